@@ -0,0 +1,203 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#include "ErosionCache.h"
+#include "ErosionSimulator.h"
+#include "HAL/FileManager.h"
+#include "Hash/CityHash.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Guid.h"
+#include "Misc/Paths.h"
+#include "Misc/ScopeLock.h"
+#include "ProceduralWorld.h"
+
+namespace
+{
+	constexpr uint32 CacheMagic = 0x434F5245; // "EROC"
+	// Increment whenever simulation changes its results for equal settings, older files are then never hit
+	constexpr uint32 CacheVersion = 2;
+	const TCHAR* const CacheExtension = TEXT(".erosion");
+	const TCHAR* const TempExtension = TEXT(".tmp");
+}
+
+FErosionCache::FErosionCache(const FString& InDirectory, int64 InSizeLimit) : Directory(InDirectory),
+                                                                             SizeLimit(InSizeLimit)
+{
+	IFileManager& FileManager = IFileManager::Get();
+	FileManager.MakeDirectory(*Directory, true);
+
+	// Leftovers of stores interrupted by a crash
+	TArray<FString> TempFiles;
+	FileManager.FindFiles(TempFiles, *Directory, TempExtension);
+	for (const FString& TempFile : TempFiles)
+	{
+		FileManager.Delete(*(Directory / TempFile), false, false, true);
+	}
+
+	// Modification time is refreshed on every hit, so it orders entries by last use across sessions
+	TArray<FString> Files;
+	FileManager.FindFiles(Files, *Directory, CacheExtension);
+	for (const FString& File : Files)
+	{
+		const FString Path = Directory / File;
+		const uint64 Key = FCString::Strtoui64(*FPaths::GetBaseFilename(File), nullptr, 16);
+
+		FEntry& Entry = Entries.Add(Key);
+		Entry.Size = FileManager.FileSize(*Path);
+		Entry.AccessTime = FileManager.GetTimeStamp(*Path);
+		TotalSize += Entry.Size;
+	}
+
+	FScopeLock ScopeLock(&Lock);
+	EvictOverLimit();
+}
+
+uint64 FErosionCache::MakeKey(const TArray<float>& HeightMap, const FErosionSolver& Solver,
+                              const FErosionContext& Context)
+{
+	uint64 Key = CityHash64(reinterpret_cast<const char*>(HeightMap.GetData()), HeightMap.Num() * sizeof(float));
+
+	HashCombineBytes(Key, CacheVersion);
+	HashCombineBytes(Key, HeightMap.Num());
+	HashCombineBytes(Key, Solver.GetSettingsHash());
+	HashCombineBytes(Key, Context.Seed);
+	HashCombineBytes(Key, Context.ChunkCoordinates.X);
+	HashCombineBytes(Key, Context.ChunkCoordinates.Y);
+
+	// Bounds are plain floats without padding
+	if (Context.Area)
+	{
+		HashCombineBytes(Key, Context.Area->Spawn);
+		HashCombineBytes(Key, Context.Area->Droplet);
+		HashCombineBytes(Key, Context.Area->Erode);
+	}
+	return Key;
+}
+
+bool FErosionCache::Load(uint64 Key, TArray<float>& HeightMap)
+{
+	{
+		FScopeLock ScopeLock(&Lock);
+		if (!Entries.Contains(Key))
+		{
+			Misses.Increment();
+			return false;
+		}
+	}
+
+	const FString Path = GetPath(Key);
+	const int64 HeightBytes = HeightMap.Num() * sizeof(float);
+	TArray<uint8> Data;
+
+	// Entry may be evicted by a concurrent Store once the lock is released, its file is gone then
+	if (!FFileHelper::LoadFileToArray(Data, *Path, FILEREAD_Silent))
+	{
+		Misses.Increment();
+		return false;
+	}
+
+	const FHeader* Header = reinterpret_cast<const FHeader*>(Data.GetData());
+	const uint8* Heights = Data.GetData() + sizeof(FHeader);
+
+	if (Data.Num() != sizeof(FHeader) + HeightBytes || Header->Magic != CacheMagic || Header->Version != CacheVersion || Header->Key != Key ||
+		Header->HeightNum != HeightMap.Num() ||
+		Header->Checksum != CityHash64(reinterpret_cast<const char*>(Heights), HeightBytes))
+	{
+		UE_LOG(LogTemp, Warning, TEXT("FErosionCache: invalid entry %s removed"), *Path);
+		Rejected.Increment();
+		Misses.Increment();
+		Remove(Key);
+		return false;
+	}
+
+	FMemory::Memcpy(HeightMap.GetData(), Heights, HeightBytes);
+	Hits.Increment();
+
+	const FDateTime Now = FDateTime::UtcNow();
+	IFileManager::Get().SetTimeStamp(*Path, Now);
+
+	FScopeLock ScopeLock(&Lock);
+	if (FEntry* Entry = Entries.Find(Key)) Entry->AccessTime = Now;
+	return true;
+}
+
+void FErosionCache::Store(uint64 Key, const TArray<float>& HeightMap)
+{
+	const int64 HeightBytes = HeightMap.Num() * sizeof(float);
+	TArray<uint8> Data;
+	Data.SetNumUninitialized(sizeof(FHeader) + HeightBytes);
+
+	FHeader Header;
+	Header.Magic = CacheMagic;
+	Header.Version = CacheVersion;
+	Header.Key = Key;
+	Header.HeightNum = HeightMap.Num();
+	Header.Checksum = CityHash64(reinterpret_cast<const char*>(HeightMap.GetData()), HeightBytes);
+	FMemory::Memcpy(Data.GetData(), &Header, sizeof(FHeader));
+	FMemory::Memcpy(Data.GetData() + sizeof(FHeader), HeightMap.GetData(), HeightBytes);
+
+	// Written under a unique name first, so a concurrent Load never reads a partial file
+	IFileManager& FileManager = IFileManager::Get();
+	const FString TempPath = Directory / FGuid::NewGuid().ToString() + TempExtension;
+
+	if (!FFileHelper::SaveArrayToFile(Data, *TempPath) ||
+		!FileManager.Move(*GetPath(Key), *TempPath, true, true, false, true))
+	{
+		UE_LOG(LogTemp, Warning, TEXT("FErosionCache: failed to store %s"), *GetPath(Key));
+		FileManager.Delete(*TempPath, false, false, true);
+		return;
+	}
+
+	FScopeLock ScopeLock(&Lock);
+	FEntry& Entry = Entries.FindOrAdd(Key);
+	TotalSize += Data.Num() - Entry.Size;
+	Entry.Size = Data.Num();
+	Entry.AccessTime = FDateTime::UtcNow();
+	EvictOverLimit();
+}
+
+void FErosionCache::SetSizeLimit(int64 InSizeLimit)
+{
+	FScopeLock ScopeLock(&Lock);
+	SizeLimit = InSizeLimit;
+	EvictOverLimit();
+}
+
+void FErosionCache::LogStats() const
+{
+	FScopeLock ScopeLock(&Lock);
+	UE_LOG(LogTemp, Warning, TEXT("FErosionCache: %d hits, %d misses, %d invalid - %d entries, %.1f of %.1f MB"),
+	       Hits.GetValue(), Misses.GetValue(), Rejected.GetValue(), Entries.Num(), TotalSize / (1024.0 * 1024.0),
+	       SizeLimit / (1024.0 * 1024.0));
+}
+
+FString FErosionCache::GetPath(uint64 Key) const
+{
+	return Directory / FString::Printf(TEXT("%016llx"), Key) + CacheExtension;
+}
+
+void FErosionCache::Remove(uint64 Key)
+{
+	IFileManager::Get().Delete(*GetPath(Key), false, false, true);
+
+	FScopeLock ScopeLock(&Lock);
+	FEntry Entry;
+	if (Entries.RemoveAndCopyValue(Key, Entry)) TotalSize -= Entry.Size;
+}
+
+void FErosionCache::EvictOverLimit()
+{
+	while (TotalSize > SizeLimit && Entries.Num())
+	{
+		// Linear search is fine, limit keeps entries in the thousands at most
+		const TPair<uint64, FEntry>* Oldest = nullptr;
+		for (const TPair<uint64, FEntry>& Pair : Entries)
+		{
+			if (!Oldest || Pair.Value.AccessTime < Oldest->Value.AccessTime) Oldest = &Pair;
+		}
+
+		const uint64 Key = Oldest->Key;
+		IFileManager::Get().Delete(*GetPath(Key), false, false, true);
+		TotalSize -= Oldest->Value.Size;
+		Entries.Remove(Key);
+	}
+}
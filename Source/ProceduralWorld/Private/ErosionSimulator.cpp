@@ -1,107 +1,650 @@
 // Fill out your copyright notice in the Description page of Project Settings.
 
 #include "ErosionSimulator.h"
+#include "ErosionCache.h"
+#include "Algo/BinarySearch.h"
+#include "Async/ParallelFor.h"
+#include "Misc/Paths.h"
+#include "ProceduralWorld.h"
 
 UErosionSimulator::UErosionSimulator()
 {
 	PrimaryComponentTick.bCanEverTick = false;
 }
 
-// Initialization function, must be called before SimulateErosion. Calculates erosion indices and weights.
+FErosionSettings UErosionSimulator::CreateSettings() const
+{
+	FErosionSettings Settings;
+
+	Settings.BorderSize = BorderSize;
+	Settings.bApplyBlur = bApplyBlur;
+	Settings.BlurKernel = BlurKernel;
+	Settings.BlurRadius = BlurRadius;
+	Settings.BaseWaterSpeed = BaseWaterSpeed;
+	Settings.Inertia = Inertia;
+	Settings.SedimentCapacityFactor = SedimentCapacityFactor;
+	Settings.MinSedimentCapacity = MinSedimentCapacity;
+	Settings.ErosionRadius = ErosionRadius;
+	Settings.ErosionSpeed = ErosionSpeed;
+	Settings.DepositionSpeed = DepositionSpeed;
+	Settings.EvaporationSpeed = EvaporationSpeed;
+	Settings.DropletLifetime = DropletLifetime;
+	Settings.IterationNumber = IterationNumber;
+	Settings.ErosionEngine = ErosionEngine;
+	Settings.ErosionTileSize = ErosionTileSize;
+	Settings.PipeStepNumber = PipeStepNumber;
+	Settings.PipeTimeStep = PipeTimeStep;
+	Settings.PipeRainAmount = PipeRainAmount;
+	Settings.PipeSedimentCapacity = PipeSedimentCapacity;
+	Settings.bMultiResolution = bMultiResolution;
+	Settings.CoarseFactor = CoarseFactor;
+	Settings.FinePassFraction = FinePassFraction;
+	Settings.SpawnDistribution = SpawnDistribution;
+	Settings.SpawnUniformShare = SpawnUniformShare;
+	Settings.bAdaptiveIterations = bAdaptiveIterations;
+	Settings.ConvergenceBatchSize = ConvergenceBatchSize;
+	Settings.ConvergenceThreshold = ConvergenceThreshold;
+	Settings.HeightLayout = HeightLayout;
+	Settings.ChunkSize = ChunkSize;
+	Settings.VertexSize = VertexSize;
+
+	return Settings;
+}
+
+// Initialization function, SimulateErosion builds a solver on every call until it is called
 void UErosionSimulator::PrecalculateIndicesAndWeights()
 {
-	// Total number of squares in a chunk
-	const int TotalMapSize = ChunkSize * ChunkSize;
-	// Number of unique vertices for a given erosion radius
-	const int VerticesNumber = ErosionRadius * ErosionRadius * 4;
+	Solver = MakeShared<FErosionSolver, ESPMode::ThreadSafe>(CreateSettings());
+	SeamlessSolver.Reset();
+
+	if (bSeamlessErosion)
+	{
+		// Blur needs final heights of neighbours, so it is applied separately once they are eroded
+		FErosionSettings SeamlessSettings = CreateSettings();
+		SeamlessSettings.ChunkSize += 2 * HaloSize;
+		SeamlessSettings.bApplyBlur = false;
+		SeamlessSolver = MakeShared<FErosionSolver, ESPMode::ThreadSafe>(SeamlessSettings);
+	}
+
+	const int64 CacheSizeLimit = static_cast<int64>(CacheSizeLimitMB) * 1024 * 1024;
+	if (!bCacheResults)
+		Cache.Reset();
+	else if (Cache)
+		Cache->SetSizeLimit(CacheSizeLimit);
+	else
+		Cache = MakeShared<FErosionCache, ESPMode::ThreadSafe>(FPaths::ProjectSavedDir() / TEXT("ErosionCache"),
+		                                                        CacheSizeLimit);
+}
+
+void UErosionSimulator::SimulateErosion(TArray<FVector>& HeightMap)
+{
+	SimulateErosion(HeightMap, [] { return false; });
+}
+
+bool UErosionSimulator::SimulateErosion(TArray<FVector>& HeightMap, TFunctionRef<bool()> ShouldCancel)
+{
+	// Solver built for this call only when none was precalculated, shared one is written only on game thread
+	const FErosionSolverPtr CallSolver = Solver
+		                                     ? Solver
+		                                     : MakeShared<FErosionSolver, ESPMode::ThreadSafe>(CreateSettings());
+
+	FErosionContext Context(ErosionSeed);
+	Context.ShouldCancel = [&ShouldCancel] { return ShouldCancel(); };
+
+	return CallSolver->SimulateErosion(HeightMap, Context);
+}
+
+void UErosionSimulator::CompareMultiResolution(const TArray<FVector>& HeightMap)
+{
+	if (HeightMap.Num() != FMath::Square(ChunkSize)) return;
+
+	FErosionSettings SingleSettings = CreateSettings();
+	SingleSettings.bMultiResolution = false;
+	FErosionSettings MultiSettings = CreateSettings();
+	MultiSettings.bMultiResolution = true;
+
+	const FErosionSolver SingleSolver(SingleSettings);
+	const FErosionSolver MultiSolver(MultiSettings);
+
+	TArray<float> Original;
+	Original.SetNumUninitialized(HeightMap.Num());
+	for (int i = 0; i < HeightMap.Num(); i++)
+	{
+		Original[i] = HeightMap[i].Z;
+	}
+	TArray<float> Single = Original;
+	TArray<float> Multi = Original;
+
+	FErosionContext SingleContext(ErosionSeed);
+	double StartTime = FPlatformTime::Seconds();
+	SingleSolver.SimulateErosion(Single, SingleContext);
+	const double SingleSeconds = FPlatformTime::Seconds() - StartTime;
+
+	FErosionContext MultiContext(ErosionSeed);
+	StartTime = FPlatformTime::Seconds();
+	MultiSolver.SimulateErosion(Multi, MultiContext);
+	const double MultiSeconds = FPlatformTime::Seconds() - StartTime;
+
+	// Droplet paths differ between the two, so height changes are compared as whole instead of vertex by vertex
+	double SingleVolume = 0.0, MultiVolume = 0.0;
+	double SingleSquares = 0.0, MultiSquares = 0.0, Products = 0.0;
+	double ErrorSquares = 0.0;
+	for (int i = 0; i < Original.Num(); i++)
+	{
+		const double SingleDelta = Single[i] - Original[i];
+		const double MultiDelta = Multi[i] - Original[i];
+
+		SingleVolume += FMath::Abs(SingleDelta);
+		MultiVolume += FMath::Abs(MultiDelta);
+		SingleSquares += SingleDelta * SingleDelta;
+		MultiSquares += MultiDelta * MultiDelta;
+		Products += SingleDelta * MultiDelta;
+		ErrorSquares += FMath::Square(Multi[i] - Single[i]);
+	}
+
+	const double Correlation = SingleSquares > 0.0 && MultiSquares > 0.0
+		                           ? Products / FMath::Sqrt(SingleSquares * MultiSquares)
+		                           : 0.0;
+	const double RelativeError = SingleSquares > 0.0 ? FMath::Sqrt(ErrorSquares / SingleSquares) : 0.0;
+
+	UE_LOG(LogTemp, Warning, TEXT("CompareMultiResolution: single %.2f ms, multi %.2f ms, speedup %.2fx"),
+	       SingleSeconds * 1000.0, MultiSeconds * 1000.0, MultiSeconds > 0.0 ? SingleSeconds / MultiSeconds : 0.0);
+	UE_LOG(LogTemp, Warning,
+	       TEXT("CompareMultiResolution: moved height ratio %.3f, height change correlation %.3f, relative RMS error %.3f"),
+	       SingleVolume > 0.0 ? MultiVolume / SingleVolume : 0.0, Correlation, RelativeError);
+}
+
+/* Hardware counters are not available in engine, cache misses are estimated by distinct 64 byte lines an interior
+ * droplet step touches, its brush and bilinear square, averaged over every vertex brush fits around.
+ */
+void UErosionSimulator::BenchmarkHeightLayouts(const TArray<FVector>& HeightMap)
+{
+	if (HeightMap.Num() != FMath::Square(ChunkSize)) return;
+
+	constexpr int FloatsPerLine = 64 / sizeof(float);
+	const EErosionHeightLayout Layouts[] = {
+		EErosionHeightLayout::RowMajor, EErosionHeightLayout::Tiled, EErosionHeightLayout::Morton
+	};
+
+	TArray<float> Original;
+	Original.SetNumUninitialized(HeightMap.Num());
+	for (int i = 0; i < HeightMap.Num(); i++)
+	{
+		Original[i] = HeightMap[i].Z;
+	}
+	TArray<float> Reference;
+
+	for (const EErosionHeightLayout Layout : Layouts)
+	{
+		// Only droplets on the full plane are measured
+		FErosionSettings LayoutSettings = CreateSettings();
+		LayoutSettings.HeightLayout = Layout;
+		LayoutSettings.bMultiResolution = false;
+		LayoutSettings.bAdaptiveIterations = false;
+		if (LayoutSettings.ErosionEngine != EErosionEngine::TiledDroplet)
+			LayoutSettings.ErosionEngine = EErosionEngine::Droplet;
+
+		const FErosionSolver LayoutSolver(LayoutSettings);
+		TArray<float> Heights = Original;
+		FErosionContext Context(ErosionSeed);
+
+		const double StartTime = FPlatformTime::Seconds();
+		LayoutSolver.SimulateErosion(Heights, Context);
+		const double Seconds = FPlatformTime::Seconds() - StartTime;
+
+		FErosionHeightLayout LayoutMap;
+		LayoutMap.Initialize(Layout, ChunkSize);
+		TArray<int> Lines;
+		int64 LineSum = 0;
+		int StepNum = 0;
+
+		for (int y = ErosionRadius; y < ChunkSize - ErosionRadius - 1; y++)
+		{
+			for (int x = ErosionRadius; x < ChunkSize - ErosionRadius - 1; x++)
+			{
+				Lines.Reset();
+				for (int OffsetY = -ErosionRadius; OffsetY <= ErosionRadius; OffsetY++)
+				{
+					for (int OffsetX = -ErosionRadius; OffsetX <= ErosionRadius; OffsetX++)
+					{
+						const bool bSquare = OffsetX >= 0 && OffsetX <= 1 && OffsetY >= 0 && OffsetY <= 1;
+						if (bSquare || FMath::Square(OffsetX) + FMath::Square(OffsetY) < FMath::Square(ErosionRadius))
+							Lines.AddUnique(LayoutMap.GetIndex(x + OffsetX, y + OffsetY) / FloatsPerLine);
+					}
+				}
+				LineSum += Lines.Num();
+				StepNum++;
+			}
+		}
+
+		float MaxDifference = 0.f;
+		if (!Reference.Num()) Reference = Heights;
+		for (int i = 0; i < Heights.Num(); i++)
+		{
+			MaxDifference = FMath::Max(MaxDifference, FMath::Abs(Heights[i] - Reference[i]));
+		}
+
+		UE_LOG(LogTemp, Warning,
+		       TEXT("BenchmarkHeightLayouts: %s - %.2f ms, %.2f ns per droplet step, %.1f cache lines per step, "
+			       "max difference to row-major %f"),
+		       *StaticEnum<EErosionHeightLayout>()->GetNameStringByValue(static_cast<int64>(Layout)),
+		       Seconds * 1000.0, Context.DropletSteps ? Seconds * 1e9 / Context.DropletSteps : 0.0,
+		       StepNum ? static_cast<double>(LineSum) / StepNum : 0.0, MaxDifference);
+	}
+}
+
+// Calculates one brush variant per edge clipping case, in the same tap order as a per vertex table would use
+void FErosionBrush::Initialize(int InRadius, int InPlaneSize)
+{
+	Radius = InRadius;
+	PlaneSize = InPlaneSize;
+	ClassNum = 2 * Radius + 1;
+
+	checkf(Radius <= MAX_int8 && (Radius + 1) * PlaneSize <= MAX_int16, TEXT("Erosion brush offsets do not fit"));
 
 	TArray<FIntPoint> VertexOffsets;
 	TArray<float> VertexWeights;
 
-	ErosionIndicesMap.Reserve(TotalMapSize);
-	ErosionWeightsMap.Reserve(TotalMapSize);
-	VertexOffsets.Reserve(VerticesNumber);
-	VertexWeights.Reserve(VerticesNumber);
+	Taps.Reset();
+	VariantStarts.Reset(FMath::Square(ClassNum) + 1);
+	VertexOffsets.Reserve(FMath::Square(ClassNum));
+	VertexWeights.Reserve(FMath::Square(ClassNum));
 
-	// Loop over every vertex on map
-	for (int i = 0; i < TotalMapSize; i++)
+	for (int ClassY = 0; ClassY < ClassNum; ClassY++)
 	{
-		const int ErosionCentreX = i % ChunkSize;
-		const int ErosionCentreY = i / ChunkSize;
+		for (int ClassX = 0; ClassX < ClassNum; ClassX++)
+		{
+			// Representative vertex of the class, only its distance to edges matters
+			const int ErosionCentreX = ClassX < Radius ? ClassX : ClassX == Radius ? Radius : PlaneSize - 1 - (2 * Radius - ClassX);
+			const int ErosionCentreY = ClassY < Radius ? ClassY : ClassY == Radius ? Radius : PlaneSize - 1 - (2 * Radius - ClassY);
 
-		float WeightedSum = 0.f;
+			float WeightedSum = 0.f;
 
-		for (int y = ErosionCentreY - ErosionRadius; y <= ErosionCentreY + ErosionRadius; y++)
-		{
-			for (int x = ErosionCentreX - ErosionRadius; x <= ErosionCentreX + ErosionRadius; x++)
+			for (int y = ErosionCentreY - Radius; y <= ErosionCentreY + Radius; y++)
 			{
-				const float DistanceX = ErosionCentreX - x, DistanceY = ErosionCentreY - y;
-				const float DistanceWeight = FMath::Max(
-					0.f, 1 - FMath::Sqrt(DistanceX * DistanceX + DistanceY * DistanceY) / ErosionRadius
-				);
+				for (int x = ErosionCentreX - Radius; x <= ErosionCentreX + Radius; x++)
+				{
+					const float DistanceX = ErosionCentreX - x, DistanceY = ErosionCentreY - y;
+					const float DistanceWeight = FMath::Max(
+						0.f, 1 - FMath::Sqrt(DistanceX * DistanceX + DistanceY * DistanceY) / Radius
+					);
 
-				if (x < 0 || x > ChunkSize - 1 || y < 0 || y > ChunkSize - 1 || DistanceWeight == 0.f)
-					continue;
+					if (x < 0 || x > PlaneSize - 1 || y < 0 || y > PlaneSize - 1 || DistanceWeight == 0.f)
+						continue;
 
-				VertexOffsets.Add(FIntPoint(x, y));
-				VertexWeights.Add(DistanceWeight);
-				WeightedSum += DistanceWeight;
+					VertexOffsets.Add(FIntPoint(x - ErosionCentreX, y - ErosionCentreY));
+					VertexWeights.Add(DistanceWeight);
+					WeightedSum += DistanceWeight;
+				}
 			}
+
+			VariantStarts.Add(Taps.Num());
+
+			for (int j = 0; j < VertexOffsets.Num(); j++)
+			{
+				FTap& Tap = Taps.AddDefaulted_GetRef();
+				Tap.Offset = VertexOffsets[j].X + VertexOffsets[j].Y * PlaneSize;
+				Tap.OffsetX = VertexOffsets[j].X;
+				Tap.OffsetY = VertexOffsets[j].Y;
+				Tap.Weight = VertexWeights[j] / WeightedSum;
+			}
+
+			VertexOffsets.Reset();
+			VertexWeights.Reset();
+		}
+	}
+
+	VariantStarts.Add(Taps.Num());
+	Taps.Shrink();
+}
+
+namespace
+{
+	// Coarse plane keeps every CoarseFactor-th vertex, droplets cover the same distance and area in world units
+	FErosionSettings CreateCoarseSettings(const FErosionSettings& Settings)
+	{
+		const int Factor = Settings.CoarseFactor;
+		// Fine pass takes its part of the budget
+		const float CoarseFraction = 1.f - Settings.FinePassFraction;
+		FErosionSettings Coarse = Settings;
+
+		Coarse.bMultiResolution = false;
+		Coarse.bApplyBlur = false;
+		Coarse.ChunkSize = (Settings.ChunkSize - 1) / Factor + 1;
+		Coarse.VertexSize = Settings.VertexSize * Factor;
+		Coarse.BorderSize = FMath::DivideAndRoundUp(Settings.BorderSize, Factor);
+		Coarse.ErosionRadius = FMath::Max(FMath::RoundToInt(static_cast<float>(Settings.ErosionRadius) / Factor), 2);
+		Coarse.DropletLifetime = FMath::Max(Settings.DropletLifetime / Factor, 1);
+		Coarse.IterationNumber = FMath::Max(
+			FMath::RoundToInt(CoarseFraction * Settings.IterationNumber / FMath::Square(Factor)), 1);
+		Coarse.ErosionTileSize = FMath::Max(Settings.ErosionTileSize / Factor, 2 * Coarse.ErosionRadius + 2);
+		Coarse.ConvergenceBatchSize = FMath::Max(Settings.ConvergenceBatchSize / FMath::Square(Factor), 1);
+		// Pipe model works in world units, water covers the same distance per step on both planes
+		Coarse.PipeStepNumber = FMath::Max(FMath::RoundToInt(CoarseFraction * Settings.PipeStepNumber), 1);
+		return Coarse;
+	}
+
+	// Every field separately, struct padding is undefined
+	uint64 HashSettings(const FErosionSettings& Settings)
+	{
+		uint64 Hash = 0;
+
+		HashCombineBytes(Hash, Settings.BorderSize);
+		HashCombineBytes(Hash, Settings.bApplyBlur);
+		HashCombineBytes(Hash, Settings.BlurKernel);
+		HashCombineBytes(Hash, Settings.BlurRadius);
+		HashCombineBytes(Hash, Settings.BaseWaterSpeed);
+		HashCombineBytes(Hash, Settings.Inertia);
+		HashCombineBytes(Hash, Settings.SedimentCapacityFactor);
+		HashCombineBytes(Hash, Settings.MinSedimentCapacity);
+		HashCombineBytes(Hash, Settings.ErosionRadius);
+		HashCombineBytes(Hash, Settings.ErosionSpeed);
+		HashCombineBytes(Hash, Settings.DepositionSpeed);
+		HashCombineBytes(Hash, Settings.EvaporationSpeed);
+		HashCombineBytes(Hash, Settings.DropletLifetime);
+		HashCombineBytes(Hash, Settings.IterationNumber);
+		HashCombineBytes(Hash, Settings.ErosionEngine);
+		HashCombineBytes(Hash, Settings.ErosionTileSize);
+		HashCombineBytes(Hash, Settings.PipeStepNumber);
+		HashCombineBytes(Hash, Settings.PipeTimeStep);
+		HashCombineBytes(Hash, Settings.PipeRainAmount);
+		HashCombineBytes(Hash, Settings.PipeSedimentCapacity);
+		HashCombineBytes(Hash, Settings.bMultiResolution);
+		HashCombineBytes(Hash, Settings.CoarseFactor);
+		HashCombineBytes(Hash, Settings.FinePassFraction);
+		HashCombineBytes(Hash, Settings.SpawnDistribution);
+		HashCombineBytes(Hash, Settings.SpawnUniformShare);
+		HashCombineBytes(Hash, Settings.bAdaptiveIterations);
+		HashCombineBytes(Hash, Settings.ConvergenceBatchSize);
+		HashCombineBytes(Hash, Settings.ConvergenceThreshold);
+		// Height layout changes only memory order, results are equal
+		HashCombineBytes(Hash, Settings.ChunkSize);
+		HashCombineBytes(Hash, Settings.VertexSize);
+		return Hash;
+	}
+
+	// Vertex index in row-major plane, brush taps use precalculated offsets
+	struct FRowMajorIndexer
+	{
+		int PlaneSize;
+
+		FORCEINLINE int GetIndex(int X, int Y) const { return X + Y * PlaneSize; }
+
+		FORCEINLINE int GetTapIndex(int Index, int, int, const FErosionBrush::FTap& Tap) const
+		{
+			return Index + Tap.Offset;
+		}
+
+		// North-west, north-east, south-west and south-east vertex of square
+		FORCEINLINE void GetSquare(int X, int Y, int (&Indices)[4]) const
+		{
+			Indices[0] = GetIndex(X, Y);
+			Indices[1] = Indices[0] + 1;
+			Indices[2] = Indices[0] + PlaneSize;
+			Indices[3] = Indices[2] + 1;
+		}
+	};
+
+	// Vertex index in plane of any FErosionHeightLayout
+	struct FLayoutIndexer
+	{
+		const int* ColumnOffsets;
+		const int* RowOffsets;
+
+		FORCEINLINE int GetIndex(int X, int Y) const { return ColumnOffsets[X] + RowOffsets[Y]; }
+
+		FORCEINLINE int GetTapIndex(int, int X, int Y, const FErosionBrush::FTap& Tap) const
+		{
+			return GetIndex(X + Tap.OffsetX, Y + Tap.OffsetY);
+		}
+
+		FORCEINLINE void GetSquare(int X, int Y, int (&Indices)[4]) const
+		{
+			Indices[0] = ColumnOffsets[X] + RowOffsets[Y];
+			Indices[1] = ColumnOffsets[X + 1] + RowOffsets[Y];
+			Indices[2] = ColumnOffsets[X] + RowOffsets[Y + 1];
+			Indices[3] = ColumnOffsets[X + 1] + RowOffsets[Y + 1];
+		}
+	};
+
+	// Places bits of value at even positions, Z-order index is then X bits or Y bits shifted by one
+	int SpreadBits(int Value)
+	{
+		int Spread = 0;
+		for (int Bit = 0; Value >> Bit; Bit++)
+		{
+			Spread |= (Value >> Bit & 1) << 2 * Bit;
+		}
+		return Spread;
+	}
+
+	FErosionBounds ScaleBounds(const FErosionBounds& Bounds, float Scale)
+	{
+		FErosionBounds Scaled;
+		Scaled.MinX = Bounds.MinX * Scale;
+		Scaled.MinY = Bounds.MinY * Scale;
+		Scaled.MaxX = Bounds.MaxX * Scale;
+		Scaled.MaxY = Bounds.MaxY * Scale;
+		return Scaled;
+	}
+}
+
+void FErosionHeightLayout::Initialize(EErosionHeightLayout InLayout, int InPlaneSize)
+{
+	Layout = InLayout;
+	PlaneSize = InPlaneSize;
+
+	const int BlockNum = FMath::DivideAndRoundUp(PlaneSize, BlockSize);
+	const int BlockArea = BlockSize * BlockSize;
+	Num = Layout == EErosionHeightLayout::RowMajor ? FMath::Square(PlaneSize) : FMath::Square(BlockNum) * BlockArea;
+
+	ColumnOffsets.SetNumUninitialized(PlaneSize);
+	RowOffsets.SetNumUninitialized(PlaneSize);
+
+	for (int i = 0; i < PlaneSize; i++)
+	{
+		const int Block = i / BlockSize;
+		const int Local = i % BlockSize;
+
+		switch (Layout)
+		{
+		case EErosionHeightLayout::Tiled:
+			ColumnOffsets[i] = Block * BlockArea + Local;
+			RowOffsets[i] = Block * BlockNum * BlockArea + Local * BlockSize;
+			break;
+		case EErosionHeightLayout::Morton:
+			ColumnOffsets[i] = Block * BlockArea + SpreadBits(Local);
+			RowOffsets[i] = Block * BlockNum * BlockArea + (SpreadBits(Local) << 1);
+			break;
+		default:
+			ColumnOffsets[i] = i;
+			RowOffsets[i] = i * PlaneSize;
 		}
+	}
+}
 
-		ErosionIndicesMap.AddDefaulted();
-		ErosionIndicesMap[i].Init(0, VertexOffsets.Num());
+void FErosionHeightLayout::FromRowMajor(const float* Source, float* Destination) const
+{
+	if (Layout == EErosionHeightLayout::RowMajor)
+	{
+		FMemory::Memcpy(Destination, Source, Num * sizeof(float));
+		return;
+	}
 
-		ErosionWeightsMap.AddDefaulted();
-		ErosionWeightsMap[i].Init(0.f, VertexOffsets.Num());
+	for (int y = 0; y < PlaneSize; y++)
+	{
+		const float* SourceRow = Source + y * PlaneSize;
+		float* DestinationRow = Destination + RowOffsets[y];
 
-		for (int j = 0; j < VertexOffsets.Num(); j++)
+		for (int x = 0; x < PlaneSize; x++)
 		{
-			ErosionIndicesMap[i][j] = VertexOffsets[j].X + VertexOffsets[j].Y * ChunkSize;
-			ErosionWeightsMap[i][j] = VertexWeights[j] / WeightedSum;
+			DestinationRow[ColumnOffsets[x]] = SourceRow[x];
 		}
+	}
+}
+
+void FErosionHeightLayout::ToRowMajor(const float* Source, float* Destination) const
+{
+	if (Layout == EErosionHeightLayout::RowMajor)
+	{
+		FMemory::Memcpy(Destination, Source, Num * sizeof(float));
+		return;
+	}
+
+	for (int y = 0; y < PlaneSize; y++)
+	{
+		const float* SourceRow = Source + RowOffsets[y];
+		float* DestinationRow = Destination + y * PlaneSize;
 
-		VertexOffsets.Reset();
-		VertexWeights.Reset();
+		for (int x = 0; x < PlaneSize; x++)
+		{
+			DestinationRow[x] = SourceRow[ColumnOffsets[x]];
+		}
 	}
 }
 
-// Applies blur using mean filter
-void UErosionSimulator::GaussianBlur(TArray<FVector>& HeightMap)
+FErosionSolver::FErosionSolver(const FErosionSettings& InSettings) : Settings(InSettings),
+                                                                      SettingsHash(HashSettings(InSettings))
 {
-	// Total number of squares in map
-	const int TotalMapSize = ChunkSize * ChunkSize;
-	const TArray<FVector> HeightMapCopy = HeightMap;
+	FineIterationNumber = Settings.IterationNumber;
+	FinePipeStepNumber = Settings.PipeStepNumber;
 
-	// Loop over every vertex on map
-	for (int CombinedIndex = 0; CombinedIndex < TotalMapSize; CombinedIndex++)
+	if (Settings.bMultiResolution && Settings.CoarseFactor > 1)
 	{
-		const int IndexX = CombinedIndex % ChunkSize;
-		const int IndexY = CombinedIndex / ChunkSize;
-		float NewValue = 0.f;
+		CoarseSolver = MakeUnique<const FErosionSolver>(CreateCoarseSettings(Settings));
+
+		// Coarse pass carves the large features, fine pass only restores detail
+		FineIterationNumber = FMath::Max(FMath::RoundToInt(Settings.IterationNumber * Settings.FinePassFraction), 1);
+		FinePipeStepNumber = FMath::Max(FMath::RoundToInt(Settings.PipeStepNumber * Settings.FinePassFraction), 1);
+	}
+
+	Brush.Initialize(Settings.ErosionRadius, Settings.ChunkSize);
+	HeightLayout.Initialize(Settings.HeightLayout, Settings.ChunkSize);
 
-		for (int y = IndexY - 1; y <= IndexY + 1; y++)
+	const int BlurRadius = Settings.BlurRadius;
+	const float Sigma = FMath::Max(BlurRadius / 3.f, 0.5f);
+	float WeightSum = 0.f;
+
+	BlurWeights.SetNumUninitialized(2 * BlurRadius + 1);
+	for (int i = -BlurRadius; i <= BlurRadius; i++)
+	{
+		const float Weight = Settings.BlurKernel == EErosionBlurKernel::Gaussian
+			                     ? FMath::Exp(-FMath::Square(i) / (2 * FMath::Square(Sigma)))
+			                     : 1.f;
+		BlurWeights[i + BlurRadius] = Weight;
+		WeightSum += Weight;
+	}
+	for (float& Weight : BlurWeights)
+	{
+		Weight /= WeightSum;
+	}
+}
+
+SIZE_T FErosionSolver::GetAllocatedSize() const
+{
+	return Brush.GetAllocatedSize() + HeightLayout.GetAllocatedSize() + BlurWeights.GetAllocatedSize() +
+		(CoarseSolver ? CoarseSolver->GetAllocatedSize() : 0);
+}
+
+void FErosionSolver::BlurHeights(TArray<float>& HeightPlane, int PlaneSize) const
+{
+	check(HeightPlane.Num() == PlaneSize * PlaneSize);
+
+	SeparableBlur(HeightPlane.GetData(), PlaneSize);
+}
+
+/* Separable blur, rows first and columns second. Plane edges are extended by repeating edge vertices, so taps
+ * never branch. Row pass reads from a padded copy of the current row, column pass from a ring of source rows
+ * around the current one, so no full copy of the plane is needed. Both passes add whole vectors of vertices.
+ */
+void FErosionSolver::SeparableBlur(float* HeightMap, int PlaneSize) const
+{
+	const int Radius = BlurWeights.Num() / 2;
+	const int TapNum = BlurWeights.Num();
+	const float* Weights = BlurWeights.GetData();
+
+	TArray<float> Buffer;
+	Buffer.SetNumUninitialized(PlaneSize + 2 * Radius + TapNum * PlaneSize);
+	float* Line = Buffer.GetData();
+	float* Ring = Line + PlaneSize + 2 * Radius;
+	// Blur radius is clamped to 8
+	const float* Sources[2 * 8 + 1];
+	check(TapNum <= UE_ARRAY_COUNT(Sources));
+
+	// Output = sum of weighted sources, vertex by vertex
+	const auto Convolve = [PlaneSize, TapNum, Weights, &Sources](float* Output)
+	{
+		int x = 0;
+		for (; x + 4 <= PlaneSize; x += 4)
 		{
-			for (int x = IndexX - 1; x <= IndexX + 1; x++)
+			VectorRegister Sum = VectorZero();
+			for (int Tap = 0; Tap < TapNum; Tap++)
 			{
-				// Using regular box blur
-				if (x < 0 || x > ChunkSize - 1 || y < 0 || y > ChunkSize - 1)
-				{
-					NewValue += HeightMapCopy[CombinedIndex].Z;
-					continue;
-				}
-				NewValue += HeightMapCopy[x + y * ChunkSize].Z;
+				Sum = VectorMultiplyAdd(VectorLoad(Sources[Tap] + x), VectorSetFloat1(Weights[Tap]), Sum);
+			}
+			VectorStore(Sum, Output + x);
+		}
+		for (; x < PlaneSize; x++)
+		{
+			float Sum = 0.f;
+			for (int Tap = 0; Tap < TapNum; Tap++)
+			{
+				Sum += Sources[Tap][x] * Weights[Tap];
 			}
+			Output[x] = Sum;
 		}
-		HeightMap[CombinedIndex].Z = NewValue / 9.f;
+	};
+
+	for (int Tap = 0; Tap < TapNum; Tap++)
+	{
+		Sources[Tap] = Line + Tap;
+	}
+
+	for (int y = 0; y < PlaneSize; y++)
+	{
+		float* Row = HeightMap + y * PlaneSize;
+
+		for (int i = 0; i < Radius; i++)
+		{
+			Line[i] = Row[0];
+			Line[Radius + PlaneSize + i] = Row[PlaneSize - 1];
+		}
+		FMemory::Memcpy(Line + Radius, Row, PlaneSize * sizeof(float));
+		Convolve(Row);
+	}
+
+	// Ring slot of source row, rows outside of the plane repeat the edge row
+	const auto LoadRow = [&](int y)
+	{
+		const int SourceRow = FMath::Clamp(y, 0, PlaneSize - 1);
+		FMemory::Memcpy(Ring + (y + Radius) % TapNum * PlaneSize, HeightMap + SourceRow * PlaneSize,
+		                PlaneSize * sizeof(float));
+	};
+
+	for (int y = -Radius; y < Radius; y++)
+	{
+		LoadRow(y);
+	}
+
+	for (int y = 0; y < PlaneSize; y++)
+	{
+		// Row below the window is not overwritten yet
+		LoadRow(y + Radius);
+
+		for (int Tap = 0; Tap < TapNum; Tap++)
+		{
+			Sources[Tap] = Ring + (y + Tap) % TapNum * PlaneSize;
+		}
+		Convolve(HeightMap + y * PlaneSize);
 	}
 }
 
 // Calculates gradient and height of current point inside vertex square
-FGradientAndHeight* UErosionSimulator::CalculateGradientAndHeight(TArray<FVector>& HeightMap, float RealPositionX,
-                                                                  float RealPositionY)
+template <typename TIndexer>
+FGradientAndHeight FErosionSolver::CalculateGradientAndHeight(const float* HeightMap, const TIndexer& Indexer,
+                                                              float RealPositionX, float RealPositionY) const
 {
-	FGradientAndHeight* GradientAndHeight = new FGradientAndHeight;
+	FGradientAndHeight GradientAndHeight;
 	const int IndexPositionX = RealPositionX;
 	const int IndexPositionY = RealPositionY;
 
@@ -109,122 +652,1143 @@ FGradientAndHeight* UErosionSimulator::CalculateGradientAndHeight(TArray<FVector
 	const float SquareOffsetY = RealPositionY - IndexPositionY;
 
 	// Get square vertices heights
-	const int CombinedIndexPosition = IndexPositionX + IndexPositionY * ChunkSize;
-	const float HeightNW = HeightMap[CombinedIndexPosition].Z;
-	const float HeightNE = HeightMap[CombinedIndexPosition + 1].Z;
-	const float HeightSW = HeightMap[CombinedIndexPosition + ChunkSize].Z;
-	const float HeightSE = HeightMap[CombinedIndexPosition + 1 + ChunkSize].Z;
+	int Square[4];
+	Indexer.GetSquare(IndexPositionX, IndexPositionY, Square);
+	const float HeightNW = HeightMap[Square[0]];
+	const float HeightNE = HeightMap[Square[1]];
+	const float HeightSW = HeightMap[Square[2]];
+	const float HeightSE = HeightMap[Square[3]];
 
-	GradientAndHeight->GradientX = (HeightNE - HeightNW) * (1 - SquareOffsetY) + (HeightSE - HeightSW) * SquareOffsetY;
-	GradientAndHeight->GradientY = (HeightSW - HeightNW) * (1 - SquareOffsetX) + (HeightSE - HeightNE) * SquareOffsetX;
+	GradientAndHeight.GradientX = (HeightNE - HeightNW) * (1 - SquareOffsetY) + (HeightSE - HeightSW) * SquareOffsetY;
+	GradientAndHeight.GradientY = (HeightSW - HeightNW) * (1 - SquareOffsetX) + (HeightSE - HeightNE) * SquareOffsetX;
 
-	GradientAndHeight->Height = HeightNW * (1 - SquareOffsetX) * (1 - SquareOffsetY) + HeightNE * SquareOffsetX * (1 -
+	GradientAndHeight.Height = HeightNW * (1 - SquareOffsetX) * (1 - SquareOffsetY) + HeightNE * SquareOffsetX * (1 -
 		SquareOffsetY) + HeightSW * (1 - SquareOffsetX) * SquareOffsetY + HeightSE * SquareOffsetX * SquareOffsetY;
 
 	return GradientAndHeight;
 }
 
 // Deposits water droplet sediment based on parameters
-void UErosionSimulator::DepositSediment(TArray<FVector>& HeightMap, int CombinedIndexPosition, float HeightDelta,
-                                        float& Sediment, float SedimentCapacity)
+template <typename TIndexer>
+void FErosionSolver::DepositSediment(float* HeightMap, const TIndexer& Indexer, int IndexPositionX,
+                                     int IndexPositionY, float HeightDelta, float& Sediment, float SedimentCapacity,
+                                     float Scale) const
 {
 	const float DepositAmount = HeightDelta < 0
 		                            ? FMath::Min(-HeightDelta, Sediment)
-		                            : (Sediment - SedimentCapacity) * DepositionSpeed;
+		                            : (Sediment - SedimentCapacity) * Settings.DepositionSpeed;
 	Sediment -= DepositAmount;
 
-	HeightMap[CombinedIndexPosition].Z += DepositAmount * 0.25f;
-	HeightMap[CombinedIndexPosition + 1].Z += DepositAmount * 0.25f;
-	HeightMap[CombinedIndexPosition + ChunkSize].Z += DepositAmount * 0.25f;
-	HeightMap[CombinedIndexPosition + 1 + ChunkSize].Z += DepositAmount * 0.25f;
+	int Square[4];
+	Indexer.GetSquare(IndexPositionX, IndexPositionY, Square);
+
+	const float VertexDeposit = DepositAmount * 0.25f * Scale;
+	HeightMap[Square[0]] += VertexDeposit;
+	HeightMap[Square[1]] += VertexDeposit;
+	HeightMap[Square[2]] += VertexDeposit;
+	HeightMap[Square[3]] += VertexDeposit;
 }
 
 // Erodes terrain and gathers sediment to droplet
-void UErosionSimulator::ErodeTerrain(TArray<FVector>& HeightMap, int CombinedIndexPosition, float HeightDelta,
-                                     float& Sediment, float SedimentCapacity)
+template <typename TIndexer>
+void FErosionSolver::ErodeTerrain(float* HeightMap, const TIndexer& Indexer, int CentreX, int CentreY,
+                                  float HeightDelta, float& Sediment, float SedimentCapacity, float Scale,
+                                  const FErosionBounds& ErodeBounds) const
 {
-	const float ErosionAmount = FMath::Min((SedimentCapacity - Sediment) * ErosionSpeed, HeightDelta);
+	const float ErosionAmount = FMath::Min((SedimentCapacity - Sediment) * Settings.ErosionSpeed, HeightDelta);
+	const int CentreIndex = Indexer.GetIndex(CentreX, CentreY);
 
-	// Uses precalculated vertices for each vertex on the map
-	for (int i = 0; i < ErosionIndicesMap[CombinedIndexPosition].Num(); i++)
+	// Uses shared brush, picking edge variant for vertices close to plane edge
+	for (const FErosionBrush::FTap& Tap : Brush.GetTaps(CentreX, CentreY))
 	{
-		const int ErodedVertex = ErosionIndicesMap[CombinedIndexPosition][i];
+		const int ErodedVertexX = CentreX + Tap.OffsetX;
+		const int ErodedVertexY = CentreY + Tap.OffsetY;
 
 		// Applies boundaries to each map chunk in order to keep seams between them
-		if (ErodedVertex / ChunkSize < BorderSize || ErodedVertex / ChunkSize > ChunkSize - (BorderSize + 1) ||
-			ErodedVertex % ChunkSize < BorderSize || ErodedVertex % ChunkSize > ChunkSize - (BorderSize + 1))
+		if (ErodedVertexY < ErodeBounds.MinY || ErodedVertexY > ErodeBounds.MaxY ||
+			ErodedVertexX < ErodeBounds.MinX || ErodedVertexX > ErodeBounds.MaxX)
 			continue;
 
-		const float WeightedErosionAmount = ErosionAmount * ErosionWeightsMap[CombinedIndexPosition][i];
+		const float WeightedErosionAmount = ErosionAmount * Tap.Weight;
 		const float SedimentDelta = WeightedErosionAmount;
 
-		HeightMap[ErodedVertex].Z -= SedimentDelta;
+		HeightMap[Indexer.GetTapIndex(CentreIndex, CentreX, CentreY, Tap)] -= SedimentDelta * Scale;
 		Sediment += SedimentDelta;
 	}
 }
 
-// Main function, responsible for simulating droplet erosion
-void UErosionSimulator::SimulateErosion(TArray<FVector>& HeightMap)
+bool FErosionSolver::SimulateErosion(TArray<FVector>& HeightMap, FErosionContext& Context) const
+{
+	TArray<float> HeightPlane;
+	HeightPlane.SetNumUninitialized(HeightMap.Num());
+
+	for (int i = 0; i < HeightMap.Num(); i++)
+	{
+		HeightPlane[i] = HeightMap[i].Z;
+	}
+
+	const bool bCompleted = SimulateErosion(HeightPlane, Context);
+
+	for (int i = 0; i < HeightMap.Num(); i++)
+	{
+		HeightMap[i].Z = HeightPlane[i];
+	}
+	return bCompleted;
+}
+
+// Simulates single droplet from its spawn position until it evaporates or leaves bounds, returns steps it took
+template <typename TIndexer>
+int FErosionSolver::SimulateDroplet(float* HeightMap, const TIndexer& Indexer, const FErosionSpawn& Spawn,
+                                    const FErosionBounds& Bounds, const FErosionBounds& ErodeBounds) const
+{
+	const float Inertia = Settings.Inertia;
+
+	float RealPositionX = Spawn.X;
+	float RealPositionY = Spawn.Y;
+	float DirectionX = 0.f;
+	float DirectionY = 0.f;
+	float Speed = Settings.BaseWaterSpeed;
+	float Water = 1.f;
+	float Sediment = 0.f;
+
+	int DropletLifeIndex = 0;
+	for (; DropletLifeIndex < Settings.DropletLifetime; DropletLifeIndex++)
+	{
+		const int IndexPositionX = RealPositionX;
+		const int IndexPositionY = RealPositionY;
+
+		const FGradientAndHeight CurrentGradientAndHeight = CalculateGradientAndHeight(
+			HeightMap, Indexer, RealPositionX, RealPositionY
+		);
+
+		// Calculate direction of fastest descent
+		DirectionX = DirectionX * Inertia - CurrentGradientAndHeight.GradientX * (1 - Inertia);
+		DirectionY = DirectionY * Inertia - CurrentGradientAndHeight.GradientY * (1 - Inertia);
+
+		// Normalize droplet direction
+		const float CombinedDirection = FMath::Max(
+			0.01f, FMath::Sqrt(DirectionX * DirectionX + DirectionY * DirectionY));
+		DirectionX /= CombinedDirection;
+		DirectionY /= CombinedDirection;
+
+		RealPositionX += DirectionX;
+		RealPositionY += DirectionY;
+
+		// Check if droplet stopped in a pit or flowed out of its bounds (chunk border or tile area)
+		if (DirectionX == 0.f && DirectionY == 0.f || (RealPositionX < Bounds.MinX || RealPositionX > Bounds.MaxX ||
+			RealPositionY < Bounds.MinY || RealPositionY > Bounds.MaxY))
+			break;
+
+		// Recalculate height at new position
+		const FGradientAndHeight NewGradientAndHeight = CalculateGradientAndHeight(
+			HeightMap, Indexer, RealPositionX, RealPositionY);
+
+		const float HeightDelta = CurrentGradientAndHeight.Height - NewGradientAndHeight.Height;
+
+		const float SedimentCapacity = FMath::Max(HeightDelta, Settings.MinSedimentCapacity) * Speed *
+			Water * Settings.SedimentCapacityFactor;
+
+		if (Sediment > SedimentCapacity || HeightDelta < 0)
+			DepositSediment(HeightMap, Indexer, IndexPositionX, IndexPositionY, HeightDelta, Sediment,
+			                SedimentCapacity, Spawn.Scale);
+		else
+			ErodeTerrain(HeightMap, Indexer, IndexPositionX, IndexPositionY, HeightDelta, Sediment, SedimentCapacity,
+			             Spawn.Scale, ErodeBounds);
+
+		// Calculate droplet speed as an approximation based on slope
+		Speed = FMath::Max(HeightDelta * Settings.BaseWaterSpeed, 0.f);
+		Water *= 1 - Settings.EvaporationSpeed;
+	}
+	return DropletLifeIndex;
+}
+
+// Whole chunk, border is left untouched to keep seams between chunks eroded separately
+FErosionArea FErosionSolver::GetChunkArea() const
+{
+	FErosionArea Area;
+	Area.Spawn.MinX = Area.Spawn.MinY = Settings.ErosionRadius;
+	Area.Spawn.MaxX = Area.Spawn.MaxY = Settings.ChunkSize - Settings.ErosionRadius;
+	Area.Droplet.MinX = Area.Droplet.MinY = Settings.BorderSize;
+	Area.Droplet.MaxX = Area.Droplet.MaxY = Settings.ChunkSize - (Settings.BorderSize + 1);
+	Area.Erode = Area.Droplet;
+	return Area;
+}
+
+/* Splits spawn area into square cells and gives every cell a density from heights in its corners and centre.
+ * Density is mixed with uniform share, so every cell keeps some droplets and no droplet is scaled by more than
+ * inverse of the share. Cells clipped by area edge count only with their area.
+ */
+void FErosionSolver::BuildSpawnMap(const float* HeightMap, const FErosionBounds& Bounds,
+                                   FErosionSpawnMap& SpawnMap) const
 {
-	// TArray<FVector> ErodedTerrain = HeightMap;
-	const FRandomStream RandomStream(ErosionSeed);
+	const int ChunkSize = Settings.ChunkSize;
+	const int CellSize = 8;
+	const int CellNumX = FMath::Max(FMath::CeilToInt((Bounds.MaxX - Bounds.MinX) / CellSize), 1);
+	const int CellNumY = FMath::Max(FMath::CeilToInt((Bounds.MaxY - Bounds.MinY) / CellSize), 1);
+	const int CellNum = CellNumX * CellNumY;
 
-	for (IterationIndex = 0; IterationIndex < IterationNumber; IterationIndex++)
+	const auto GetHeight = [&](float X, float Y)
 	{
-		float RealPositionX = RandomStream.FRandRange(ErosionRadius, ChunkSize - ErosionRadius);
-		float RealPositionY = RandomStream.FRandRange(ErosionRadius, ChunkSize - ErosionRadius);
-		float DirectionX = 0.f;
-		float DirectionY = 0.f;
-		float Speed = BaseWaterSpeed;
-		float Water = 1.f;
-		float Sediment = 0.f;
+		const int IndexX = FMath::Clamp(static_cast<int>(X), 0, ChunkSize - 1);
+		const int IndexY = FMath::Clamp(static_cast<int>(Y), 0, ChunkSize - 1);
+		return HeightMap[IndexX + IndexY * ChunkSize];
+	};
 
-		for (DropletLifeIndex = 0; DropletLifeIndex < DropletLifetime; DropletLifeIndex++)
+	TArray<float> Measures;
+	TArray<float> Areas;
+	Measures.SetNumUninitialized(CellNum);
+	Areas.SetNumUninitialized(CellNum);
+	float MinHeight = MAX_flt;
+
+	for (int CellY = 0; CellY < CellNumY; CellY++)
+	{
+		for (int CellX = 0; CellX < CellNumX; CellX++)
 		{
-			const int IndexPositionX = RealPositionX;
-			const int IndexPositionY = RealPositionY;
+			const int Cell = CellX + CellY * CellNumX;
+			const float MinX = Bounds.MinX + CellX * CellSize;
+			const float MinY = Bounds.MinY + CellY * CellSize;
+			const float MaxX = FMath::Min(MinX + CellSize, Bounds.MaxX);
+			const float MaxY = FMath::Min(MinY + CellSize, Bounds.MaxY);
+			const float Samples[] = {
+				GetHeight(MinX, MinY), GetHeight(MaxX, MinY), GetHeight(MinX, MaxY), GetHeight(MaxX, MaxY),
+				GetHeight((MinX + MaxX) / 2, (MinY + MaxY) / 2)
+			};
+
+			const float CellMin = FMath::Min(FMath::Min3(Samples[0], Samples[1], Samples[2]),
+			                                 FMath::Min(Samples[3], Samples[4]));
+			const float CellMax = FMath::Max(FMath::Max3(Samples[0], Samples[1], Samples[2]),
+			                                 FMath::Max(Samples[3], Samples[4]));
+
+			Areas[Cell] = FMath::Max(MaxX - MinX, 0.f) * FMath::Max(MaxY - MinY, 0.f);
+			Measures[Cell] = Settings.SpawnDistribution == EErosionSpawnDistribution::Slope
+				                 ? (CellMax - CellMin) / FMath::Max(MaxX - MinX + MaxY - MinY, 1.f)
+				                 : Samples[4];
+			MinHeight = FMath::Min(MinHeight, CellMin);
+		}
+	}
+
+	float TotalArea = 0.f;
+	float TotalMeasure = 0.f;
+	for (int Cell = 0; Cell < CellNum; Cell++)
+	{
+		// Lowest ground gets only uniform share
+		if (Settings.SpawnDistribution == EErosionSpawnDistribution::Height) Measures[Cell] -= MinHeight;
+
+		TotalArea += Areas[Cell];
+		TotalMeasure += Measures[Cell] * Areas[Cell];
+	}
+
+	// Weights average to one over the area, so droplet scale is the inverse of weight
+	const float UniformShare = Settings.SpawnUniformShare;
+	const float MeanMeasure = TotalMeasure / FMath::Max(TotalArea, SMALL_NUMBER);
+	float Total = 0.f;
+
+	SpawnMap.Bounds = Bounds;
+	SpawnMap.CellSize = CellSize;
+	SpawnMap.CellNumX = CellNumX;
+	SpawnMap.Cumulative.SetNumUninitialized(CellNum);
+	SpawnMap.Scales.SetNumUninitialized(CellNum);
+
+	for (int Cell = 0; Cell < CellNum; Cell++)
+	{
+		const float Weight = UniformShare + (1.f - UniformShare) * (MeanMeasure > 0.f
+			                                                            ? Measures[Cell] / MeanMeasure
+			                                                            : 1.f);
+		Total += Areas[Cell] * Weight;
+		SpawnMap.Cumulative[Cell] = Total;
+		SpawnMap.Scales[Cell] = Weight > 0.f ? 1.f / Weight : 0.f;
+	}
+
+	for (float& Value : SpawnMap.Cumulative)
+	{
+		Value /= Total;
+	}
+}
+
+FErosionSpawn FErosionSolver::GetDropletSpawn(const FErosionContext& Context, const FErosionArea& Area,
+                                              int DropletIndex) const
+{
+	FErosionSpawn Spawn;
+
+	if (!Context.SpawnMap.IsSet())
+	{
+		Spawn.X = Context.Random.GetRange(DropletIndex, 0, Area.Spawn.MinX, Area.Spawn.MaxX);
+		Spawn.Y = Context.Random.GetRange(DropletIndex, 1, Area.Spawn.MinY, Area.Spawn.MaxY);
+		return Spawn;
+	}
+
+	// Cell is picked by its probability, position inside of it uniformly
+	const FErosionSpawnMap& SpawnMap = Context.SpawnMap.GetValue();
+	const float Sample = Context.Random.GetRange(DropletIndex, 2, 0.f, 1.f);
+	const int Cell = FMath::Min(Algo::UpperBound(SpawnMap.Cumulative, Sample), SpawnMap.Cumulative.Num() - 1);
+	const float MinX = SpawnMap.Bounds.MinX + Cell % SpawnMap.CellNumX * SpawnMap.CellSize;
+	const float MinY = SpawnMap.Bounds.MinY + Cell / SpawnMap.CellNumX * SpawnMap.CellSize;
+
+	const float MaxX = FMath::Min(MinX + SpawnMap.CellSize, SpawnMap.Bounds.MaxX);
+	const float MaxY = FMath::Min(MinY + SpawnMap.CellSize, SpawnMap.Bounds.MaxY);
+
+	Spawn.X = Context.Random.GetRange(DropletIndex, 0, MinX, MaxX);
+	Spawn.Y = Context.Random.GetRange(DropletIndex, 1, MinY, MaxY);
+	Spawn.Scale = SpawnMap.Scales[Cell];
+	return Spawn;
+}
+
+// Converts row-major plane to height layout of the solver for the duration of work, and back even when cancelled.
+// Work gets converted plane and its indexer.
+template <typename TWork>
+bool FErosionSolver::SimulateInLayout(float* HeightMap, TWork&& Work) const
+{
+	if (HeightLayout.GetLayout() == EErosionHeightLayout::RowMajor)
+		return Work(HeightMap, FRowMajorIndexer{Settings.ChunkSize});
+
+	TArray<float> LayoutPlane;
+	LayoutPlane.SetNumUninitialized(HeightLayout.GetNum());
+	HeightLayout.FromRowMajor(HeightMap, LayoutPlane.GetData());
+
+	const bool bCompleted = Work(LayoutPlane.GetData(),
+	                             FLayoutIndexer{HeightLayout.GetColumnOffsets(), HeightLayout.GetRowOffsets()});
+
+	HeightLayout.ToRowMajor(LayoutPlane.GetData(), HeightMap);
+	return bCompleted;
+}
+
+// Droplets simulated one after another, starting at context iteration so cancelled simulation can be resumed
+bool FErosionSolver::SimulateDroplets(float* HeightMap, FErosionContext& Context) const
+{
+	const FErosionArea Area = Context.Area.IsSet() ? Context.Area.GetValue() : GetChunkArea();
+	const int LastDroplet = FMath::Min(FineIterationNumber, Context.IterationEnd);
+
+	return SimulateInLayout(HeightMap, [&](float* LayoutPlane, const auto& Indexer)
+	{
+		for (; Context.IterationIndex < LastDroplet; Context.IterationIndex++)
+		{
+			// Cancellation checkpoint
+			if (Context.IterationIndex % 1024 == 0 && Context.ShouldCancel && Context.ShouldCancel()) return false;
+
+			Context.DropletSteps += SimulateDroplet(LayoutPlane, Indexer,
+			                                        GetDropletSpawn(Context, Area, Context.IterationIndex),
+			                                        Area.Droplet, Area.Erode);
+		}
+		return true;
+	});
+}
+
+/* Droplets are grouped into square tiles by spawn position and confined to their tile extended by a margin.
+ * Tiles are coloured like a 2x2 checkerboard, tiles of the same colour are a whole tile apart, so their
+ * brush footprints never overlap and they can run in parallel. Colours run one after another.
+ * A B A B
+ * C D C D
+ */
+bool FErosionSolver::SimulateTiledDroplets(float* HeightMap, FErosionContext& Context) const
+{
+	const int ChunkSize = Settings.ChunkSize;
+	const int ErosionRadius = Settings.ErosionRadius;
+	// Footprint of droplet reaches radius plus one vertex of bilinear sampling beyond its position
+	const int TileSize = FMath::Max(Settings.ErosionTileSize, 2 * ErosionRadius + 2);
+	const int TileMargin = TileSize / 2 - ErosionRadius - 1;
+	const int TilesNumber = FMath::DivideAndRoundUp(ChunkSize, TileSize);
+	const FErosionArea Area = Context.Area.IsSet() ? Context.Area.GetValue() : GetChunkArea();
+	const FErosionBounds& ChunkBounds = Area.Droplet;
+
+	// Spawn positions are the same as in serial simulation, droplets before context iteration were already simulated
+	const int FirstDroplet = Context.IterationIndex;
+	const int LastDroplet = FMath::Min(FineIterationNumber, Context.IterationEnd);
+	const int DropletsNumber = FMath::Max(LastDroplet - FirstDroplet, 0);
+	TArray<FErosionSpawn> Spawns;
+	TArray<int> TileStarts;
+	TArray<int> TileDroplets;
+
+	Spawns.SetNumUninitialized(DropletsNumber);
+	TileStarts.Init(0, FMath::Square(TilesNumber) + 1);
+	TileDroplets.SetNumUninitialized(DropletsNumber);
+
+	const auto GetTileIndex = [TileSize, TilesNumber](const FErosionSpawn& Position)
+	{
+		return static_cast<int>(Position.X) / TileSize + static_cast<int>(Position.Y) / TileSize * TilesNumber;
+	};
+
+	for (int i = 0; i < DropletsNumber; i++)
+	{
+		Spawns[i] = GetDropletSpawn(Context, Area, FirstDroplet + i);
+		TileStarts[GetTileIndex(Spawns[i]) + 1]++;
+	}
+
+	// Counting sort keeps droplets of every tile in spawn order
+	for (int TileIndex = 1; TileIndex < TileStarts.Num(); TileIndex++)
+	{
+		TileStarts[TileIndex] += TileStarts[TileIndex - 1];
+	}
+	{
+		TArray<int> TileFill(TileStarts.GetData(), TileStarts.Num() - 1);
+		for (int i = 0; i < DropletsNumber; i++)
+		{
+			TileDroplets[TileFill[GetTileIndex(Spawns[i])]++] = i;
+		}
+	}
+
+	TArray<int> ColourTiles;
+	ColourTiles.Reserve(FMath::Square(TilesNumber / 2 + 1));
+
+	const bool bCompleted = SimulateInLayout(HeightMap, [&](float* LayoutPlane, const auto& Indexer)
+	{
+		for (int Colour = 0; Colour < 4; Colour++)
+		{
+			if (Context.ShouldCancel && Context.ShouldCancel()) return false;
+
+			ColourTiles.Reset();
+			for (int TileY = Colour / 2; TileY < TilesNumber; TileY += 2)
+			{
+				for (int TileX = Colour % 2; TileX < TilesNumber; TileX += 2)
+				{
+					ColourTiles.Add(TileX + TileY * TilesNumber);
+				}
+			}
+
+			ParallelFor(ColourTiles.Num(), [&](int ColourTileIndex)
+			{
+				const int TileIndex = ColourTiles[ColourTileIndex];
+				const int TileX = TileIndex % TilesNumber;
+				const int TileY = TileIndex / TilesNumber;
+
+				FErosionBounds Bounds;
+				Bounds.MinX = FMath::Max<float>(ChunkBounds.MinX, TileX * TileSize - TileMargin);
+				Bounds.MinY = FMath::Max<float>(ChunkBounds.MinY, TileY * TileSize - TileMargin);
+				Bounds.MaxX = FMath::Min<float>(ChunkBounds.MaxX, (TileX + 1) * TileSize + TileMargin);
+				Bounds.MaxY = FMath::Min<float>(ChunkBounds.MaxY, (TileY + 1) * TileSize + TileMargin);
+
+				int64 TileSteps = 0;
+				for (int i = TileStarts[TileIndex]; i < TileStarts[TileIndex + 1]; i++)
+				{
+					TileSteps += SimulateDroplet(LayoutPlane, Indexer, Spawns[TileDroplets[i]], Bounds, Area.Erode);
+				}
+				FPlatformAtomics::InterlockedAdd(&Context.DropletSteps, TileSteps);
+			}, !Context.bParallel);
+		}
+		return true;
+	});
+	if (!bCompleted) return false;
+
+	Context.IterationIndex = FMath::Max(LastDroplet, FirstDroplet);
+	return true;
+}
+
+/* Four droplets advance in lockstep, direction, interpolation, bounds and capacity math runs on vector registers.
+ * Height fetches and brush erosion stay scalar per lane. Dead lanes are refilled with next droplets, so a lane does
+ * not follow spawn order. Within a step lanes erode and deposit in lane order, and lanes die at the same steps on
+ * every run, so the result is deterministic.
+ */
+bool FErosionSolver::SimulateDropletLanes(float* HeightMap, FErosionContext& Context) const
+{
+	constexpr int LaneNum = 4;
+	const int ChunkSize = Settings.ChunkSize;
+	const FErosionArea Area = Context.Area.IsSet() ? Context.Area.GetValue() : GetChunkArea();
+
+	// Lane state, vector phases load and store it as a whole. Zeroed, so lanes never spawned carry finite values.
+	struct alignas(16) FLanes
+	{
+		float PositionX[LaneNum];
+		float PositionY[LaneNum];
+		float DirectionX[LaneNum];
+		float DirectionY[LaneNum];
+		float Speed[LaneNum];
+		float Water[LaneNum];
+		float Sediment[LaneNum];
+		// Bilinear sample of current and next position
+		float OffsetX[LaneNum];
+		float OffsetY[LaneNum];
+		float HeightNW[LaneNum];
+		float HeightNE[LaneNum];
+		float HeightSW[LaneNum];
+		float HeightSE[LaneNum];
+		float Height[LaneNum];
+		float HeightDelta[LaneNum];
+		float SedimentCapacity[LaneNum];
+	} Lanes = {};
+
+	const FRowMajorIndexer Indexer{ChunkSize};
+	int IndexPositionsX[LaneNum] = {};
+	int IndexPositionsY[LaneNum] = {};
+	int LifeIndices[LaneNum] = {};
+	float Scales[LaneNum] = {};
+	bool bAlive[LaneNum] = {};
+
+	const VectorRegister Zero = VectorZero();
+	const VectorRegister One = VectorOne();
+	const VectorRegister Inertia = VectorSetFloat1(Settings.Inertia);
+	const VectorRegister InverseInertia = VectorSetFloat1(1 - Settings.Inertia);
+	const VectorRegister MinDirectionSquared = VectorSetFloat1(0.01f * 0.01f);
+	const VectorRegister MinX = VectorSetFloat1(Area.Droplet.MinX);
+	const VectorRegister MinY = VectorSetFloat1(Area.Droplet.MinY);
+	const VectorRegister MaxX = VectorSetFloat1(Area.Droplet.MaxX);
+	const VectorRegister MaxY = VectorSetFloat1(Area.Droplet.MaxY);
+	const VectorRegister MinSedimentCapacity = VectorSetFloat1(Settings.MinSedimentCapacity);
+	const VectorRegister SedimentCapacityFactor = VectorSetFloat1(Settings.SedimentCapacityFactor);
+	const VectorRegister BaseWaterSpeed = VectorSetFloat1(Settings.BaseWaterSpeed);
+	const VectorRegister Evaporation = VectorSetFloat1(1 - Settings.EvaporationSpeed);
+
+	// Scalar gather of square vertices around every live lane
+	const auto FetchSquares = [&]
+	{
+		for (int Lane = 0; Lane < LaneNum; Lane++)
+		{
+			// Dead lanes keep last values, their results are ignored
+			if (!bAlive[Lane]) continue;
+
+			const int IndexPositionX = Lanes.PositionX[Lane];
+			const int IndexPositionY = Lanes.PositionY[Lane];
 			const int CombinedIndexPosition = IndexPositionX + IndexPositionY * ChunkSize;
 
-			const FGradientAndHeight* CurrentGradientAndHeight = CalculateGradientAndHeight(
-				HeightMap, RealPositionX, RealPositionY
-			);
+			Lanes.OffsetX[Lane] = Lanes.PositionX[Lane] - IndexPositionX;
+			Lanes.OffsetY[Lane] = Lanes.PositionY[Lane] - IndexPositionY;
+			Lanes.HeightNW[Lane] = HeightMap[CombinedIndexPosition];
+			Lanes.HeightNE[Lane] = HeightMap[CombinedIndexPosition + 1];
+			Lanes.HeightSW[Lane] = HeightMap[CombinedIndexPosition + ChunkSize];
+			Lanes.HeightSE[Lane] = HeightMap[CombinedIndexPosition + 1 + ChunkSize];
+		}
+	};
 
-			// Calculate direction of fastest descent
-			DirectionX = DirectionX * Inertia - CurrentGradientAndHeight->GradientX * (1 - Inertia);
-			DirectionY = DirectionY * Inertia - CurrentGradientAndHeight->GradientY * (1 - Inertia);
+	// Bilinear height of fetched squares
+	const auto InterpolateHeight = [&](const VectorRegister& OffsetX, const VectorRegister& OffsetY)
+	{
+		const VectorRegister InverseOffsetX = VectorSubtract(One, OffsetX);
+		const VectorRegister InverseOffsetY = VectorSubtract(One, OffsetY);
+		const VectorRegister North = VectorMultiplyAdd(VectorLoadAligned(Lanes.HeightNE), OffsetX,
+		                                               VectorMultiply(VectorLoadAligned(Lanes.HeightNW), InverseOffsetX));
+		const VectorRegister South = VectorMultiplyAdd(VectorLoadAligned(Lanes.HeightSE), OffsetX,
+		                                               VectorMultiply(VectorLoadAligned(Lanes.HeightSW), InverseOffsetX));
+		return VectorMultiplyAdd(South, OffsetY, VectorMultiply(North, InverseOffsetY));
+	};
 
-			// Normalize droplet direction
-			const float CombinedDirection = FMath::Max(
-				0.01f, FMath::Sqrt(DirectionX * DirectionX + DirectionY * DirectionY));
-			DirectionX /= CombinedDirection;
-			DirectionY /= CombinedDirection;
+	int NextDroplet = Context.IterationIndex;
+	const int LastDroplet = FMath::Min(FineIterationNumber, Context.IterationEnd);
+
+	while (true)
+	{
+		// Next droplets go to dead lanes in lane order
+		int AliveNum = 0;
+		for (int Lane = 0; Lane < LaneNum; Lane++)
+		{
+			if (!bAlive[Lane] && NextDroplet < LastDroplet)
+			{
+				// Cancellation checkpoint
+				if (NextDroplet % 1024 == 0 && Context.ShouldCancel && Context.ShouldCancel()) return false;
+
+				const FErosionSpawn Spawn = GetDropletSpawn(Context, Area, NextDroplet++);
+				Lanes.PositionX[Lane] = Spawn.X;
+				Lanes.PositionY[Lane] = Spawn.Y;
+				Scales[Lane] = Spawn.Scale;
+				Lanes.DirectionX[Lane] = 0.f;
+				Lanes.DirectionY[Lane] = 0.f;
+				Lanes.Speed[Lane] = Settings.BaseWaterSpeed;
+				Lanes.Water[Lane] = 1.f;
+				Lanes.Sediment[Lane] = 0.f;
+				LifeIndices[Lane] = 0;
+				bAlive[Lane] = true;
+			}
+			AliveNum += bAlive[Lane];
+		}
+		Context.IterationIndex = NextDroplet;
 
-			RealPositionX += DirectionX;
-			RealPositionY += DirectionY;
+		if (!AliveNum) break;
+
+		// Dead lanes may hold positions far outside the plane, only live ones are converted
+		for (int Lane = 0; Lane < LaneNum; Lane++)
+		{
+			if (!bAlive[Lane]) continue;
+
+			IndexPositionsX[Lane] = Lanes.PositionX[Lane];
+			IndexPositionsY[Lane] = Lanes.PositionY[Lane];
+		}
+		FetchSquares();
+
+		{
+			const VectorRegister OffsetX = VectorLoadAligned(Lanes.OffsetX);
+			const VectorRegister OffsetY = VectorLoadAligned(Lanes.OffsetY);
+			const VectorRegister InverseOffsetX = VectorSubtract(One, OffsetX);
+			const VectorRegister InverseOffsetY = VectorSubtract(One, OffsetY);
+			const VectorRegister HeightNW = VectorLoadAligned(Lanes.HeightNW);
+			const VectorRegister HeightNE = VectorLoadAligned(Lanes.HeightNE);
+			const VectorRegister HeightSW = VectorLoadAligned(Lanes.HeightSW);
+			const VectorRegister HeightSE = VectorLoadAligned(Lanes.HeightSE);
+
+			const VectorRegister GradientX = VectorMultiplyAdd(VectorSubtract(HeightSE, HeightSW), OffsetY,
+			                                                   VectorMultiply(VectorSubtract(HeightNE, HeightNW),
+			                                                                  InverseOffsetY));
+			const VectorRegister GradientY = VectorMultiplyAdd(VectorSubtract(HeightSE, HeightNE), OffsetX,
+			                                                   VectorMultiply(VectorSubtract(HeightSW, HeightNW),
+			                                                                  InverseOffsetX));
+			VectorStoreAligned(InterpolateHeight(OffsetX, OffsetY), Lanes.Height);
+
+			// Calculate direction of fastest descent and normalize it
+			VectorRegister DirectionX = VectorSubtract(VectorMultiply(VectorLoadAligned(Lanes.DirectionX), Inertia),
+			                                           VectorMultiply(GradientX, InverseInertia));
+			VectorRegister DirectionY = VectorSubtract(VectorMultiply(VectorLoadAligned(Lanes.DirectionY), Inertia),
+			                                           VectorMultiply(GradientY, InverseInertia));
+			const VectorRegister DirectionSquared = VectorMultiplyAdd(DirectionX, DirectionX,
+			                                                          VectorMultiply(DirectionY, DirectionY));
+			const VectorRegister InverseLength = VectorReciprocalSqrtAccurate(
+				VectorMax(DirectionSquared, MinDirectionSquared));
+			DirectionX = VectorMultiply(DirectionX, InverseLength);
+			DirectionY = VectorMultiply(DirectionY, InverseLength);
+
+			const VectorRegister PositionX = VectorAdd(VectorLoadAligned(Lanes.PositionX), DirectionX);
+			const VectorRegister PositionY = VectorAdd(VectorLoadAligned(Lanes.PositionY), DirectionY);
+			VectorStoreAligned(DirectionX, Lanes.DirectionX);
+			VectorStoreAligned(DirectionY, Lanes.DirectionY);
+			VectorStoreAligned(PositionX, Lanes.PositionX);
+			VectorStoreAligned(PositionY, Lanes.PositionY);
+
+			// Droplet stopped in a pit or flowed out of its bounds
+			const VectorRegister Stopped = VectorBitwiseAnd(VectorCompareEQ(DirectionX, Zero),
+			                                                VectorCompareEQ(DirectionY, Zero));
+			const VectorRegister Outside = VectorBitwiseOr(
+				VectorBitwiseOr(VectorCompareLT(PositionX, MinX), VectorCompareGT(PositionX, MaxX)),
+				VectorBitwiseOr(VectorCompareLT(PositionY, MinY), VectorCompareGT(PositionY, MaxY)));
+			const int DeadLanes = VectorMaskBits(VectorBitwiseOr(Stopped, Outside));
+
+			for (int Lane = 0; Lane < LaneNum; Lane++)
+			{
+				if (DeadLanes & 1 << Lane) bAlive[Lane] = false;
+			}
+		}
 
-			// Check if droplet stopped in a pit or flowed out of the map chunk (or entered chunk border)
-			if (DirectionX == 0.f && DirectionY == 0.f || (RealPositionX < BorderSize || RealPositionX > ChunkSize
-				- (BorderSize + 1) || RealPositionY < BorderSize || RealPositionY > ChunkSize - (BorderSize + 1)))
-				break;
+		// Recalculate height at new position
+		FetchSquares();
 
-			// Recalculate height at new position
-			const FGradientAndHeight* NewGradientAndHeight = CalculateGradientAndHeight(
-				HeightMap, RealPositionX, RealPositionY);
+		{
+			const VectorRegister NewHeight = InterpolateHeight(VectorLoadAligned(Lanes.OffsetX),
+			                                                   VectorLoadAligned(Lanes.OffsetY));
+			const VectorRegister HeightDelta = VectorSubtract(VectorLoadAligned(Lanes.Height), NewHeight);
+			const VectorRegister SedimentCapacity = VectorMultiply(
+				VectorMultiply(VectorMax(HeightDelta, MinSedimentCapacity), VectorLoadAligned(Lanes.Speed)),
+				VectorMultiply(VectorLoadAligned(Lanes.Water), SedimentCapacityFactor));
 
-			const float HeightDelta = CurrentGradientAndHeight->Height - NewGradientAndHeight->Height;
+			VectorStoreAligned(HeightDelta, Lanes.HeightDelta);
+			VectorStoreAligned(SedimentCapacity, Lanes.SedimentCapacity);
+		}
 
-			const float SedimentCapacity = FMath::Max(HeightDelta, MinSedimentCapacity) * Speed *
-				Water * SedimentCapacityFactor;
+		// Conflicting writes of lanes are resolved by lane order
+		for (int Lane = 0; Lane < LaneNum; Lane++)
+		{
+			if (!bAlive[Lane]) continue;
 
-			if (Sediment > SedimentCapacity || HeightDelta < 0)
-				DepositSediment(HeightMap, CombinedIndexPosition, HeightDelta, Sediment, SedimentCapacity);
+			if (Lanes.Sediment[Lane] > Lanes.SedimentCapacity[Lane] || Lanes.HeightDelta[Lane] < 0)
+				DepositSediment(HeightMap, Indexer, IndexPositionsX[Lane], IndexPositionsY[Lane], Lanes.HeightDelta[Lane],
+				                Lanes.Sediment[Lane], Lanes.SedimentCapacity[Lane], Scales[Lane]);
 			else
-				ErodeTerrain(HeightMap, CombinedIndexPosition, HeightDelta, Sediment, SedimentCapacity);
+				ErodeTerrain(HeightMap, Indexer, IndexPositionsX[Lane], IndexPositionsY[Lane], Lanes.HeightDelta[Lane],
+				             Lanes.Sediment[Lane], Lanes.SedimentCapacity[Lane], Scales[Lane], Area.Erode);
 
-			// Calculate droplet speed as an approximation based on slope
-			Speed = FMath::Max(HeightDelta * BaseWaterSpeed, 0.f);
-			Water *= 1 - EvaporationSpeed;
+			if (++LifeIndices[Lane] == Settings.DropletLifetime) bAlive[Lane] = false;
 		}
+
+		// Calculate droplet speed as an approximation based on slope
+		VectorStoreAligned(VectorMax(VectorMultiply(VectorLoadAligned(Lanes.HeightDelta), BaseWaterSpeed), Zero),
+		                   Lanes.Speed);
+		VectorStoreAligned(VectorMultiply(VectorLoadAligned(Lanes.Water), Evaporation), Lanes.Water);
 	}
-	if (bApplyBlur) GaussianBlur(HeightMap);
+	return true;
+}
+
+/* Virtual pipe model, every vertex is a water column connected to its four neighbours with pipes.
+ * Each step accelerates flux through pipes by water level differences, moves water, erodes or
+ * deposits towards sediment capacity of local flow, evaporates and adds rain, then advects sediment along velocity.
+ * Every pass reads previous pass results of neighbours and writes only its own vertex, so rows run in parallel.
+ * Result does not depend on thread count. Heights are simulated in vertex size units, so the pipe length is one.
+ * Grids are padded by a vertex on every side and rows are rounded up to whole vectors, so flux, water and erosion
+ * passes work on four vertices at once without branches. Closed pipes, plane edges and erode area are per column
+ * masks and per row factors, padding repeats edge terrain, so gradients at plane edges are one-sided.
+ */
+bool FErosionSolver::SimulatePipeModel(float* HeightMap, FErosionContext& Context) const
+{
+	constexpr int LaneNum = 4;
+	// Padding columns in front of a row, so the first vertex of every row starts a vector
+	constexpr int PadX = LaneNum;
+	const int Size = Settings.ChunkSize;
+	const int VectorSize = Align(Size, LaneNum);
+	const int Stride = VectorSize + 2 * PadX;
+	const int PaddedArea = Stride * (Size + 2);
+	const FErosionArea ErosionArea = Context.Area.IsSet() ? Context.Area.GetValue() : GetChunkArea();
+	const float TimeStep = Settings.PipeTimeStep;
+	const float Gravity = 9.81f;
+	const float HeightScale = 1.f / Settings.VertexSize;
+	const float Evaporation = 1.f - Settings.EvaporationSpeed * TimeStep;
+
+	enum EField { Terrain, Water, Sediment, NextSediment, FluxLeft, FluxRight, FluxUp, FluxDown, VelocityX,
+		VelocityY, Tilt, FieldNum };
+
+	TArray<float> Fields;
+	Fields.SetNumZeroed(FieldNum * PaddedArea);
+	float* Field[FieldNum];
+	for (int i = 0; i < FieldNum; i++)
+	{
+		Field[i] = Fields.GetData() + i * PaddedArea;
+	}
+
+	// Padded index of plane vertex, padding row and column are -1 and Size
+	const auto Index = [Stride](int x, int y) { return (y + 1) * Stride + PadX + x; };
+
+	for (int y = 0; y < Size; y++)
+	{
+		for (int x = 0; x < Size; x++)
+		{
+			Field[Terrain][Index(x, y)] = HeightMap[x + y * Size] * HeightScale;
+			Field[Water][Index(x, y)] = Settings.PipeRainAmount;
+		}
+	}
+
+	// Vertices outside of erode area keep their height
+	const int ErodeMinX = FMath::Max(0, FMath::CeilToInt(ErosionArea.Erode.MinX));
+	const int ErodeMaxX = FMath::Min(Size - 1, FMath::FloorToInt(ErosionArea.Erode.MaxX));
+	const int ErodeMinY = FMath::Max(0, FMath::CeilToInt(ErosionArea.Erode.MinY));
+	const int ErodeMaxY = FMath::Min(Size - 1, FMath::FloorToInt(ErosionArea.Erode.MaxY));
+
+	// Column masks, 1 where the pipe is open or the vertex is eroded, 0 for columns past the plane
+	TArray<float> Masks;
+	Masks.SetNumZeroed(4 * VectorSize);
+	float* OpenLeft = Masks.GetData();
+	float* OpenRight = OpenLeft + VectorSize;
+	float* Inside = OpenRight + VectorSize;
+	float* ErodeColumn = Inside + VectorSize;
+	for (int x = 0; x < Size; x++)
+	{
+		OpenLeft[x] = x > 0;
+		OpenRight[x] = x < Size - 1;
+		Inside[x] = 1.f;
+		ErodeColumn[x] = x >= ErodeMinX && x <= ErodeMaxX;
+	}
+
+	// Padding repeats edge terrain, refreshed every step as erosion may reach the edge
+	const auto PadTerrain = [&]
+	{
+		float* Ground = Field[Terrain];
+		for (int y = 0; y < Size; y++)
+		{
+			Ground[Index(-1, y)] = Ground[Index(0, y)];
+			Ground[Index(Size, y)] = Ground[Index(Size - 1, y)];
+		}
+		FMemory::Memcpy(Ground + Index(-1, -1), Ground + Index(-1, 0), (Size + 2) * sizeof(float));
+		FMemory::Memcpy(Ground + Index(-1, Size), Ground + Index(-1, Size - 1), (Size + 2) * sizeof(float));
+	};
+
+	const VectorRegister Zero = VectorZero();
+	const VectorRegister One = VectorOne();
+	const VectorRegister Half = VectorSetFloat1(0.5f);
+	const VectorRegister Small = VectorSetFloat1(KINDA_SMALL_NUMBER);
+	const VectorRegister VectorTimeStep = VectorSetFloat1(TimeStep);
+	const VectorRegister Acceleration = VectorSetFloat1(TimeStep * Gravity);
+	const VectorRegister MinTilt = VectorSetFloat1(0.05f);
+	const VectorRegister SedimentCapacity = VectorSetFloat1(Settings.PipeSedimentCapacity);
+	const VectorRegister ErosionRate = VectorSetFloat1(Settings.ErosionSpeed * TimeStep);
+	const VectorRegister DepositionRate = VectorSetFloat1(Settings.DepositionSpeed * TimeStep);
+	const VectorRegister VectorEvaporation = VectorSetFloat1(Evaporation);
+	const VectorRegister Rain = VectorSetFloat1(Settings.PipeRainAmount);
+
+	// Square root of non-negative values, zero stays zero
+	const auto Sqrt = [Small](const VectorRegister& Value)
+	{
+		return VectorMultiply(Value, VectorReciprocalSqrtAccurate(VectorMax(Value, Small)));
+	};
+
+	// Advection only samples sediment, so per row totals are used to keep its amount unchanged
+	TArray<double> SedimentTotals;
+	SedimentTotals.SetNumZeroed(2 * Size);
+	float SedimentScale = 1.f;
+
+	// Sediment never leaves erode area, so all of it settles on eroded vertices at the end
+	const float AdvectMinX = ErodeMinX;
+	const float AdvectMaxX = FMath::Max<float>(ErodeMinX, ErodeMaxX - 0.001f);
+	const float AdvectMinY = ErodeMinY;
+	const float AdvectMaxY = FMath::Max<float>(ErodeMinY, ErodeMaxY - 0.001f);
+
+	for (Context.IterationIndex = 0; Context.IterationIndex < FinePipeStepNumber; Context.IterationIndex++)
+	{
+		// Cancellation checkpoint
+		if (Context.IterationIndex % 16 == 0 && Context.ShouldCancel && Context.ShouldCancel()) return false;
+
+		PadTerrain();
+
+		// Outflow flux, pipes leaving the plane are closed
+		ParallelFor(Size, [&](int y)
+		{
+			const int Row = Index(0, y);
+			const float* Ground = Field[Terrain] + Row;
+			const float* Depth = Field[Water] + Row;
+			float* Left = Field[FluxLeft] + Row;
+			float* Right = Field[FluxRight] + Row;
+			float* Up = Field[FluxUp] + Row;
+			float* Down = Field[FluxDown] + Row;
+			const VectorRegister OpenUp = y > 0 ? One : Zero;
+			const VectorRegister OpenDown = y < Size - 1 ? One : Zero;
+
+			for (int x = 0; x < VectorSize; x += LaneNum)
+			{
+				const VectorRegister ColumnDepth = VectorLoad(Depth + x);
+				const VectorRegister Level = VectorAdd(VectorLoad(Ground + x), ColumnDepth);
+				const auto Outflow = [&](const float* Flux, int Offset, const VectorRegister& Open)
+				{
+					const VectorRegister Difference = VectorSubtract(
+						Level, VectorAdd(VectorLoad(Ground + x + Offset), VectorLoad(Depth + x + Offset)));
+					return VectorMultiply(VectorMax(Zero, VectorMultiplyAdd(Acceleration, Difference,
+					                                                        VectorLoad(Flux + x))), Open);
+				};
+
+				const VectorRegister Inner = VectorLoad(Inside + x);
+				const VectorRegister OutLeft = Outflow(Left, -1, VectorLoad(OpenLeft + x));
+				const VectorRegister OutRight = Outflow(Right, 1, VectorLoad(OpenRight + x));
+				const VectorRegister OutUp = Outflow(Up, -Stride, VectorMultiply(OpenUp, Inner));
+				const VectorRegister OutDown = Outflow(Down, Stride, VectorMultiply(OpenDown, Inner));
+
+				// Outflow can never take more water than the column holds
+				const VectorRegister OutTotal = VectorMultiply(
+					VectorAdd(VectorAdd(OutLeft, OutRight), VectorAdd(OutUp, OutDown)), VectorTimeStep);
+				const VectorRegister Scale = VectorMin(
+					One, VectorMultiply(ColumnDepth, VectorReciprocalAccurate(VectorMax(OutTotal, Small))));
+				VectorStore(VectorMultiply(OutLeft, Scale), Left + x);
+				VectorStore(VectorMultiply(OutRight, Scale), Right + x);
+				VectorStore(VectorMultiply(OutUp, Scale), Up + x);
+				VectorStore(VectorMultiply(OutDown, Scale), Down + x);
+			}
+		}, !Context.bParallel);
+
+		// Water level, velocity and slope. Closed pipes and padding hold no flux, so inflow needs no edge checks.
+		ParallelFor(Size, [&](int y)
+		{
+			const int Row = Index(0, y);
+			const float* Ground = Field[Terrain] + Row;
+			const float* Left = Field[FluxLeft] + Row;
+			const float* Right = Field[FluxRight] + Row;
+			const float* Up = Field[FluxUp] + Row;
+			const float* Down = Field[FluxDown] + Row;
+			float* Depth = Field[Water] + Row;
+			float* FlowX = Field[VelocityX] + Row;
+			float* FlowY = Field[VelocityY] + Row;
+			float* Slope = Field[Tilt] + Row;
+
+			for (int x = 0; x < VectorSize; x += LaneNum)
+			{
+				const VectorRegister OutLeft = VectorLoad(Left + x);
+				const VectorRegister OutRight = VectorLoad(Right + x);
+				const VectorRegister OutUp = VectorLoad(Up + x);
+				const VectorRegister OutDown = VectorLoad(Down + x);
+				const VectorRegister InLeft = VectorLoad(Right + x - 1);
+				const VectorRegister InRight = VectorLoad(Left + x + 1);
+				const VectorRegister InUp = VectorLoad(Down + x - Stride);
+				const VectorRegister InDown = VectorLoad(Up + x + Stride);
+
+				const VectorRegister In = VectorAdd(VectorAdd(InLeft, InRight), VectorAdd(InUp, InDown));
+				const VectorRegister Out = VectorAdd(VectorAdd(OutLeft, OutRight), VectorAdd(OutUp, OutDown));
+				const VectorRegister OldDepth = VectorLoad(Depth + x);
+				const VectorRegister NewDepth = VectorMax(
+					Zero, VectorMultiplyAdd(VectorTimeStep, VectorSubtract(In, Out), OldDepth));
+				const VectorRegister InverseMeanDepth = VectorReciprocalAccurate(
+					VectorMax(VectorMultiply(VectorAdd(OldDepth, NewDepth), Half), Small));
+				VectorStore(NewDepth, Depth + x);
+
+				const VectorRegister NetX = VectorSubtract(VectorAdd(InLeft, OutRight), VectorAdd(OutLeft, InRight));
+				const VectorRegister NetY = VectorSubtract(VectorAdd(InUp, OutDown), VectorAdd(OutUp, InDown));
+				VectorStore(VectorMultiply(VectorMultiply(NetX, Half), InverseMeanDepth), FlowX + x);
+				VectorStore(VectorMultiply(VectorMultiply(NetY, Half), InverseMeanDepth), FlowY + x);
+
+				const VectorRegister GradientX = VectorMultiply(
+					VectorSubtract(VectorLoad(Ground + x + 1), VectorLoad(Ground + x - 1)), Half);
+				const VectorRegister GradientY = VectorMultiply(
+					VectorSubtract(VectorLoad(Ground + x + Stride), VectorLoad(Ground + x - Stride)), Half);
+				const VectorRegister SlopeSquared = VectorMultiplyAdd(GradientX, GradientX,
+				                                                      VectorMultiply(GradientY, GradientY));
+				VectorStore(Sqrt(VectorMultiply(SlopeSquared, VectorReciprocalAccurate(VectorAdd(One, SlopeSquared)))),
+				            Slope + x);
+			}
+		}, !Context.bParallel);
+
+		// Erosion and deposition towards capacity of local flow, then evaporation and rain for the next step
+		const VectorRegister VectorSedimentScale = VectorSetFloat1(SedimentScale);
+		ParallelFor(Size, [&](int y)
+		{
+			const int Row = Index(0, y);
+			float* Ground = Field[Terrain] + Row;
+			float* Depth = Field[Water] + Row;
+			float* Carried = Field[Sediment] + Row;
+			const float* FlowX = Field[VelocityX] + Row;
+			const float* FlowY = Field[VelocityY] + Row;
+			const float* Slope = Field[Tilt] + Row;
+			const VectorRegister ErodeRow = y >= ErodeMinY && y <= ErodeMaxY ? One : Zero;
+			VectorRegister RowTotal = Zero;
+
+			for (int x = 0; x < VectorSize; x += LaneNum)
+			{
+				const VectorRegister ColumnFlowX = VectorLoad(FlowX + x);
+				const VectorRegister ColumnFlowY = VectorLoad(FlowY + x);
+				const VectorRegister ColumnDepth = VectorLoad(Depth + x);
+				const VectorRegister Speed = Sqrt(VectorMultiplyAdd(ColumnFlowX, ColumnFlowX,
+				                                                    VectorMultiply(ColumnFlowY, ColumnFlowY)));
+				// Flat areas still carry a little sediment
+				const VectorRegister Capacity = VectorMultiply(
+					VectorMultiply(SedimentCapacity, VectorMax(VectorLoad(Slope + x), MinTilt)),
+					VectorMultiply(Speed, ColumnDepth));
+				const VectorRegister OldSediment = VectorMultiply(VectorLoad(Carried + x), VectorSedimentScale);
+
+				const VectorRegister Difference = VectorSubtract(Capacity, OldSediment);
+				const VectorRegister Rate = VectorSelect(VectorCompareGT(Difference, Zero), ErosionRate,
+				                                         DepositionRate);
+				const VectorRegister Amount = VectorMultiply(VectorMultiply(Difference, Rate),
+				                                             VectorMultiply(VectorLoad(ErodeColumn + x), ErodeRow));
+				const VectorRegister NewSediment = VectorAdd(OldSediment, Amount);
+
+				VectorStore(VectorSubtract(VectorLoad(Ground + x), Amount), Ground + x);
+				VectorStore(NewSediment, Carried + x);
+				VectorStore(VectorMultiplyAdd(ColumnDepth, VectorEvaporation, Rain), Depth + x);
+				RowTotal = VectorAdd(RowTotal, NewSediment);
+			}
+
+			// Columns past the plane hold no sediment
+			alignas(16) float Totals[LaneNum];
+			VectorStoreAligned(RowTotal, Totals);
+			SedimentTotals[y] = static_cast<double>(Totals[0]) + Totals[1] + Totals[2] + Totals[3];
+		}, !Context.bParallel);
+
+		// Semi-Lagrangian sediment transport, sediment comes from where the flow was one step ago. Bilinear
+		// samples are gathers, so this pass stays scalar.
+		ParallelFor(Size, [&](int y)
+		{
+			double RowTotal = 0.0;
+			if (y < ErodeMinY || y > ErodeMaxY)
+			{
+				SedimentTotals[Size + y] = RowTotal;
+				return;
+			}
+
+			const float* FlowX = Field[VelocityX];
+			const float* FlowY = Field[VelocityY];
+			float* Next = Field[NextSediment];
+
+			for (int x = ErodeMinX; x <= ErodeMaxX; x++)
+			{
+				const int i = Index(x, y);
+				const float SourceX = FMath::Clamp(x - FlowX[i] * TimeStep, AdvectMinX, AdvectMaxX);
+				const float SourceY = FMath::Clamp(y - FlowY[i] * TimeStep, AdvectMinY, AdvectMaxY);
+				const int IndexX = SourceX;
+				const int IndexY = SourceY;
+				const float OffsetX = SourceX - IndexX;
+				const float OffsetY = SourceY - IndexY;
+				const float* Source = Field[Sediment] + Index(IndexX, IndexY);
+
+				Next[i] = FMath::Lerp(FMath::Lerp(Source[0], Source[1], OffsetX),
+				                      FMath::Lerp(Source[Stride], Source[Stride + 1], OffsetX), OffsetY);
+				RowTotal += Next[i];
+			}
+			SedimentTotals[Size + y] = RowTotal;
+		}, !Context.bParallel);
+
+		Swap(Field[Sediment], Field[NextSediment]);
+
+		// Rows are summed in fixed order, so the result does not depend on thread count
+		double Before = 0.0, After = 0.0;
+		for (int y = 0; y < Size; y++)
+		{
+			Before += SedimentTotals[y];
+			After += SedimentTotals[Size + y];
+		}
+		SedimentScale = After > 0.0 ? static_cast<float>(Before / After) : 1.f;
+	}
+
+	// Sediment still carried by water settles where it is, all of it is inside erode area
+	for (int y = ErodeMinY; y <= ErodeMaxY; y++)
+	{
+		for (int x = ErodeMinX; x <= ErodeMaxX; x++)
+		{
+			Field[Terrain][Index(x, y)] += Field[Sediment][Index(x, y)] * SedimentScale;
+		}
+	}
+
+	for (int y = 0; y < Size; y++)
+	{
+		for (int x = 0; x < Size; x++)
+		{
+			HeightMap[x + y * Size] = Field[Terrain][Index(x, y)] / HeightScale;
+		}
+	}
+	return true;
+}
+
+/* Downsamples plane by CoarseFactor, erodes it with coarse solver and adds bilinearly upsampled height change back.
+ * Every coarse vertex averages full plane vertices up to half of its spacing away, so narrow ridges do not alias.
+ */
+bool FErosionSolver::SimulateCoarsePass(float* HeightMap, const FErosionContext& Context) const
+{
+	const int Factor = Settings.CoarseFactor;
+	const int HalfFactor = Factor / 2;
+	const int PlaneSize = Settings.ChunkSize;
+	const int CoarseSize = CoarseSolver->Settings.ChunkSize;
+	const FErosionArea Area = Context.Area.IsSet() ? Context.Area.GetValue() : GetChunkArea();
+
+	TArray<float> CoarsePlane;
+	CoarsePlane.SetNumUninitialized(FMath::Square(CoarseSize));
+
+	for (int CoarseY = 0; CoarseY < CoarseSize; CoarseY++)
+	{
+		const int MinY = FMath::Max(CoarseY * Factor - HalfFactor, 0);
+		const int MaxY = FMath::Min(CoarseY * Factor + HalfFactor, PlaneSize - 1);
+
+		for (int CoarseX = 0; CoarseX < CoarseSize; CoarseX++)
+		{
+			const int MinX = FMath::Max(CoarseX * Factor - HalfFactor, 0);
+			const int MaxX = FMath::Min(CoarseX * Factor + HalfFactor, PlaneSize - 1);
+			float Sum = 0.f;
+
+			for (int y = MinY; y <= MaxY; y++)
+			{
+				for (int x = MinX; x <= MaxX; x++)
+				{
+					Sum += HeightMap[x + y * PlaneSize];
+				}
+			}
+			CoarsePlane[CoarseX + CoarseY * CoarseSize] = Sum / ((MaxX - MinX + 1) * (MaxY - MinY + 1));
+		}
+	}
+
+	const TArray<float> Original = CoarsePlane;
+
+	// Inverted seed keeps coarse droplets from spawning where fine droplets of the same index do
+	FErosionContext CoarseContext(~Context.Seed, Context.ChunkCoordinates);
+	CoarseContext.ShouldCancel = Context.ShouldCancel;
+	CoarseContext.bParallel = Context.bParallel;
+
+	FErosionArea CoarseArea;
+	CoarseArea.Spawn = ScaleBounds(Area.Spawn, 1.f / Factor);
+	CoarseArea.Droplet = ScaleBounds(Area.Droplet, 1.f / Factor);
+	CoarseArea.Droplet.MaxX = FMath::Min(CoarseArea.Droplet.MaxX, CoarseSize - 2.f);
+	CoarseArea.Droplet.MaxY = FMath::Min(CoarseArea.Droplet.MaxY, CoarseSize - 2.f);
+	CoarseArea.Erode = ScaleBounds(Area.Erode, 1.f / Factor);
+	CoarseContext.Area = CoarseArea;
+
+	if (!CoarseSolver->SimulateErosion(CoarsePlane, CoarseContext)) return false;
+
+	for (int i = 0; i < CoarsePlane.Num(); i++)
+	{
+		CoarsePlane[i] -= Original[i];
+	}
+
+	// Vertices outside of erode area keep their heights, change fades out towards it through interpolation
+	const int MinX = FMath::CeilToInt(Area.Erode.MinX), MaxX = FMath::FloorToInt(Area.Erode.MaxX);
+	const int MinY = FMath::CeilToInt(Area.Erode.MinY), MaxY = FMath::FloorToInt(Area.Erode.MaxY);
+
+	for (int y = MinY; y <= MaxY; y++)
+	{
+		const float CoarseY = FMath::Min(static_cast<float>(y) / Factor, CoarseSize - 1.f);
+		const int IndexY = FMath::Min(static_cast<int>(CoarseY), CoarseSize - 2);
+		const float OffsetY = CoarseY - IndexY;
+		const float* Row = CoarsePlane.GetData() + IndexY * CoarseSize;
+
+		for (int x = MinX; x <= MaxX; x++)
+		{
+			const float CoarseX = FMath::Min(static_cast<float>(x) / Factor, CoarseSize - 1.f);
+			const int IndexX = FMath::Min(static_cast<int>(CoarseX), CoarseSize - 2);
+			const float OffsetX = CoarseX - IndexX;
+
+			const float North = FMath::Lerp(Row[IndexX], Row[IndexX + 1], OffsetX);
+			const float South = FMath::Lerp(Row[IndexX + CoarseSize], Row[IndexX + CoarseSize + 1], OffsetX);
+			HeightMap[x + y * PlaneSize] += FMath::Lerp(North, South, OffsetY);
+		}
+	}
+	return true;
+}
+
+bool FErosionSolver::SimulateEngine(float* HeightMap, FErosionContext& Context) const
+{
+	switch (Settings.ErosionEngine)
+	{
+	case EErosionEngine::TiledDroplet:
+		return SimulateTiledDroplets(HeightMap, Context);
+	case EErosionEngine::SimdDroplet:
+		return SimulateDropletLanes(HeightMap, Context);
+	case EErosionEngine::PipeModel:
+		return SimulatePipeModel(HeightMap, Context);
+	default:
+		return SimulateDroplets(HeightMap, Context);
+	}
+}
+
+/* Runs droplet engine in batches and measures mean absolute height change of eroded vertices caused by each of them.
+ * Simulation ends once a batch falls below threshold. Batches cut short by context iteration end are measured only
+ * when they have at least half of the droplets, scaled to the full batch.
+ */
+bool FErosionSolver::SimulateUntilConverged(float* HeightMap, FErosionContext& Context) const
+{
+	const int PlaneSize = Settings.ChunkSize;
+	const int BatchSize = Settings.ConvergenceBatchSize;
+	const FErosionArea Area = Context.Area.IsSet() ? Context.Area.GetValue() : GetChunkArea();
+	const int MinX = FMath::Max(0, FMath::CeilToInt(Area.Erode.MinX));
+	const int MaxX = FMath::Min(PlaneSize - 1, FMath::FloorToInt(Area.Erode.MaxX));
+	const int MinY = FMath::Max(0, FMath::CeilToInt(Area.Erode.MinY));
+	const int MaxY = FMath::Min(PlaneSize - 1, FMath::FloorToInt(Area.Erode.MaxY));
+	const int VertexNum = FMath::Max((MaxX - MinX + 1) * (MaxY - MinY + 1), 1);
+
+	const int IterationEnd = Context.IterationEnd;
+	const int LastDroplet = FMath::Min(FineIterationNumber, IterationEnd);
+	TArray<float> Previous;
+	Previous.SetNumUninitialized(FMath::Square(PlaneSize));
+
+	while (!Context.bConverged && Context.IterationIndex < LastDroplet)
+	{
+		const int FirstDroplet = Context.IterationIndex;
+		FMemory::Memcpy(Previous.GetData(), HeightMap, Previous.Num() * sizeof(float));
+
+		Context.IterationEnd = FMath::Min(LastDroplet, FirstDroplet + BatchSize);
+		const bool bCompleted = SimulateEngine(HeightMap, Context);
+		Context.IterationEnd = IterationEnd;
+		if (!bCompleted) return false;
+
+		const int BatchDroplets = Context.IterationIndex - FirstDroplet;
+		if (2 * BatchDroplets < BatchSize) continue;
+
+		double Change = 0.0;
+		for (int y = MinY; y <= MaxY; y++)
+		{
+			for (int x = MinX; x <= MaxX; x++)
+			{
+				Change += FMath::Abs(HeightMap[x + y * PlaneSize] - Previous[x + y * PlaneSize]);
+			}
+		}
+
+		const double MeanChange = Change / VertexNum * BatchSize / BatchDroplets;
+		Context.bConverged = MeanChange < Settings.ConvergenceThreshold;
+	}
+	return true;
+}
+
+bool FErosionSolver::SimulateErosion(TArray<float>& HeightPlane, FErosionContext& Context) const
+{
+	check(HeightPlane.Num() == Settings.ChunkSize * Settings.ChunkSize);
+
+	float* HeightMap = HeightPlane.GetData();
+
+	if (CoarseSolver && !Context.bCoarsePassDone)
+	{
+		if (!SimulateCoarsePass(HeightMap, Context)) return false;
+		Context.bCoarsePassDone = true;
+	}
+
+	if (Settings.SpawnDistribution != EErosionSpawnDistribution::Uniform &&
+		Settings.ErosionEngine != EErosionEngine::PipeModel && !Context.SpawnMap.IsSet())
+	{
+		const FErosionArea Area = Context.Area.IsSet() ? Context.Area.GetValue() : GetChunkArea();
+		Context.SpawnMap.Emplace();
+		BuildSpawnMap(HeightMap, Area.Spawn, Context.SpawnMap.GetValue());
+	}
+
+	const bool bCompleted = Settings.bAdaptiveIterations && Settings.ErosionEngine != EErosionEngine::PipeModel
+		                        ? SimulateUntilConverged(HeightMap, Context)
+		                        : SimulateEngine(HeightMap, Context);
+
+	if (!bCompleted) return false;
+
+	// Pipe model always runs every step, droplet engines may be paused
+	if (Settings.ErosionEngine != EErosionEngine::PipeModel && !Context.bConverged &&
+		Context.IterationIndex < FineIterationNumber)
+		return true;
+
+	if (Settings.bApplyBlur) SeparableBlur(HeightMap, Settings.ChunkSize);
+	Context.bFinished = true;
+	return true;
 }
@@ -1,11 +1,146 @@
 // Fill out your copyright notice in the Description page of Project Settings.
 
 #include "NoiseGenerator.h"
+#include "ErosionCache.h"
+#include "Misc/Paths.h"
+#include "GameFramework/Pawn.h"
 #include "ProceduralMeshComponent.h"
+#include "ProceduralWorld.h"
+#include "TerrainHeightfield.h"
+#include "TerrainChunkCache.h"
+#include "TerrainHeightStore.h"
+
+DECLARE_CYCLE_STAT(TEXT("Terrain noise"), STAT_TerrainNoise, STATGROUP_ProceduralWorld);
+DECLARE_CYCLE_STAT(TEXT("Terrain mask"), STAT_TerrainMask, STATGROUP_ProceduralWorld);
+DECLARE_CYCLE_STAT(TEXT("Terrain erosion"), STAT_TerrainErosion, STATGROUP_ProceduralWorld);
+DECLARE_CYCLE_STAT(TEXT("Terrain mesh"), STAT_TerrainMesh, STATGROUP_ProceduralWorld);
+DECLARE_CYCLE_STAT(TEXT("Terrain upload"), STAT_TerrainUpload, STATGROUP_ProceduralWorld);
+DECLARE_CYCLE_STAT(TEXT("Terrain streaming"), STAT_TerrainStreaming, STATGROUP_ProceduralWorld);
+DECLARE_CYCLE_STAT(TEXT("Terrain memory budget"), STAT_TerrainMemoryBudget, STATGROUP_ProceduralWorld);
+
+namespace
+{
+	// Chunks within a distance form a square, so do the slots of height store
+	int GetChunkDistance(const FIntPoint& A, const FIntPoint& B)
+	{
+		return FMath::Max(FMath::Abs(A.X - B.X), FMath::Abs(A.Y - B.Y));
+	}
+
+	// Mesh stage builds the same grid for every chunk, so equal counts mean equal triangles and UVs
+	bool HasSameTopology(UProceduralMeshComponent* Mesh, int VertexNum, int IndexNum)
+	{
+		const FProcMeshSection* Section = Mesh->GetProcMeshSection(0);
+		return Section && Section->ProcVertexBuffer.Num() == VertexNum && Section->ProcIndexBuffer.Num() == IndexNum;
+	}
+
+	// Section data kept on game thread, render resources are not counted
+	int64 GetSectionBytes(UProceduralMeshComponent* Mesh)
+	{
+		const FProcMeshSection* Section = IsValid(Mesh) ? Mesh->GetProcMeshSection(0) : nullptr;
+		return Section ? Section->ProcVertexBuffer.GetAllocatedSize() + Section->ProcIndexBuffer.GetAllocatedSize() : 0;
+	}
+
+	// Cooked triangle mesh holds about a position per vertex and an index per triangle corner
+	int64 GetCollisionBytes(UProceduralMeshComponent* Mesh)
+	{
+		const FProcMeshSection* Section = IsValid(Mesh) ? Mesh->GetProcMeshSection(0) : nullptr;
+		if (!Section || !Section->bEnableCollision) return 0;
+		return Section->ProcVertexBuffer.Num() * sizeof(FVector) + Section->ProcIndexBuffer.Num() * sizeof(int32);
+	}
+
+	// Collision is cooked only from sections created with it, so the section is created again from its own data
+	void RecreateSection(UProceduralMeshComponent* Mesh, bool bCreateCollision)
+	{
+		const FProcMeshSection* Section = Mesh->GetProcMeshSection(0);
+		if (!Section) return;
+
+		TArray<FVector> Vertices;
+		TArray<FVector> Normals;
+		TArray<FVector2D> UV;
+		TArray<int32> Triangles;
+		Vertices.Reserve(Section->ProcVertexBuffer.Num());
+		Normals.Reserve(Section->ProcVertexBuffer.Num());
+		UV.Reserve(Section->ProcVertexBuffer.Num());
+		Triangles.Reserve(Section->ProcIndexBuffer.Num());
+
+		for (const FProcMeshVertex& Vertex : Section->ProcVertexBuffer)
+		{
+			Vertices.Add(Vertex.Position);
+			Normals.Add(Vertex.Normal);
+			UV.Add(Vertex.UV0);
+		}
+		for (const uint32 Index : Section->ProcIndexBuffer)
+		{
+			Triangles.Add(Index);
+		}
+
+		Mesh->CreateMeshSection(0, Vertices, Triangles, Normals, UV, TArray<FColor>(), TArray<FProcMeshTangent>(),
+		                        bCreateCollision);
+	}
+
+	void HashCurve(uint64& Hash, const FRichCurve& Curve)
+	{
+		for (const FRichCurveKey& Key : Curve.GetConstRefOfKeys())
+		{
+			HashCombineBytes(Hash, Key.InterpMode);
+			HashCombineBytes(Hash, Key.TangentMode);
+			HashCombineBytes(Hash, Key.TangentWeightMode);
+			HashCombineBytes(Hash, Key.Time);
+			HashCombineBytes(Hash, Key.Value);
+			HashCombineBytes(Hash, Key.ArriveTangent);
+			HashCombineBytes(Hash, Key.ArriveTangentWeight);
+			HashCombineBytes(Hash, Key.LeaveTangent);
+			HashCombineBytes(Hash, Key.LeaveTangentWeight);
+		}
+		HashCombineBytes(Hash, Curve.PreInfinityExtrap);
+		HashCombineBytes(Hash, Curve.PostInfinityExtrap);
+	}
+
+	// Everything final heights and terrain vertices of a chunk depend on
+	uint64 HashGenerationSettings(const FTerrainGenerationSettings& Settings, const UCurveFloat* MoatHeightCurve)
+	{
+		uint64 Hash = 0;
+
+		// Every member of noise generator is 4 bytes long, so it has no padding
+		HashCombineBytes(Hash, Settings.NoiseGen);
+		HashCombineBytes(Hash, Settings.NoiseScale);
+		HashCombineBytes(Hash, Settings.GlobalOffsetX);
+		HashCombineBytes(Hash, Settings.GlobalOffsetY);
+		HashCombineBytes(Hash, Settings.MapArraySize);
+		HashCombineBytes(Hash, Settings.NoiseArraySize);
+		HashCombineBytes(Hash, Settings.VertexSize);
+		HashCombineBytes(Hash, Settings.HeightMultiplier);
+		HashCurve(Hash, Settings.TerrainHeightCurve);
+
+		// World size matters only to the mask and to erosion at world edges
+		HashCombineBytes(Hash, Settings.bApplyMask);
+		if (Settings.bApplyMask)
+		{
+			HashCombineBytes(Hash, Settings.MapSize);
+			if (MoatHeightCurve) HashCurve(Hash, MoatHeightCurve->FloatCurve);
+		}
+
+		HashCombineBytes(Hash, Settings.bApplyErosion);
+		if (Settings.bApplyErosion)
+		{
+			HashCombineBytes(Hash, Settings.ErosionSeed);
+			HashCombineBytes(Hash, Settings.ErosionSolver->GetSettingsHash());
+			HashCombineBytes(Hash, Settings.bSeamlessErosion);
+		}
+		if (Settings.bSeamlessErosion)
+		{
+			HashCombineBytes(Hash, Settings.MapSize);
+			HashCombineBytes(Hash, Settings.ErosionHalo);
+			HashCombineBytes(Hash, Settings.SeamlessErosionSolver->GetSettingsHash());
+		}
+		return Hash;
+	}
+}
 
 ANoiseGenerator::ANoiseGenerator()
 {
-	PrimaryActorTick.bCanEverTick = false;
+	// Ticks to stream the world and to keep terrain data within memory budget
+	PrimaryActorTick.bCanEverTick = true;
 
 	NoiseGen.SetFractalType(FastNoiseLite::FractalType_FBm);
 	NoiseGen.SetNoiseType(FastNoiseLite::NoiseType_OpenSimplex2);
@@ -15,37 +150,107 @@ ANoiseGenerator::ANoiseGenerator()
 	ErosionSimulator->VertexSize = VertexSize;
 }
 
-// Sets up chunks in the world
+// Sets up chunks in the world, streamed world starts empty
 void ANoiseGenerator::UpdateWorld()
 {
+	for (FChunkProperties& Chunk : World)
+	{
+		ReleaseChunkMeshes(Chunk);
+		TrackChunkMemory(Chunk);
+	}
+	LoadedChunks.Reset();
+	FreeChunkIndices.Reset();
+	StreamingCenter = FIntPoint(MAX_int32, MAX_int32);
+
+	if (bStreamWorld)
+	{
+		World.Reset();
+
+		// Chunks come and go, so none of them can be the root
+		USceneComponent* Root = NewObject<USceneComponent>(this, TEXT("StreamingRoot"));
+		Root->RegisterComponent();
+		RootComponent = Root;
+
+		// Window follows the player, see UpdateStreaming
+		HeightStore = MakeShared<FTerrainHeightStore, ESPMode::ThreadSafe>(2 * GetUnloadRadius() + 1, MapArraySize,
+		                                                                   NoiseArraySize, VertexSize);
+
+		// Components for every chunk that can be loaded at once, so none are created while the player moves
+		for (int i = TerrainMeshPool.Num(); i < FMath::Square(2 * GetUnloadRadius() + 1); i++)
+		{
+			FChunkProperties Spare;
+			Spare.TerrainMesh = CreateChunkMesh(TEXT("TerrainMesh"), true);
+			Spare.WaterMesh = CreateChunkMesh(TEXT("WaterMesh"), false);
+			ReleaseChunkMeshes(Spare);
+		}
+		return;
+	}
+
 	const int ChunksNumber = FMath::Square(MapSize);
 
-	World.Reserve(ChunksNumber);
+	World.Reset(ChunksNumber);
 
 	for (int y = 0; y < MapSize; y++)
 	{
 		for (int x = 0; x < MapSize; x++)
 		{
-			const FName TerrainObjectName = *FString::Printf(TEXT("TerrainMesh%i"), x + y * MapSize);
 			World.Add(FChunkProperties());
-
-			World[x + y * MapSize].TerrainMesh = NewObject<UProceduralMeshComponent>(
-				this, UProceduralMeshComponent::StaticClass(), TerrainObjectName);
-			World[x + y * MapSize].TerrainMesh->bUseAsyncCooking = true;
-			World[x + y * MapSize].TerrainMesh->RegisterComponent();
-
-			const FName WaterObjectName = *FString::Printf(TEXT("WaterMesh%i"), x + y * MapSize);
-			World.Add(FChunkProperties());
-
-			World[x + y * MapSize].WaterMesh = NewObject<UProceduralMeshComponent>(
-				this, UProceduralMeshComponent::StaticClass(), WaterObjectName);
-			World[x + y * MapSize].WaterMesh->RegisterComponent();
+			AcquireChunkMeshes(World[x + y * MapSize]);
 
 			World[x + y * MapSize].ChunkNumberX = x;
 			World[x + y * MapSize].ChunkNumberY = y;
 		}
 	}
 	RootComponent = World[0].TerrainMesh;
+
+	HeightStore = MakeShared<FTerrainHeightStore, ESPMode::ThreadSafe>(MapSize, MapArraySize, NoiseArraySize,
+	                                                                   VertexSize);
+}
+
+// Released components may wait for garbage collection under their names, so every name is unique
+UProceduralMeshComponent* ANoiseGenerator::CreateChunkMesh(const TCHAR* BaseName, bool bTerrain)
+{
+	UProceduralMeshComponent* Mesh = NewObject<UProceduralMeshComponent>(
+		this, UProceduralMeshComponent::StaticClass(),
+		MakeUniqueObjectName(this, UProceduralMeshComponent::StaticClass(), BaseName));
+	Mesh->bUseAsyncCooking = bTerrain;
+	Mesh->RegisterComponent();
+	return Mesh;
+}
+
+// Pooled components are registered already and stay hidden until the chunk is uploaded
+void ANoiseGenerator::AcquireChunkMeshes(FChunkProperties& Chunk)
+{
+	Chunk.TerrainMesh = TerrainMeshPool.Num() ? TerrainMeshPool.Pop(false) : CreateChunkMesh(TEXT("TerrainMesh"), true);
+	Chunk.WaterMesh = WaterMeshPool.Num() ? WaterMeshPool.Pop(false) : CreateChunkMesh(TEXT("WaterMesh"), false);
+}
+
+// Sections are kept, the next chunk only replaces their vertices. Section without collision is not kept, the next
+// chunk creates it with collision.
+void ANoiseGenerator::ReleaseChunkMeshes(FChunkProperties& Chunk)
+{
+	if (Chunk.bCollisionDropped)
+	{
+		if (IsValid(Chunk.TerrainMesh)) Chunk.TerrainMesh->ClearAllMeshSections();
+		Chunk.bCollisionDropped = false;
+		DroppedCollisionNum--;
+	}
+
+	if (IsValid(Chunk.TerrainMesh))
+	{
+		Chunk.TerrainMesh->SetVisibility(false);
+		Chunk.TerrainMesh->SetCollisionEnabled(ECollisionEnabled::NoCollision);
+		TerrainMeshPool.Add(Chunk.TerrainMesh);
+	}
+	if (IsValid(Chunk.WaterMesh))
+	{
+		Chunk.WaterMesh->SetVisibility(false);
+		WaterMeshPool.Add(Chunk.WaterMesh);
+	}
+
+	Chunk.TerrainMesh = nullptr;
+	Chunk.WaterMesh = nullptr;
+	bMemoryChanged = true;
 }
 
 // Update generator and simulator seed
@@ -56,7 +261,67 @@ void ANoiseGenerator::UpdateGenerator()
 		MapSeed = rand();
 	}
 	NoiseGen.SetSeed(MapSeed);
+	NoiseGen.SetFractalOctaves(Octaves);
+	NoiseGen.SetFractalLacunarity(Lacunarity);
 	ErosionSimulator->ErosionSeed = MapSeed;
+
+	// Everything already started belongs to the previous seed
+	GenerationEpoch->Increment();
+	if (Scheduler) Scheduler->DropStaleJobs();
+}
+
+// Cancels current generation and generates every chunk again with current settings
+void ANoiseGenerator::RegenerateWorld()
+{
+	if (!Scheduler || !TerrainHeightCurve) return;
+
+	UpdateGenerator();
+	// Chunks of previous epoch keep their own solver, so erosion settings can change safely
+	if (bApplyErosion) ErosionSimulator->PrecalculateIndicesAndWeights();
+
+	const APlayerController* PlayerController = GetWorld()->GetFirstPlayerController();
+	const APawn* PlayerPawn = PlayerController ? PlayerController->GetPawn() : nullptr;
+	const float WorldCenter = (bStreamWorld ? 1 : MapSize) * MapArraySize * VertexSize / 2;
+
+	ScheduleGeneration(PlayerPawn ? PlayerPawn->GetActorLocation() : FVector(WorldCenter, WorldCenter, 0.f));
+}
+
+// Snapshot of settings for chunk jobs, so they never read the actor from worker threads
+TSharedRef<const FTerrainGenerationSettings, ESPMode::ThreadSafe> ANoiseGenerator::CreateGenerationSettings() const
+{
+	const TSharedRef<FTerrainGenerationSettings, ESPMode::ThreadSafe> Settings = MakeShared<
+		FTerrainGenerationSettings, ESPMode::ThreadSafe>();
+
+	Settings->NoiseGen = NoiseGen;
+	Settings->NoiseScale = NoiseScale;
+	Settings->GlobalOffsetX = GlobalOffsetX;
+	Settings->GlobalOffsetY = GlobalOffsetY;
+	Settings->bApplyMask = bApplyMask && Mask.IsValid();
+	Settings->Mask = Mask;
+	Settings->bApplyErosion = bApplyErosion && ErosionSimulator->GetSolver().IsValid();
+	Settings->ErosionSeed = ErosionSimulator->ErosionSeed;
+	Settings->ErosionSolver = ErosionSimulator->GetSolver();
+	// Streamed chunks have no fixed set of neighbours to erode with
+	Settings->bSeamlessErosion = Settings->bApplyErosion && ErosionSimulator->GetSeamlessSolver().IsValid() &&
+		!bStreamWorld;
+	Settings->ErosionHalo = ErosionSimulator->HaloSize;
+	Settings->SeamlessErosionSolver = ErosionSimulator->GetSeamlessSolver();
+	Settings->ErosionCache = ErosionSimulator->GetCache();
+	Settings->bProgressiveErosion = Settings->bApplyErosion && bProgressiveErosion;
+	Settings->ErosionCheckpoints = ErosionCheckpoints;
+	Settings->ErosionSliceSize = ErosionSliceSize;
+	if (TerrainHeightCurve) Settings->TerrainHeightCurve = TerrainHeightCurve->FloatCurve;
+	Settings->MapSize = MapSize;
+	Settings->MapArraySize = MapArraySize;
+	Settings->EdgeArraySize = EdgeArraySize;
+	Settings->NoiseArraySize = NoiseArraySize;
+	Settings->VertexSize = VertexSize;
+	Settings->HeightMultiplier = HeightMultiplier;
+	Settings->ChunkCache = ChunkCache;
+	Settings->bCacheChunkMeshes = bCacheChunkMeshes;
+	Settings->SettingsHash = HashGenerationSettings(*Settings, MoatHeightCurve);
+
+	return Settings;
 }
 
 // Creates global mask for influencing global world structure
@@ -116,80 +381,79 @@ TArray<float> ANoiseGenerator::CreateNoiseData(float LocalOffsetX, float LocalOf
 	NoiseGen.SetFractalLacunarity(Lacunarity);
 
 	TArray<float> NoiseData;
+	SampleNoise(*CreateGenerationSettings(), LocalOffsetX, LocalOffsetY, NoiseData, [] { return false; });
+
+	return NoiseData;
+}
+
+// Fills noise array, returns false when cancelled
+bool ANoiseGenerator::SampleNoise(const FTerrainGenerationSettings& Settings, float LocalOffsetX, float LocalOffsetY,
+                                  TArray<float>& NoiseData, TFunctionRef<bool()> ShouldCancel)
+{
+	const int NoiseArraySize = Settings.NoiseArraySize;
 	const float HalfNoiseArraySize = NoiseArraySize / 2;
+	// Local copy, sampling is not const
+	FastNoiseLite NoiseGen = Settings.NoiseGen;
 
-	NoiseData.Reserve(FMath::Square(NoiseArraySize));
+	NoiseData.Reset(FMath::Square(NoiseArraySize));
 
 	for (int y = 0; y < NoiseArraySize; y++)
 	{
+		if (ShouldCancel()) return false;
+
 		for (int x = 0; x < NoiseArraySize; x++)
 		{
-			const float SampleX = (x + LocalOffsetX - HalfNoiseArraySize) * NoiseScale + GlobalOffsetX;
-			const float SampleY = (y + LocalOffsetY - HalfNoiseArraySize) * NoiseScale + GlobalOffsetY;
+			const float SampleX = (x + LocalOffsetX - HalfNoiseArraySize) * Settings.NoiseScale + Settings.GlobalOffsetX;
+			const float SampleY = (y + LocalOffsetY - HalfNoiseArraySize) * Settings.NoiseScale + Settings.GlobalOffsetY;
 			const float NoiseValue = NoiseGen.GetNoise(SampleX, SampleY);
 
 			NoiseData.Add((NoiseValue + 1) / 2);
 		}
 	}
 
-	return NoiseData;
+	return true;
 }
 
-// Generates procedural mesh that is used for terrain and water
-void ANoiseGenerator::GenerateTerrain(int TerrainIndex)
+// Noise stage, samples noise for the chunk area with border
+void ANoiseGenerator::CreateChunkNoise(FTerrainChunkJob& Job)
 {
-	UE_LOG(LogTemp, Warning, TEXT("GenerateTerrain: thread started - %d"), TerrainIndex);
+	SCOPE_CYCLE_COUNTER(STAT_TerrainNoise);
 
-	const float FalloffSquareSideLength = NoiseArraySize * MapSize;
-	const float NoiseArraySizeSquared = FMath::Square(NoiseArraySize);
-	const float NoiseArraySizeSquaredNoBoundary = FMath::Square(NoiseArraySize - 2);
-
-	const FChunkProperties* WorldHandle = &World[TerrainIndex];
-
-	// Get required data from struct
-	UProceduralMeshComponent* Terrain = WorldHandle->TerrainMesh;
-	UProceduralMeshComponent* Water = WorldHandle->WaterMesh;
-	const float ChunkOffsetX = WorldHandle->ChunkNumberX * MapArraySize;
-	const float ChunkOffsetY = WorldHandle->ChunkNumberY * MapArraySize;
-	const float FalloffMapOffset = WorldHandle->ChunkNumberX * NoiseArraySize;
+	const FTerrainGenerationSettings& Settings = *Job.Settings;
 
-	// Data for procedural mesh
-	TArray<float> NoiseArray = CreateNoiseData(ChunkOffsetX, ChunkOffsetY);
-	TArray<FVector> Vertices;
-	TArray<FVector> WaterVertices;
-	TArray<FVector2D> UV;
-	TArray<FVector> Normals;
-	TArray<FVector> WaterNormals;
-	TArray<int32> Triangles;
-	TArray<FVector> TrueVertices;
-	TArray<FVector> TrueNormals;
-
-	//Starting position for chunk
-	const float StartingPositionX = WorldHandle->ChunkNumberX ? ChunkOffsetX * VertexSize : 0;
-	const float StartingPositionY = WorldHandle->ChunkNumberY ? ChunkOffsetY * VertexSize : 0;
+	// Chunk generated with equal settings before goes straight to mesh stage. Chunks of shared heightfield are
+	// generated, their neighbours erode with their heights.
+	if (Settings.ChunkCache && !Job.Heightfield &&
+		Settings.ChunkCache->Load(Settings.SettingsHash, Job.ChunkCoordinates, FMath::Square(Settings.NoiseArraySize),
+		                          FMath::Square(Settings.NoiseArraySize - 2), Job.Heights, Job.TrueVertices,
+		                          Job.TrueNormals))
+	{
+		Job.bCachedHeights = true;
+		Job.NextStage = ETerrainStage::Mesh;
+		return;
+	}
 
-	// The numbers are number of times array is accessed inside loop
-	Vertices.Reserve(NoiseArraySizeSquared);
-	Triangles.Reserve(6 * FMath::Square(MapSize));
-	UV.Reserve(NoiseArraySizeSquared);
-	Normals.Init(FVector(0.f), NoiseArraySizeSquared);
-	TrueVertices.Reserve(NoiseArraySizeSquaredNoBoundary);
-	TrueNormals.Reserve(NoiseArraySizeSquaredNoBoundary);
+	// Cancelled job stays stale, partial samples are released so no later stage can read them
+	if (!SampleNoise(Settings, Job.ChunkCoordinates.X * Settings.MapArraySize,
+	                 Job.ChunkCoordinates.Y * Settings.MapArraySize, Job.NoiseData, [&Job] { return Job.IsStale(); }))
+	{
+		Job.NoiseData.Empty();
+	}
+}
 
-	WaterVertices.Reserve(NoiseArraySizeSquaredNoBoundary);
-	WaterNormals.Reserve(NoiseArraySizeSquaredNoBoundary);
+// Mask stage, combines noise with global mask and turns it into terrain heights
+void ANoiseGenerator::ApplyChunkMask(FTerrainChunkJob& Job)
+{
+	SCOPE_CYCLE_COUNTER(STAT_TerrainMask);
 
-	UE_LOG(LogTemp, Warning, TEXT("GenerateTerrain: ChunkOffsetX - %f, ChunkOffsetY - %f"), ChunkOffsetX,
-	       ChunkOffsetY);
+	const FTerrainGenerationSettings& Settings = *Job.Settings;
+	const int NoiseArraySize = Settings.NoiseArraySize;
+	const float FalloffSquareSideLength = NoiseArraySize * Settings.MapSize;
+	const float FalloffMapOffset = Job.ChunkCoordinates.X * NoiseArraySize;
 
-	/* Mesh building schematic. First triangle is TL->BL->TR, second one is TR->BL->BR.
-	 * TL---TR x++
-	 * |  /  |
-	 * BL---BR
-	 * y++;
-	 */
+	Job.Heights.Reset(FMath::Square(NoiseArraySize));
 
-	// First double loop allocates vertices with border
+	// Allocates heights with border
 	for (int y = 0; y < NoiseArraySize; y++)
 	{
 		for (int x = 0; x < NoiseArraySize; x++)
@@ -197,106 +461,863 @@ void ANoiseGenerator::GenerateTerrain(int TerrainIndex)
 			float Height;
 
 			// Noise and World are clamped from 0 to 1 by HeightCurve
-			if (bApplyMask)
-				Height = HeightMultiplier * TerrainHeightCurve->GetFloatValue(NoiseArray[x + y * NoiseArraySize] +
-					Mask[x + FalloffMapOffset + (y + WorldHandle->ChunkNumberY * NoiseArraySize) *
-						FalloffSquareSideLength]);
+			if (Settings.bApplyMask)
+				Height = Settings.HeightMultiplier * Settings.TerrainHeightCurve.Eval(
+					Job.NoiseData[x + y * NoiseArraySize] + (*Settings.Mask)[x + FalloffMapOffset + (y + Job.
+						ChunkCoordinates.Y * NoiseArraySize) * FalloffSquareSideLength]);
 			else
-				Height = HeightMultiplier * TerrainHeightCurve->GetFloatValue(NoiseArray[x + y * NoiseArraySize]);
+				Height = Settings.HeightMultiplier * Settings.TerrainHeightCurve.Eval(
+					Job.NoiseData[x + y * NoiseArraySize]);
 
-			Vertices.Add(FVector(StartingPositionX + VertexSize * (x - 1), StartingPositionY + VertexSize * (y - 1),
-			                     Height));
+			Job.Heights.Add(Height);
 		}
 	}
 
-	if (bApplyErosion) ErosionSimulator->SimulateErosion(Vertices);
+	Job.NoiseData.Empty();
+
+	// Un-eroded mesh is shown first
+	if (Settings.bProgressiveErosion)
+	{
+		Job.bFinalMesh = false;
+		Job.NextStage = ETerrainStage::Mesh;
+	}
+
+	if (!Job.Heightfield) return;
+
+	// Neighbours erode into the chunk as well, so heights are kept in shared heightfield until mesh stage.
+	// First mesh of progressive chunk uses a copy, neighbours may already erode into the shared plane.
+	if (Settings.bProgressiveErosion)
+		Job.Heightfield->SetHeights(Job.ChunkCoordinates, TArray<float>(Job.Heights));
+	else
+		Job.Heightfield->SetHeights(Job.ChunkCoordinates, MoveTemp(Job.Heights));
+}
+
+// Erosion stage
+void ANoiseGenerator::ErodeChunk(FTerrainChunkJob& Job)
+{
+	SCOPE_CYCLE_COUNTER(STAT_TerrainErosion);
+
+	const FTerrainGenerationSettings& Settings = *Job.Settings;
+
+	if (!Settings.bApplyErosion) return;
+
+	// Own context per chunk, so chunks erode in parallel with a shared solver. Progressive erosion resumes it.
+	if (!Job.ErosionContext)
+	{
+		Job.ErosionContext = MakeShared<FErosionContext, ESPMode::ThreadSafe>(
+			Settings.ErosionSeed, Job.ChunkCoordinates);
+	}
+
+	FErosionContext& Context = *Job.ErosionContext;
+	Context.ShouldCancel = [&Job] { return Job.IsStale(); };
+	Context.bParallel = Settings.bParallelErosion;
+
+	const FErosionSolver& Solver = Job.Heightfield ? *Settings.SeamlessErosionSolver : *Settings.ErosionSolver;
+	int Checkpoint = MAX_int32;
+
+	// Slice ends after a fixed number of droplets or at the next checkpoint, checkpoints are rounded up,
+	// so the next one is always ahead of current droplet
+	if (Settings.bProgressiveErosion)
+	{
+		const int IterationNumber = Solver.GetIterationNumber();
+		const int Intervals = Settings.ErosionCheckpoints + 1;
+		const int64 CheckpointIndex = static_cast<int64>(Context.IterationIndex) * Intervals / IterationNumber + 1;
+
+		Checkpoint = static_cast<int>((CheckpointIndex * IterationNumber + Intervals - 1) / Intervals);
+		Context.IterationEnd = FMath::Min(Context.IterationIndex + Settings.ErosionSliceSize, Checkpoint);
+	}
+
+	if (!Job.Heightfield)
+	{
+		if (!ErodeHeights(Job, Solver, Context, Job.Heights)) return;
+	}
+	else if (!ErodeSeamlessChunk(Job, Solver, Context))
+	{
+		return;
+	}
+
+	const FErosionSettings& ErosionSettings = Solver.GetSettings();
+	// Cached result is loaded without simulating any droplet
+	if (Context.bFinished && Context.IterationIndex && ErosionSettings.bAdaptiveIterations)
+	{
+		UE_LOG(LogTemp, Warning, TEXT("ErodeChunk: chunk %d x %d - %d of %d droplets%s"), Job.ChunkCoordinates.X,
+		       Job.ChunkCoordinates.Y, Context.IterationIndex, Solver.GetIterationNumber(),
+		       Context.bConverged ? TEXT(", converged") : TEXT(""));
+	}
+
+	if (!Settings.bProgressiveErosion) return;
+
+	// Chunk goes back to the queue after every slice, so nearer chunks can take the worker in between
+	if (Context.bFinished)
+		Job.bFinalMesh = true;
+	else if (Context.IterationIndex < Checkpoint)
+		Job.NextStage = ETerrainStage::Erosion;
+}
 
-	// Second double loop calculates normal values, UVs and strips the border
-	for (int y = 0; y < EdgeArraySize; y++)
+// Erodes chunk plane extended by halo of its neighbours, droplets spawn only inside the chunk itself
+bool ANoiseGenerator::ErodeSeamlessChunk(FTerrainChunkJob& Job, const FErosionSolver& Solver,
+                                         FErosionContext& Context)
+{
+	const FTerrainGenerationSettings& Settings = *Job.Settings;
+	const FErosionSettings& ErosionSettings = Solver.GetSettings();
+	const int Halo = Settings.ErosionHalo;
+	const int Radius = ErosionSettings.ErosionRadius;
+	const FIntRect WorldArea = Job.Heightfield->GetWorldArea(Job.ChunkCoordinates, Halo);
+	TArray<float> Window;
+
+	Job.Heightfield->Gather(Job.ChunkCoordinates, Halo, Window);
+
+	// Border is kept only at the edge of the world, inside of it window edge is never reached by erosion brush
+	FErosionArea Area;
+	Area.Spawn.MinX = FMath::Max(Halo + 1, WorldArea.Min.X + Radius);
+	Area.Spawn.MinY = FMath::Max(Halo + 1, WorldArea.Min.Y + Radius);
+	Area.Spawn.MaxX = FMath::Min(Halo + 1 + Settings.MapArraySize, WorldArea.Max.X + 1 - Radius);
+	Area.Spawn.MaxY = FMath::Min(Halo + 1 + Settings.MapArraySize, WorldArea.Max.Y + 1 - Radius);
+	Area.Erode.MinX = WorldArea.Min.X + ErosionSettings.BorderSize;
+	Area.Erode.MinY = WorldArea.Min.Y + ErosionSettings.BorderSize;
+	Area.Erode.MaxX = WorldArea.Max.X - ErosionSettings.BorderSize;
+	Area.Erode.MaxY = WorldArea.Max.Y - ErosionSettings.BorderSize;
+	// Droplet samples one vertex ahead of its position
+	Area.Droplet = Area.Erode;
+	Area.Droplet.MaxX = WorldArea.Max.X - FMath::Max(ErosionSettings.BorderSize, 1);
+	Area.Droplet.MaxY = WorldArea.Max.Y - FMath::Max(ErosionSettings.BorderSize, 1);
+	Context.Area = Area;
+
+	if (!ErodeHeights(Job, Solver, Context, Window)) return false;
+
+	Job.Heightfield->Scatter(Job.ChunkCoordinates, Halo, Window);
+	if (Context.bFinished) Job.Heightfield->MarkEroded(Job.ChunkCoordinates);
+	return true;
+}
+
+// Loads result of equal heights and settings from erosion cache on the first slice, stores it once erosion finishes
+bool ANoiseGenerator::ErodeHeights(FTerrainChunkJob& Job, const FErosionSolver& Solver, FErosionContext& Context,
+                                   TArray<float>& HeightMap)
+{
+	FErosionCache* Cache = Job.Settings->ErosionCache.Get();
+
+	if (Cache && !Job.ErosionCacheKey)
 	{
-		for (int x = 0; x < EdgeArraySize; x++)
+		Job.ErosionCacheKey = FErosionCache::MakeKey(HeightMap, Solver, Context);
+		if (Cache->Load(Job.ErosionCacheKey, HeightMap))
 		{
-			// Smooth normals calculations
-			// Vertex vectors are named after their value
-			const FVector VertexX = Vertices[x + y * NoiseArraySize];
-			const FVector VertexXp1 = Vertices[x + 1 + y * NoiseArraySize];
-			const FVector VertexYp1 = Vertices[x + (y + 1) * NoiseArraySize];
-			const FVector VertexXYp1 = Vertices[x + 1 + (y + 1) * NoiseArraySize];
+			Context.bFinished = true;
+			return true;
+		}
+	}
+
+	if (!Solver.SimulateErosion(HeightMap, Context)) return false;
+
+	if (Cache && Context.bFinished) Cache->Store(Job.ErosionCacheKey, HeightMap);
+	return true;
+}
+
+bool ANoiseGenerator::CanErodeChunk(const FTerrainChunkJob& Job)
+{
+	return !Job.Heightfield || Job.Heightfield->IsErosionReady(Job.ChunkCoordinates);
+}
 
-			const FVector CrossProduct1 = FVector::CrossProduct(VertexXp1 - VertexX, VertexYp1 - VertexX);
-			const FVector CrossProduct2 = FVector::CrossProduct(VertexXp1 - VertexYp1, VertexXYp1 - VertexYp1);
+bool ANoiseGenerator::CanBuildChunkMesh(const FTerrainChunkJob& Job)
+{
+	return !Job.Heightfield || !Job.bFinalMesh || Job.Heightfield->IsMeshReady(Job.ChunkCoordinates);
+}
 
-			Normals[x + y * NoiseArraySize] += CrossProduct1;
-			Normals[x + 1 + y * NoiseArraySize] += CrossProduct1;
-			Normals[x + (y + 1) * NoiseArraySize] += CrossProduct1;
+// Mesh stage, calculates normals, UVs and triangles for terrain and water
+void ANoiseGenerator::BuildChunkMesh(FTerrainChunkJob& Job)
+{
+	SCOPE_CYCLE_COUNTER(STAT_TerrainMesh);
 
-			Normals[x + 1 + y * NoiseArraySize] += CrossProduct2;
-			Normals[x + (y + 1) * NoiseArraySize] += CrossProduct2;
-			Normals[x + 1 + (y + 1) * NoiseArraySize] += CrossProduct2;
+	const FTerrainGenerationSettings& Settings = *Job.Settings;
+	const int MapArraySize = Settings.MapArraySize;
+	const int EdgeArraySize = Settings.EdgeArraySize;
+	const int NoiseArraySize = Settings.NoiseArraySize;
+	const float VertexSize = Settings.VertexSize;
+	const float NoiseArraySizeSquared = FMath::Square(NoiseArraySize);
+	const float NoiseArraySizeSquaredNoBoundary = FMath::Square(NoiseArraySize - 2);
+	const float StartingPositionX = Job.ChunkCoordinates.X * MapArraySize * VertexSize;
+	const float StartingPositionY = Job.ChunkCoordinates.Y * MapArraySize * VertexSize;
 
-			if (x * y > 0)
+	// Final heights of shared heightfield, blur reaches its radius into neighbours, so it matches on both sides
+	if (Job.Heightfield && Job.bFinalMesh)
+	{
+		const FErosionSettings& ErosionSettings = Settings.ErosionSolver->GetSettings();
+		const bool bApplyBlur = ErosionSettings.bApplyBlur;
+		const int Margin = bApplyBlur ? ErosionSettings.BlurRadius : 0;
+		const int WindowSize = NoiseArraySize + 2 * Margin;
+		TArray<float> Window;
+
+		Job.Heightfield->Gather(Job.ChunkCoordinates, Margin, Window);
+		if (bApplyBlur) Settings.ErosionSolver->BlurHeights(Window, WindowSize);
+
+		Job.Heights.SetNumUninitialized(FMath::Square(NoiseArraySize));
+		for (int y = 0; y < NoiseArraySize; y++)
+		{
+			FMemory::Memcpy(&Job.Heights[y * NoiseArraySize], &Window[Margin + (y + Margin) * WindowSize],
+			                NoiseArraySize * sizeof(float));
+		}
+	}
+	// Intermediate mesh of progressive chunk, its plane is written only by the chunk itself until it is eroded
+	else if (Job.Heightfield && !Job.Heights.Num())
+	{
+		Job.Heightfield->Gather(Job.ChunkCoordinates, 0, Job.Heights);
+	}
+
+	const TArray<float>& Heights = Job.Heights;
+	TArray<FVector> Normals;
+	// Intermediate meshes of progressive erosion differ only in heights, so the rest is built once
+	const bool bBuildTopology = !Job.Triangles.Num();
+	// Terrain of cached chunk may be loaded along with its heights
+	const bool bBuildTerrain = !Job.bCachedHeights || !Job.TrueVertices.Num();
+
+	// Vertices with border are expanded from height plane on the fly
+	const auto Vertex = [&](int x, int y)
+	{
+		return FVector(StartingPositionX + VertexSize * (x - 1), StartingPositionY + VertexSize * (y - 1),
+		               Heights[x + y * NoiseArraySize]);
+	};
+
+	/* Mesh building schematic. First triangle is TL->BL->TR, second one is TR->BL->BR.
+	 * TL---TR x++
+	 * |  /  |
+	 * BL---BR
+	 * y++;
+	 */
+
+	// First double loop calculates normal values and strips the border
+	if (bBuildTerrain)
+	{
+		Job.TrueVertices.Reset();
+		Job.TrueNormals.Reset();
+
+		// The numbers are number of times array is accessed inside loop
+		Normals.Init(FVector(0.f), NoiseArraySizeSquared);
+		Job.TrueVertices.Reserve(NoiseArraySizeSquaredNoBoundary);
+		Job.TrueNormals.Reserve(NoiseArraySizeSquaredNoBoundary);
+
+		for (int y = 0; y < EdgeArraySize; y++)
+		{
+			if (Job.IsStale()) return;
+
+			for (int x = 0; x < EdgeArraySize; x++)
 			{
-				WaterVertices.Add(FVector(StartingPositionX + VertexSize * (x - 1),
-				                          StartingPositionY + VertexSize * (y - 1), 0.f));
-				WaterNormals.Add(FVector(0.f, 0.f, 1.f));
-				TrueVertices.Add(Vertices[x + y * NoiseArraySize]);
-				TrueNormals.Add(Normals[x + y * NoiseArraySize]);
-				UV.Add(FVector2D(x, y));
+				// Smooth normals calculations
+				// Vertex vectors are named after their value
+				const FVector VertexX = Vertex(x, y);
+				const FVector VertexXp1 = Vertex(x + 1, y);
+				const FVector VertexYp1 = Vertex(x, y + 1);
+				const FVector VertexXYp1 = Vertex(x + 1, y + 1);
+
+				const FVector CrossProduct1 = FVector::CrossProduct(VertexXp1 - VertexX, VertexYp1 - VertexX);
+				const FVector CrossProduct2 = FVector::CrossProduct(VertexXp1 - VertexYp1, VertexXYp1 - VertexYp1);
+
+				Normals[x + y * NoiseArraySize] += CrossProduct1;
+				Normals[x + 1 + y * NoiseArraySize] += CrossProduct1;
+				Normals[x + (y + 1) * NoiseArraySize] += CrossProduct1;
+
+				Normals[x + 1 + y * NoiseArraySize] += CrossProduct2;
+				Normals[x + (y + 1) * NoiseArraySize] += CrossProduct2;
+				Normals[x + 1 + (y + 1) * NoiseArraySize] += CrossProduct2;
+
+				if (x * y > 0)
+				{
+					Job.TrueVertices.Add(VertexX);
+					Job.TrueNormals.Add(Normals[x + y * NoiseArraySize]);
+				}
 			}
 		}
+
+		for (int i = 0; i < Job.TrueNormals.Num(); i++)
+		{
+			Job.TrueNormals[i].Normalize();
+		}
 	}
 
-	// Third double loop combines correct vertices into triangles. 
-	for (int y = 0; y < MapArraySize; y++)
+	// Water, UVs and triangles are the same for every chunk apart from its position
+	if (bBuildTopology)
 	{
-		for (int x = 0; x < MapArraySize; x++)
+		Job.Triangles.Reserve(6 * FMath::Square(MapArraySize));
+		Job.UV.Reserve(NoiseArraySizeSquared);
+		Job.WaterVertices.Reserve(NoiseArraySizeSquaredNoBoundary);
+		Job.WaterNormals.Reserve(NoiseArraySizeSquaredNoBoundary);
+
+		for (int y = 1; y < EdgeArraySize; y++)
+		{
+			for (int x = 1; x < EdgeArraySize; x++)
+			{
+				Job.WaterVertices.Add(FVector(StartingPositionX + VertexSize * (x - 1),
+				                              StartingPositionY + VertexSize * (y - 1), 0.f));
+				Job.WaterNormals.Add(FVector(0.f, 0.f, 1.f));
+				Job.UV.Add(FVector2D(x, y));
+			}
+		}
+
+		// Second double loop combines correct vertices into triangles.
+		for (int y = 0; y < MapArraySize; y++)
 		{
-			// TL
-			Triangles.Add(x + y * (MapArraySize + 1));
-			// BL
-			Triangles.Add(x + (y + 1) * (MapArraySize + 1));
-			// TR
-			Triangles.Add(x + 1 + y * (MapArraySize + 1));
-			// TR
-			Triangles.Add(x + 1 + y * (MapArraySize + 1));
-			// BL
-			Triangles.Add(x + (y + 1) * (MapArraySize + 1));
-			// BR
-			Triangles.Add(x + 1 + (y + 1) * (MapArraySize + 1));
+			for (int x = 0; x < MapArraySize; x++)
+			{
+				// TL
+				Job.Triangles.Add(x + y * (MapArraySize + 1));
+				// BL
+				Job.Triangles.Add(x + (y + 1) * (MapArraySize + 1));
+				// TR
+				Job.Triangles.Add(x + 1 + y * (MapArraySize + 1));
+				// TR
+				Job.Triangles.Add(x + 1 + y * (MapArraySize + 1));
+				// BL
+				Job.Triangles.Add(x + (y + 1) * (MapArraySize + 1));
+				// BR
+				Job.Triangles.Add(x + 1 + (y + 1) * (MapArraySize + 1));
+			}
 		}
 	}
 
-	for (int i = 0; i < TrueNormals.Num(); i++)
+	// Chunk of seamless epoch that fell back to eroding alone would not match its neighbours, it is not stored
+	if (Job.bFinalMesh && Settings.ChunkCache && (Job.Heightfield || !Settings.bSeamlessErosion) &&
+		(!Job.bCachedHeights || (Settings.bCacheChunkMeshes && bBuildTerrain)))
 	{
-		TrueNormals[i].Normalize();
+		const TArray<FVector> NoVertices;
+		Settings.ChunkCache->Store(Settings.SettingsHash, Job.ChunkCoordinates, Job.Heights,
+		                           Settings.bCacheChunkMeshes ? Job.TrueVertices : NoVertices,
+		                           Settings.bCacheChunkMeshes ? Job.TrueNormals : NoVertices);
 	}
 
-	// Creates objects in main thread, cause you cannot do that elsewhere
-	AsyncTask(ENamedThreads::GameThread, [=]()
+	// Final heights go to height queries on upload, progressive chunk without shared heightfield keeps eroding its own
+	if (!Job.bFinalMesh && Job.Heightfield) Job.Heights.Empty();
+	if (Job.bFinalMesh) FTerrainHeightStore::BuildPyramid(Job.Heights, MapArraySize, NoiseArraySize, Job.HeightPyramid);
+	if (Job.Heightfield && Job.bFinalMesh) Job.Heightfield->MarkMeshed(Job.ChunkCoordinates);
+}
+
+// Upload stage, creates objects in main thread, cause you cannot do that elsewhere
+void ANoiseGenerator::UploadChunk(FTerrainChunkJob& Job)
+{
+	SCOPE_CYCLE_COUNTER(STAT_TerrainUpload);
+
+	if (Job.IsStale() || !World.IsValidIndex(Job.ChunkIndex)) return;
+
+	UProceduralMeshComponent* Terrain = World[Job.ChunkIndex].TerrainMesh;
+	UProceduralMeshComponent* Water = World[Job.ChunkIndex].WaterMesh;
+	if (!IsValid(Terrain) || !IsValid(Water)) return;
+
+	// Components keep their sections across regeneration and pooling, so usually only vertices change. Far chunk
+	// may have dropped its collision, new heights are cooked with it again.
+	FChunkProperties& Chunk = World[Job.ChunkIndex];
+	if (Chunk.bCollisionDropped || !HasSameTopology(Terrain, Job.TrueVertices.Num(), Job.Triangles.Num()) ||
+		!HasSameTopology(Water, Job.WaterVertices.Num(), Job.Triangles.Num()))
 	{
-		Terrain->CreateMeshSection(0, TrueVertices, Triangles, TrueNormals, UV, TArray<FColor>(),
+		Terrain->CreateMeshSection(0, Job.TrueVertices, Job.Triangles, Job.TrueNormals, Job.UV, TArray<FColor>(),
 		                           TArray<FProcMeshTangent>(), true);
+		if (Chunk.bCollisionDropped)
+		{
+			Chunk.bCollisionDropped = false;
+			DroppedCollisionNum--;
+			Terrain->SetCollisionEnabled(ECollisionEnabled::QueryAndPhysics);
+		}
 		Terrain->SetMaterial(0, TerrainMaterial);
 		// ReSharper disable once CppExpressionWithoutSideEffects
 		Terrain->ContainsPhysicsTriMeshData(true);
 
-		Water->CreateMeshSection(0, WaterVertices, Triangles, WaterNormals, UV, TArray<FColor>(),
+		Water->CreateMeshSection(0, Job.WaterVertices, Job.Triangles, Job.WaterNormals, Job.UV, TArray<FColor>(),
 		                         TArray<FProcMeshTangent>(), false);
 		Water->SetMaterial(0, WaterMaterial);
+	}
+	else
+	{
+		// Empty UV keeps the uploaded one, water does not change between meshes of one job
+		Terrain->UpdateMeshSection(0, Job.TrueVertices, Job.TrueNormals, TArray<FVector2D>(), TArray<FColor>(),
+		                           TArray<FProcMeshTangent>());
+		if (!Job.MeshUploads)
+		{
+			Water->UpdateMeshSection(0, Job.WaterVertices, Job.WaterNormals, TArray<FVector2D>(), TArray<FColor>(),
+			                         TArray<FProcMeshTangent>());
+		}
+	}
+
+	// Pooled components are hidden until their chunk has a mesh
+	if (!Job.MeshUploads)
+	{
+		Terrain->SetVisibility(true);
+		Terrain->SetCollisionEnabled(ECollisionEnabled::QueryAndPhysics);
+		Water->SetVisibility(true);
+	}
+
+	if (Job.bFinalMesh)
+	{
+		Chunk.bFinalMesh = true;
+		HeightStore->SetHeights(Job.ChunkCoordinates, Job.Heights, Job.HeightPyramid);
+		Job.Heights.Empty();
+		Job.HeightPyramid.Empty();
+	}
+
+	Job.MeshUploads++;
+	TrackChunkMemory(Chunk);
+	RecordUpload(Job);
+
+	// Intermediate mesh of progressive erosion, chunk continues with the next slice
+	if (!Job.bFinalMesh) Job.NextStage = ETerrainStage::Erosion;
+}
+
+// Logs time from generation start until chunks get their first and their final mesh
+void ANoiseGenerator::RecordUpload(const FTerrainChunkJob& Job)
+{
+	// Streamed world is never complete
+	if (bStreamWorld) return;
+
+	const double Seconds = FPlatformTime::Seconds() - GenerationStartTime;
+
+	if (Job.MeshUploads == 1)
+	{
+		if (!FirstMeshNum) FirstMeshSeconds = Seconds;
+		if (++FirstMeshNum == World.Num())
+			UE_LOG(LogTemp, Warning, TEXT("UploadChunk: first mesh after %.2f ms, every chunk visible after %.2f ms"),
+			       FirstMeshSeconds * 1000.0, Seconds * 1000.0);
+	}
+
+	if (Job.bFinalMesh && ++FinalMeshNum == World.Num())
+	{
+		UE_LOG(LogTemp, Warning, TEXT("UploadChunk: every chunk final after %.2f ms"), Seconds * 1000.0);
+		const TSharedPtr<FErosionCache, ESPMode::ThreadSafe> Cache = ErosionSimulator->GetCache();
+		if (Cache) Cache->LogStats();
+		if (ChunkCache) ChunkCache->LogStats();
+	}
+}
+
+bool ANoiseGenerator::GetHeightAt(const FVector2D& Position, float& Height) const
+{
+	return HeightStore && HeightStore->GetHeightAt(Position, Height);
+}
+
+bool ANoiseGenerator::GetNormalAt(const FVector2D& Position, FVector& Normal) const
+{
+	return HeightStore && HeightStore->GetNormalAt(Position, Normal);
+}
+
+int ANoiseGenerator::GetHeightAt(TArrayView<const FVector2D> Positions, TArrayView<float> Heights,
+                                 TArrayView<bool> Found) const
+{
+	if (HeightStore) return HeightStore->GetHeightsAt(Positions, Heights, Found);
+
+	for (bool& bFound : Found)
+	{
+		bFound = false;
+	}
+	return 0;
+}
+
+int ANoiseGenerator::GetNormalAt(TArrayView<const FVector2D> Positions, TArrayView<FVector> Normals,
+                                 TArrayView<bool> Found) const
+{
+	if (HeightStore) return HeightStore->GetNormalsAt(Positions, Normals, Found);
+
+	for (bool& bFound : Found)
+	{
+		bFound = false;
+	}
+	return 0;
+}
+
+bool ANoiseGenerator::LineTraceTerrain(const FVector& Start, const FVector& End, FVector& HitLocation,
+                                       FVector& HitNormal) const
+{
+	FTerrainRayHit Hit;
+	if (!HeightStore || !HeightStore->LineTrace(Start, End, Hit)) return false;
+
+	HitLocation = Hit.Location;
+	HitNormal = Hit.Normal;
+	return true;
+}
+
+int ANoiseGenerator::LineTraceTerrain(TArrayView<const FVector> Starts, TArrayView<const FVector> Ends,
+                                      TArrayView<FTerrainRayHit> Hits) const
+{
+	if (HeightStore) return HeightStore->LineTrace(Starts, Ends, Hits);
+
+	for (FTerrainRayHit& Hit : Hits)
+	{
+		Hit = FTerrainRayHit();
+		Hit.bIncomplete = true;
+	}
+	return 0;
+}
+
+// Generates procedural mesh that is used for terrain and water, runs every stage for a single chunk
+void ANoiseGenerator::GenerateTerrain(int TerrainIndex)
+{
+	UE_LOG(LogTemp, Warning, TEXT("GenerateTerrain: thread started - %d"), TerrainIndex);
+
+	const FTerrainChunkJobPtr Job = MakeShared<FTerrainChunkJob, ESPMode::ThreadSafe>();
+	Job->ChunkIndex = TerrainIndex;
+	Job->ChunkCoordinates = FIntPoint(World[TerrainIndex].ChunkNumberX, World[TerrainIndex].ChunkNumberY);
+	Job->Epoch = GenerationEpoch->GetValue();
+	Job->EpochCounter = GenerationEpoch;
+
+	// Every stage runs once, so erosion is never sliced. Chunk is not on a worker of the scheduler, so it can erode
+	// on task graph.
+	const TSharedRef<FTerrainGenerationSettings, ESPMode::ThreadSafe> Settings = MakeShared<
+		FTerrainGenerationSettings, ESPMode::ThreadSafe>(*CreateGenerationSettings());
+	Settings->bProgressiveErosion = false;
+	Settings->bParallelErosion = true;
+	Job->Settings = Settings;
+
+	// Chunk loaded from chunk cache goes straight to mesh stage, like it does in the scheduler. Stages leave partial
+	// buffers once the job turns stale, so it is checked after each of them.
+	const auto IsCancelled = [Job, TerrainIndex]
+	{
+		if (!Job->IsStale()) return false;
+
+		UE_LOG(LogTemp, Warning, TEXT("GenerateTerrain: thread cancelled - %d"), TerrainIndex);
+		return true;
+	};
+
+	CreateChunkNoise(*Job);
+	if (IsCancelled()) return;
+	if (!Job->bCachedHeights)
+	{
+		ApplyChunkMask(*Job);
+		if (IsCancelled()) return;
+		ErodeChunk(*Job);
+		if (IsCancelled()) return;
+	}
+	BuildChunkMesh(*Job);
+	if (IsCancelled()) return;
+
+	// Generator may be gone or regenerated by the time game thread gets to it
+	TWeakObjectPtr<ANoiseGenerator> WeakGenerator = this;
+	AsyncTask(ENamedThreads::GameThread, [WeakGenerator, Job]()
+	{
+		ANoiseGenerator* Generator = WeakGenerator.Get();
+		if (Generator && !Job->IsStale()) Generator->UploadChunk(*Job);
 	});
 
-	UE_LOG(LogTemp, Warning, TEXT("GenerateTerrain: thread completed - %s"), *Terrain->GetName());
+	UE_LOG(LogTemp, Warning, TEXT("GenerateTerrain: thread completed - %d"), TerrainIndex);
+}
+
+// Creates worker pool and connects generation stages to it
+void ANoiseGenerator::CreateScheduler()
+{
+	Scheduler = MakeShared<FTerrainScheduler, ESPMode::ThreadSafe>(GenerationWorkers);
+	Scheduler->SetStage(ETerrainStage::Noise, NoiseStageLimits, &ANoiseGenerator::CreateChunkNoise);
+	Scheduler->SetStage(ETerrainStage::Mask, MaskStageLimits, &ANoiseGenerator::ApplyChunkMask);
+	Scheduler->SetStage(ETerrainStage::Erosion, ErosionStageLimits, &ANoiseGenerator::ErodeChunk);
+	Scheduler->SetStage(ETerrainStage::Mesh, MeshStageLimits, &ANoiseGenerator::BuildChunkMesh);
+	Scheduler->SetStageGate(ETerrainStage::Erosion, &ANoiseGenerator::CanErodeChunk);
+	Scheduler->SetStageGate(ETerrainStage::Mesh, &ANoiseGenerator::CanBuildChunkMesh);
+
+	// New chunks wait while their buffers do not fit. Scheduler still starts one once nothing else can run, chunks
+	// of seamless erosion wait at gates for neighbours not admitted yet, so generation never stops for good.
+	const TSharedRef<const FTerrainMemoryBudget, ESPMode::ThreadSafe> Budget = MemoryBudget;
+	const int64 JobBytes = GetChunkJobBytes();
+	Scheduler->SetAdmission([Budget, JobBytes](const FTerrainChunkJob&)
+	{
+		return Budget->CanAllocate(JobBytes);
+	});
+
+	// Scheduler is owned by the generator, so the upload stage never outlives it
+	Scheduler->SetStage(ETerrainStage::Upload, UploadStageLimits, [this](FTerrainChunkJob& Job)
+	{
+		UploadChunk(Job);
+	});
+}
+
+// Queues every chunk for generation in current epoch, ordered by distance to the player
+void ANoiseGenerator::ScheduleGeneration(const FVector& SpawnLocation)
+{
+	EpochSettings = CreateGenerationSettings();
+	EpochHeightfield.Reset();
+	bMemoryChanged = true;
+
+	// Every chunk loaded from cache needs no shared heightfield, a single missing one needs its neighbours generated
+	bool bEveryChunkCached = ChunkCache.IsValid();
+	for (int i = 0; i < World.Num() && bEveryChunkCached && EpochSettings->bSeamlessErosion; i++)
+	{
+		bEveryChunkCached = ChunkCache->Contains(EpochSettings->SettingsHash,
+		                                         FIntPoint(World[i].ChunkNumberX, World[i].ChunkNumberY));
+	}
+
+	if (EpochSettings->bSeamlessErosion && !bEveryChunkCached)
+	{
+		EpochHeightfield = MakeShared<FTerrainHeightfield, ESPMode::ThreadSafe>(MapArraySize, NoiseArraySize);
+		for (const FChunkProperties& Chunk : World)
+		{
+			EpochHeightfield->AddChunk(FIntPoint(Chunk.ChunkNumberX, Chunk.ChunkNumberY));
+		}
+	}
+
+	GenerationStartTime = FPlatformTime::Seconds();
+	FirstMeshNum = 0;
+	FinalMeshNum = 0;
+
+	// Loaded chunks keep their meshes until streaming gets to them within its budget
+	if (bStreamWorld)
+	{
+		for (const TPair<FIntPoint, int>& Pair : LoadedChunks)
+		{
+			World[Pair.Value].bScheduled = false;
+			World[Pair.Value].bFinalMesh = false;
+		}
+		StreamingViewLocation = SpawnLocation;
+
+		UE_LOG(LogTemp, Warning, TEXT("ScheduleGeneration: streaming %d chunks on %d workers, epoch %d"),
+		       FMath::Square(2 * LoadRadius + 1), Scheduler->GetWorkerCount(), GenerationEpoch->GetValue());
+
+		UpdateStreaming(SpawnLocation);
+		return;
+	}
+
+	for (int i = 0; i < World.Num(); i++)
+	{
+		World[i].bFinalMesh = false;
+		const FIntPoint Coordinates(World[i].ChunkNumberX, World[i].ChunkNumberY);
+		Scheduler->Enqueue(CreateChunkJob(i, FVector2D::DistSquared(GetChunkCenter(Coordinates),
+		                                                            FVector2D(SpawnLocation))));
+	}
+
+	UE_LOG(LogTemp, Warning, TEXT("ScheduleGeneration: %d chunks on %d workers, epoch %d"), World.Num(),
+	       Scheduler->GetWorkerCount(), GenerationEpoch->GetValue());
+
+	Scheduler->Dispatch();
+}
+
+FVector2D ANoiseGenerator::GetChunkCenter(const FIntPoint& Coordinates) const
+{
+	const float ChunkWorldSize = MapArraySize * VertexSize;
+	return FVector2D((Coordinates.X + 0.5f) * ChunkWorldSize, (Coordinates.Y + 0.5f) * ChunkWorldSize);
+}
+
+FTerrainChunkJobPtr ANoiseGenerator::CreateChunkJob(int ChunkIndex, float Priority) const
+{
+	const FChunkProperties& Chunk = World[ChunkIndex];
+
+	const FTerrainChunkJobPtr Job = MakeShared<FTerrainChunkJob, ESPMode::ThreadSafe>();
+	Job->ChunkIndex = ChunkIndex;
+	Job->ChunkCoordinates = FIntPoint(Chunk.ChunkNumberX, Chunk.ChunkNumberY);
+	Job->Priority = Priority;
+	Job->Epoch = GenerationEpoch->GetValue();
+	Job->EpochCounter = GenerationEpoch;
+	Job->UnloadCounter = Chunk.UnloadCounter;
+	Job->Settings = EpochSettings;
+	Job->Heightfield = EpochHeightfield;
+	Job->MemoryBudget = MemoryBudget;
+	Job->MemoryEstimate = GetChunkJobBytes();
+
+	return Job;
+}
+
+// Buffers of a chunk job around mesh stage, where they are the largest
+int64 ANoiseGenerator::GetChunkJobBytes() const
+{
+	const int64 PlaneNum = FMath::Square(NoiseArraySize);
+	const int64 VertexNum = FMath::Square(NoiseArraySize - 2);
+
+	return PlaneNum * (sizeof(float) + sizeof(FVector)) + VertexNum * (4 * sizeof(FVector) + sizeof(FVector2D)) +
+		6 * FMath::Square<int64>(MapArraySize) * sizeof(int32);
+}
+
+// Horizontal velocity of the pawn, or of the view point without one, and the rate its direction turns at
+void ANoiseGenerator::UpdateMovement(const FVector& ViewLocation, const APawn* Pawn, float DeltaSeconds)
+{
+	if (DeltaSeconds <= 0.f) return;
+
+	const FVector2D Velocity = Pawn
+		                           ? FVector2D(Pawn->GetVelocity())
+		                           : FVector2D(ViewLocation - StreamingViewLocation) / DeltaSeconds;
+	StreamingViewLocation = ViewLocation;
+
+	// Direction is noisy while standing, turn rate is smoothed over a few frames
+	float TurnRate = 0.f;
+	if (Velocity.SizeSquared() > 1.f && StreamingVelocity.SizeSquared() > 1.f)
+	{
+		const float Turn = FMath::FindDeltaAngleRadians(FMath::Atan2(StreamingVelocity.Y, StreamingVelocity.X),
+		                                                FMath::Atan2(Velocity.Y, Velocity.X));
+		TurnRate = FMath::Clamp(Turn / DeltaSeconds, -PI, PI);
+	}
+	StreamingTurnRate = FMath::Lerp(StreamingTurnRate, TurnRate, FMath::Min(DeltaSeconds * 4.f, 1.f));
+	StreamingVelocity = Velocity;
+}
+
+// Points half a chunk apart along the path of the next PrefetchSeconds with distance travelled to them, the first
+// one is the player
+void ANoiseGenerator::PredictPath(const FVector& ViewLocation, TArray<TPair<FVector2D, float>>& Path) const
+{
+	FVector2D Location(ViewLocation);
+	Path.Emplace(Location, 0.f);
+
+	const float Speed = StreamingVelocity.Size();
+	if (PrefetchSeconds <= 0.f || Speed < 1.f) return;
+
+	const float ChunkWorldSize = MapArraySize * VertexSize;
+	const int StepNum = FMath::Clamp(FMath::CeilToInt(Speed * PrefetchSeconds / (ChunkWorldSize / 2)), 1, 64);
+	const float StepSeconds = PrefetchSeconds / StepNum;
+	const float StepTurn = FMath::RadiansToDegrees(StreamingTurnRate * StepSeconds);
+
+	FVector2D Velocity = StreamingVelocity;
+	for (int i = 1; i <= StepNum; i++)
+	{
+		Velocity = Velocity.GetRotated(StepTurn);
+		Location += Velocity * StepSeconds;
+		Path.Emplace(Location, Speed * StepSeconds * i);
+	}
+}
+
+// Unloads chunks beyond unload radius and starts the most urgent missing ones within frame budget. Chunks within load
+// radius go by distance to the player, chunks along predicted path by distance the player travels until they are
+// within load radius.
+void ANoiseGenerator::UpdateStreaming(const FVector& ViewLocation)
+{
+	SCOPE_CYCLE_COUNTER(STAT_TerrainStreaming);
+
+	const float ChunkWorldSize = MapArraySize * VertexSize;
+	const FIntPoint Center(FMath::FloorToInt(ViewLocation.X / ChunkWorldSize),
+	                       FMath::FloorToInt(ViewLocation.Y / ChunkWorldSize));
+	const int StreamingUnloadRadius = GetUnloadRadius();
+
+	if (Center != StreamingCenter)
+	{
+		// Chunks entering load radius are prefetch hits when they are ready, chunks around spawn are not counted
+		const bool bMoved = StreamingCenter != FIntPoint(MAX_int32, MAX_int32);
+		for (int y = -LoadRadius; y <= LoadRadius && bMoved; y++)
+		{
+			for (int x = -LoadRadius; x <= LoadRadius; x++)
+			{
+				const FIntPoint Coordinates = Center + FIntPoint(x, y);
+				if (GetChunkDistance(Coordinates, StreamingCenter) <= LoadRadius) continue;
+
+				const int* LoadedIndex = LoadedChunks.Find(Coordinates);
+				if (LoadedIndex && World[*LoadedIndex].bFinalMesh)
+					PrefetchStats.Hits++;
+				else
+					PrefetchStats.Misses++;
+				if (LoadedIndex) World[*LoadedIndex].bPrefetched = false;
+			}
+		}
+
+		// Window of height store covers every chunk that is not waiting for unload
+		StreamingCenter = Center;
+		HeightStore->SetWindow(Center - FIntPoint(StreamingUnloadRadius, StreamingUnloadRadius));
+	}
+
+	int Unloads = 0;
+	for (auto It = LoadedChunks.CreateIterator(); It && FrameUnloads < StreamingUnloadsPerFrame; ++It)
+	{
+		if (GetChunkDistance(It.Key(), Center) <= StreamingUnloadRadius) continue;
+
+		if (World[It.Value()].bPrefetched) PrefetchStats.Wasted++;
+		UnloadChunk(It.Value());
+		It.RemoveCurrent();
+		Unloads++;
+		FrameUnloads++;
+	}
+	if (Unloads) Scheduler->DropStaleJobs();
+
+	// Missing chunks and loaded ones without job of current epoch, by urgency
+	TMap<FIntPoint, float> Candidates;
+	int PendingNum = 0;
+
+	for (const TPair<FIntPoint, int>& Pair : LoadedChunks)
+	{
+		const FChunkProperties& Chunk = World[Pair.Value];
+		if (!Chunk.bScheduled)
+			Candidates.Add(Pair.Key, FVector2D::DistSquared(GetChunkCenter(Pair.Key), FVector2D(ViewLocation)));
+		else if (!Chunk.bFinalMesh)
+			PendingNum++;
+	}
+
+	const int Budget = FMath::Min(StreamingLoadsPerFrame, MaxPendingChunks - PendingNum);
+	if (Budget <= 0) return;
+
+	TArray<TPair<FVector2D, float>> Path;
+	PredictPath(ViewLocation, Path);
+	// Budget would unload prefetched chunks right away
+	if (MemoryBudget->GetExcess()) Path.SetNum(1);
+
+	FIntPoint PreviousPointChunk(MAX_int32, MAX_int32);
+	for (const TPair<FVector2D, float>& Point : Path)
+	{
+		const FIntPoint PointChunk(FMath::FloorToInt(Point.Key.X / ChunkWorldSize),
+		                           FMath::FloorToInt(Point.Key.Y / ChunkWorldSize));
+		if (PointChunk == PreviousPointChunk) continue;
+		PreviousPointChunk = PointChunk;
+
+		for (int y = -LoadRadius; y <= LoadRadius; y++)
+		{
+			for (int x = -LoadRadius; x <= LoadRadius; x++)
+			{
+				const FIntPoint Coordinates = PointChunk + FIntPoint(x, y);
+				const int Distance = GetChunkDistance(Coordinates, Center);
+				if (Distance > StreamingUnloadRadius || LoadedChunks.Contains(Coordinates)) continue;
+
+				// Chunk ahead is needed once the player gets to the point, as urgent as a chunk at the edge of load
+				// radius that much further away
+				const FVector2D ChunkCenter = GetChunkCenter(Coordinates);
+				const float Priority = Distance <= LoadRadius
+					                       ? FVector2D::DistSquared(ChunkCenter, FVector2D(ViewLocation))
+					                       : FMath::Square(Point.Value + LoadRadius * ChunkWorldSize);
+				const float* Existing = Candidates.Find(Coordinates);
+				if (!Existing || Priority < *Existing) Candidates.Add(Coordinates, Priority);
+			}
+		}
+	}
+	if (!Candidates.Num()) return;
+
+	Candidates.ValueSort([](float A, float B) { return A < B; });
+
+	int Loads = 0;
+	for (const TPair<FIntPoint, float>& Candidate : Candidates)
+	{
+		if (Loads++ == Budget) break;
+
+		const int* LoadedIndex = LoadedChunks.Find(Candidate.Key);
+		const int ChunkIndex = LoadedIndex ? *LoadedIndex : LoadChunk(Candidate.Key);
+
+		World[ChunkIndex].bScheduled = true;
+		if (!LoadedIndex) World[ChunkIndex].bPrefetched = GetChunkDistance(Candidate.Key, Center) > LoadRadius;
+		Scheduler->Enqueue(CreateChunkJob(ChunkIndex, Candidate.Value));
+	}
+	Scheduler->Dispatch();
+}
+
+int ANoiseGenerator::LoadChunk(const FIntPoint& Coordinates)
+{
+	const int ChunkIndex = FreeChunkIndices.Num() ? FreeChunkIndices.Pop(false) : World.AddDefaulted();
+	FChunkProperties& Chunk = World[ChunkIndex];
+
+	Chunk = FChunkProperties();
+	Chunk.ChunkNumberX = Coordinates.X;
+	Chunk.ChunkNumberY = Coordinates.Y;
+	Chunk.UnloadCounter = MakeShared<FThreadSafeCounter, ESPMode::ThreadSafe>();
+
+	AcquireChunkMeshes(Chunk);
+
+	LoadedChunks.Add(Coordinates, ChunkIndex);
+	return ChunkIndex;
+}
+
+// Job of the chunk is cancelled, its index may be reused right away
+void ANoiseGenerator::UnloadChunk(int ChunkIndex)
+{
+	FChunkProperties& Chunk = World[ChunkIndex];
+
+	Chunk.UnloadCounter->Set(1);
+	HeightStore->RemoveHeights(FIntPoint(Chunk.ChunkNumberX, Chunk.ChunkNumberY));
+
+	ReleaseChunkMeshes(Chunk);
+	TrackChunkMemory(Chunk);
+	Chunk = FChunkProperties();
+
+	FreeChunkIndices.Add(ChunkIndex);
 }
 
 // Called when the game starts, starts async terrain generations
 void ANoiseGenerator::BeginPlay()
 {
-	const float WorldCenter = MapSize * MapArraySize * VertexSize / 2;
+	Super::BeginPlay();
+
+	// Streamed world starts in the middle of chunk 0, 0
+	const float WorldCenter = (bStreamWorld ? 1 : MapSize) * MapArraySize * VertexSize / 2;
+	const FVector SpawnLocation(WorldCenter, WorldCenter, 12000.f);
 	APlayerController* PlayerController = GetWorld()->GetFirstPlayerController();
 
-	PlayerController->ClientSetLocation(FVector(WorldCenter, WorldCenter, 12000.f),
-	                                                          FRotator(0.f)
-	);
+	PlayerController->ClientSetLocation(SpawnLocation, FRotator(0.f));
 	EnableInput(PlayerController);
 
 	if (!TerrainHeightCurve)
@@ -308,14 +1329,198 @@ void ANoiseGenerator::BeginPlay()
 	UpdateWorld();
 	UpdateGenerator();
 
-	if (bApplyMask) Mask = CreateMask();
+	// Mask covers MapSize x MapSize chunks
+	if (bApplyMask && !bStreamWorld) Mask = MakeShared<TArray<float>, ESPMode::ThreadSafe>(CreateMask());
 	if (bApplyErosion) ErosionSimulator->PrecalculateIndicesAndWeights();
+	if (bCacheChunks) ChunkCache = MakeShared<FTerrainChunkCache, ESPMode::ThreadSafe>(
+		FPaths::ProjectSavedDir() / TEXT("ChunkCache"));
+
+	MemoryBudget->SetLimit(static_cast<int64>(MemoryBudgetMB) * 1024 * 1024);
+	CreateScheduler();
+	ScheduleGeneration(SpawnLocation);
+}
+
+// Waits for running chunk generations, chunks that have not started yet are dropped
+void ANoiseGenerator::EndPlay(const EEndPlayReason::Type EndPlayReason)
+{
+	GenerationEpoch->Increment();
+	Scheduler.Reset();
+
+	if (bStreamWorld)
+	{
+		const int Needed = PrefetchStats.Hits + PrefetchStats.Misses;
+		UE_LOG(LogTemp, Warning, TEXT("EndPlay: prefetch hit rate %.1f%% (%d hits, %d misses), %d chunks wasted"),
+		       Needed ? 100.f * PrefetchStats.Hits / Needed : 0.f, PrefetchStats.Hits, PrefetchStats.Misses,
+		       PrefetchStats.Wasted);
+	}
+	MemoryBudget->LogStats();
+	if (ChunkCache && bStreamWorld) ChunkCache->LogStats();
+
+	Super::EndPlay(EndPlayReason);
+}
+
+void ANoiseGenerator::Tick(float DeltaSeconds)
+{
+	Super::Tick(DeltaSeconds);
 
-	for (int i = 0; i < FMath::Square(MapSize); i++)
+	const APlayerController* PlayerController = GetWorld()->GetFirstPlayerController();
+	if (!Scheduler || !EpochSettings || !PlayerController) return;
+
+	// View point works with and without a pawn
+	FVector ViewLocation;
+	FRotator ViewRotation;
+	PlayerController->GetPlayerViewPoint(ViewLocation, ViewRotation);
+
+	FrameUnloads = 0;
+	if (bStreamWorld)
+	{
+		UpdateMovement(ViewLocation, PlayerController->GetPawn(), DeltaSeconds);
+		UpdateStreaming(ViewLocation);
+	}
+	EnforceMemoryBudget(ViewLocation);
+}
+
+void ANoiseGenerator::GetMemoryUsage(int64& CurrentBytes, int64& PeakBytes) const
+{
+	CurrentBytes = MemoryBudget->GetUsed();
+	PeakBytes = MemoryBudget->GetPeak();
+}
+
+// Meshes of released chunk are no longer counted
+void ANoiseGenerator::TrackChunkMemory(const FChunkProperties& Chunk)
+{
+	const FIntPoint Coordinates(Chunk.ChunkNumberX, Chunk.ChunkNumberY);
+
+	MemoryBudget->SetChunkBytes(ETerrainMemory::Meshes, Coordinates,
+	                            GetSectionBytes(Chunk.TerrainMesh) + GetSectionBytes(Chunk.WaterMesh));
+	MemoryBudget->SetChunkBytes(ETerrainMemory::Collision, Coordinates, GetCollisionBytes(Chunk.TerrainMesh));
+	bMemoryChanged = true;
+}
+
+// Collision of terrain is cooked again or freed, returns true on change
+bool ANoiseGenerator::SetChunkCollision(FChunkProperties& Chunk, bool bEnable)
+{
+	if (Chunk.bCollisionDropped != bEnable || !IsValid(Chunk.TerrainMesh) || !Chunk.TerrainMesh->GetProcMeshSection(0))
+		return false;
+
+	RecreateSection(Chunk.TerrainMesh, bEnable);
+	if (bEnable)
+		Chunk.TerrainMesh->SetCollisionEnabled(ECollisionEnabled::QueryAndPhysics);
+	else
+		Chunk.TerrainMesh->SetCollisionEnabled(ECollisionEnabled::NoCollision);
+	Chunk.bCollisionDropped = !bEnable;
+	DroppedCollisionNum += bEnable ? -1 : 1;
+	TrackChunkMemory(Chunk);
+	return true;
+}
+
+// Data not owned by any chunk, polled on game thread
+void ANoiseGenerator::UpdateSharedMemory()
+{
+	const FErosionSolverPtr Solver = ErosionSimulator->GetSolver();
+	const FErosionSolverPtr SeamlessSolver = ErosionSimulator->GetSeamlessSolver();
+	int64 PoolBytes = 0;
+
+	for (UProceduralMeshComponent* Mesh : TerrainMeshPool)
+	{
+		PoolBytes += GetSectionBytes(Mesh) + GetCollisionBytes(Mesh);
+	}
+	for (UProceduralMeshComponent* Mesh : WaterMeshPool)
 	{
-		Async(EAsyncExecution::Thread, [&, i]
+		PoolBytes += GetSectionBytes(Mesh);
+	}
+
+	MemoryBudget->SetSharedBytes(ETerrainMemory::Mask, Mask ? Mask->GetAllocatedSize() : 0);
+	MemoryBudget->SetSharedBytes(ETerrainMemory::ErosionTables, (Solver ? Solver->GetAllocatedSize() : 0) +
+	                             (SeamlessSolver ? SeamlessSolver->GetAllocatedSize() : 0));
+	MemoryBudget->SetSharedBytes(ETerrainMemory::Heightfield,
+	                             EpochHeightfield ? EpochHeightfield->GetAllocatedSize() : 0);
+	MemoryBudget->SetSharedBytes(ETerrainMemory::HeightStore, HeightStore ? HeightStore->GetAllocatedSize() : 0);
+	MemoryBudget->SetSharedBytes(ETerrainMemory::MeshPool, PoolBytes);
+}
+
+// Frees terrain data over budget. Sections of pooled components go first, least recently released first, then
+// collision of far chunks and streamed chunks beyond load radius, farthest first. Chunks next to the player get their
+// collision back regardless of budget.
+void ANoiseGenerator::EnforceMemoryBudget(const FVector& ViewLocation)
+{
+	SCOPE_CYCLE_COUNTER(STAT_TerrainMemoryBudget);
+
+	// Without a limit nothing is freed and no collision waits to come back, usage is republished only on change
+	if (!MemoryBudget->GetLimit() && !DroppedCollisionNum && !bMemoryChanged) return;
+	bMemoryChanged = false;
+
+	const float ChunkWorldSize = MapArraySize * VertexSize;
+	const FIntPoint Center(FMath::FloorToInt(ViewLocation.X / ChunkWorldSize),
+	                       FMath::FloorToInt(ViewLocation.Y / ChunkWorldSize));
+	TArray<TPair<float, int>> FarChunks;
+
+	for (int i = 0; i < World.Num(); i++)
+	{
+		const FChunkProperties& Chunk = World[i];
+		const FIntPoint Coordinates(Chunk.ChunkNumberX, Chunk.ChunkNumberY);
+		// Free index of streamed world
+		if (!IsValid(Chunk.TerrainMesh)) continue;
+
+		if (GetChunkDistance(Coordinates, Center) > 1)
+			FarChunks.Emplace(FVector2D::DistSquared(GetChunkCenter(Coordinates), FVector2D(ViewLocation)), i);
+		else
+			SetChunkCollision(World[i], true);
+	}
+
+	UpdateSharedMemory();
+	int64 Excess = MemoryBudget->GetExcess();
+
+	if (Excess)
+	{
+		// Pools are stacks, components at the bottom were released first
+		const auto TrimPool = [&Excess](TArray<UProceduralMeshComponent*>& Pool)
 		{
-			GenerateTerrain(i);
-		});
+			for (int i = 0; Excess > 0 && i < Pool.Num(); i++)
+			{
+				const int64 Bytes = GetSectionBytes(Pool[i]) + GetCollisionBytes(Pool[i]);
+				if (!Bytes) continue;
+
+				Pool[i]->ClearAllMeshSections();
+				Excess -= Bytes;
+			}
+		};
+		TrimPool(TerrainMeshPool);
+		TrimPool(WaterMeshPool);
+
+		FarChunks.Sort([](const TPair<float, int>& A, const TPair<float, int>& B) { return A.Key > B.Key; });
+
+		// Far chunks are only looked at
+		for (int i = 0; Excess > 0 && i < FarChunks.Num(); i++)
+		{
+			FChunkProperties& Chunk = World[FarChunks[i].Value];
+			const int64 Bytes = GetCollisionBytes(Chunk.TerrainMesh);
+			if (SetChunkCollision(Chunk, false)) Excess -= Bytes;
+		}
+
+		// Shares per frame limit with streaming, so the budget never unloads a burst of chunks at once
+		int Unloads = 0;
+		for (int i = 0; bStreamWorld && Excess > 0 && i < FarChunks.Num(); i++)
+		{
+			if (FrameUnloads >= StreamingUnloadsPerFrame) break;
+
+			FChunkProperties& Chunk = World[FarChunks[i].Value];
+			const FIntPoint Coordinates(Chunk.ChunkNumberX, Chunk.ChunkNumberY);
+			if (GetChunkDistance(Coordinates, Center) <= LoadRadius) continue;
+
+			if (Chunk.bPrefetched) PrefetchStats.Wasted++;
+			Excess -= MemoryBudget->GetChunkBytes(Coordinates);
+			UnloadChunk(FarChunks[i].Value);
+			LoadedChunks.Remove(Coordinates);
+			Unloads++;
+			FrameUnloads++;
+		}
+		if (Unloads) Scheduler->DropStaleJobs();
+
+		UpdateSharedMemory();
 	}
+
+	MemoryBudget->PublishStats();
+	// Admission of new chunks may have changed
+	Scheduler->Dispatch();
 }
@@ -0,0 +1,207 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#include "TerrainChunkCache.h"
+#include "HAL/FileManager.h"
+#include "HAL/PlatformFilemanager.h"
+#include "Hash/CityHash.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Guid.h"
+#include "Misc/Paths.h"
+
+namespace
+{
+	constexpr uint32 CacheMagic = 0x4B4E4843; // "CHNK"
+	// Increment whenever format or generation changes results for equal settings, older files are then rejected
+	constexpr uint32 CacheVersion = 2;
+	const TCHAR* const CacheExtension = TEXT(".chunk");
+	const TCHAR* const TempExtension = TEXT(".tmp");
+	// Written into settings directory on every store, its time stamp orders directories by last use
+	const TCHAR* const UsedFileName = TEXT("LastUsed");
+}
+
+FTerrainChunkCache::FTerrainChunkCache(const FString& InDirectory) : Directory(InDirectory)
+{
+	IFileManager& FileManager = IFileManager::Get();
+	FileManager.MakeDirectory(*Directory, true);
+
+	TArray<FString> SettingsDirectories;
+	FileManager.FindFiles(SettingsDirectories, *(Directory / TEXT("*")), false, true);
+
+	TArray<TPair<FDateTime, FString>> Settings;
+	for (const FString& SettingsDirectory : SettingsDirectories)
+	{
+		const FString Path = Directory / SettingsDirectory;
+		Settings.Emplace(FileManager.GetTimeStamp(*(Path / UsedFileName)), Path);
+	}
+	Settings.Sort([](const TPair<FDateTime, FString>& A, const TPair<FDateTime, FString>& B)
+	{
+		return A.Key > B.Key;
+	});
+
+	for (int i = 0; i < Settings.Num(); i++)
+	{
+		if (i >= MaxSettingsNum)
+		{
+			FileManager.DeleteDirectory(*Settings[i].Value, false, true);
+			continue;
+		}
+
+		// Leftovers of stores interrupted by a crash
+		TArray<FString> TempFiles;
+		FileManager.FindFiles(TempFiles, *Settings[i].Value, TempExtension);
+		for (const FString& TempFile : TempFiles)
+		{
+			FileManager.Delete(*(Settings[i].Value / TempFile), false, false, true);
+		}
+	}
+}
+
+bool FTerrainChunkCache::Contains(uint64 SettingsHash, const FIntPoint& Chunk) const
+{
+	return IFileManager::Get().FileExists(*GetPath(SettingsHash, Chunk));
+}
+
+bool FTerrainChunkCache::Load(uint64 SettingsHash, const FIntPoint& Chunk, int HeightNum, int VertexNum,
+                              TArray<float>& Heights, TArray<FVector>& Vertices, TArray<FVector>& Normals)
+{
+	const FString Path = GetPath(SettingsHash, Chunk);
+	IFileManager& FileManager = IFileManager::Get();
+
+	if (!FileManager.FileExists(*Path))
+	{
+		Misses.Increment();
+		return false;
+	}
+
+	bool bValid;
+	{
+		// Mapped pages are copied straight into job buffers, without reading the whole file into memory first
+		IPlatformFile& PlatformFile = FPlatformFileManager::Get().GetPlatformFile();
+		const TUniquePtr<IMappedFileHandle> Handle(PlatformFile.OpenMapped(*Path));
+		const TUniquePtr<IMappedFileRegion> Region(Handle ? Handle->MapRegion(0, Handle->GetFileSize()) : nullptr);
+
+		if (Region)
+		{
+			bValid = ReadEntry(Region->GetMappedPtr(), Region->GetMappedSize(), SettingsHash, Chunk, HeightNum,
+			                   VertexNum, Heights, Vertices, Normals);
+		}
+		else
+		{
+			TArray<uint8> Data;
+			bValid = FFileHelper::LoadFileToArray(Data, *Path, FILEREAD_Silent) &&
+				ReadEntry(Data.GetData(), Data.Num(), SettingsHash, Chunk, HeightNum, VertexNum, Heights, Vertices,
+				          Normals);
+		}
+	}
+
+	// Mapping is closed by now, some platforms cannot delete mapped files
+	if (!bValid)
+	{
+		UE_LOG(LogTemp, Warning, TEXT("FTerrainChunkCache: invalid entry %s removed"), *Path);
+		FileManager.Delete(*Path, false, false, true);
+		Rejected.Increment();
+		Misses.Increment();
+		return false;
+	}
+
+	Hits.Increment();
+	return true;
+}
+
+void FTerrainChunkCache::Store(uint64 SettingsHash, const FIntPoint& Chunk, const TArray<float>& Heights,
+                               const TArray<FVector>& Vertices, const TArray<FVector>& Normals)
+{
+	check(Vertices.Num() == Normals.Num());
+
+	const int64 HeightBytes = Heights.Num() * sizeof(float);
+	const int64 VertexBytes = Vertices.Num() * sizeof(FVector);
+	TArray<uint8> Data;
+	Data.SetNumUninitialized(sizeof(FHeader) + HeightBytes + 2 * VertexBytes);
+
+	uint8* Payload = Data.GetData() + sizeof(FHeader);
+	FMemory::Memcpy(Payload, Heights.GetData(), HeightBytes);
+	FMemory::Memcpy(Payload + HeightBytes, Vertices.GetData(), VertexBytes);
+	FMemory::Memcpy(Payload + HeightBytes + VertexBytes, Normals.GetData(), VertexBytes);
+
+	FHeader Header;
+	Header.Magic = CacheMagic;
+	Header.Version = CacheVersion;
+	Header.SettingsHash = SettingsHash;
+	Header.ChunkX = Chunk.X;
+	Header.ChunkY = Chunk.Y;
+	Header.HeightNum = Heights.Num();
+	Header.VertexNum = Vertices.Num();
+	Header.Checksum = CityHash64(reinterpret_cast<const char*>(Payload), Data.Num() - sizeof(FHeader));
+	FMemory::Memcpy(Data.GetData(), &Header, sizeof(FHeader));
+
+	// Written under a unique name first, so a concurrent Load never reads a partial file
+	IFileManager& FileManager = IFileManager::Get();
+	const FString SettingsDirectory = GetSettingsDirectory(SettingsHash);
+	const FString TempPath = SettingsDirectory / FGuid::NewGuid().ToString() + TempExtension;
+	const FString Path = GetPath(SettingsHash, Chunk);
+
+	if (!FFileHelper::SaveArrayToFile(Data, *TempPath) || !FileManager.Move(*Path, *TempPath, true, true, false, true))
+	{
+		UE_LOG(LogTemp, Warning, TEXT("FTerrainChunkCache: failed to store %s"), *Path);
+		FileManager.Delete(*TempPath, false, false, true);
+		return;
+	}
+
+	const FString UsedPath = SettingsDirectory / UsedFileName;
+	if (!FileManager.SetTimeStamp(*UsedPath, FDateTime::UtcNow())) FFileHelper::SaveStringToFile(FString(), *UsedPath);
+	Stored.Increment();
+}
+
+void FTerrainChunkCache::LogStats() const
+{
+	UE_LOG(LogTemp, Warning, TEXT("FTerrainChunkCache: %d hits, %d misses, %d invalid, %d stored"), Hits.GetValue(),
+	       Misses.GetValue(), Rejected.GetValue(), Stored.GetValue());
+}
+
+FString FTerrainChunkCache::GetSettingsDirectory(uint64 SettingsHash) const
+{
+	return Directory / FString::Printf(TEXT("%016llx"), SettingsHash);
+}
+
+FString FTerrainChunkCache::GetPath(uint64 SettingsHash, const FIntPoint& Chunk) const
+{
+	return GetSettingsDirectory(SettingsHash) / FString::Printf(TEXT("%d_%d"), Chunk.X, Chunk.Y) + CacheExtension;
+}
+
+bool FTerrainChunkCache::ReadEntry(const uint8* Data, int64 Size, uint64 SettingsHash, const FIntPoint& Chunk,
+                                   int HeightNum, int VertexNum, TArray<float>& Heights, TArray<FVector>& Vertices,
+                                   TArray<FVector>& Normals)
+{
+	if (Size < static_cast<int64>(sizeof(FHeader))) return false;
+
+	FHeader Header;
+	FMemory::Memcpy(&Header, Data, sizeof(FHeader));
+	const uint8* Payload = Data + sizeof(FHeader);
+	const int64 HeightBytes = static_cast<int64>(HeightNum) * sizeof(float);
+	const int64 VertexBytes = static_cast<int64>(Header.VertexNum) * sizeof(FVector);
+
+	if (Header.Magic != CacheMagic || Header.Version != CacheVersion || Header.SettingsHash != SettingsHash ||
+		Header.ChunkX != Chunk.X || Header.ChunkY != Chunk.Y || Header.HeightNum != HeightNum ||
+		Header.VertexNum < 0 || Size != static_cast<int64>(sizeof(FHeader)) + HeightBytes + 2 * VertexBytes ||
+		Header.Checksum != CityHash64(reinterpret_cast<const char*>(Payload), Size - sizeof(FHeader)))
+	{
+		return false;
+	}
+
+	Heights.SetNumUninitialized(HeightNum);
+	FMemory::Memcpy(Heights.GetData(), Payload, HeightBytes);
+
+	// Entry stored without mesh, or with mesh of different size
+	if (!Header.VertexNum || Header.VertexNum != VertexNum)
+	{
+		Vertices.Empty();
+		Normals.Empty();
+		return true;
+	}
+
+	Vertices.SetNumUninitialized(VertexNum);
+	Normals.SetNumUninitialized(VertexNum);
+	FMemory::Memcpy(Vertices.GetData(), Payload + HeightBytes, VertexBytes);
+	FMemory::Memcpy(Normals.GetData(), Payload + HeightBytes + VertexBytes, VertexBytes);
+	return true;
+}
@@ -0,0 +1,538 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#include "TerrainHeightStore.h"
+
+FTerrainHeightStore::FTerrainHeightStore(int InWindowSize, int InChunkStride, int InPlaneSize, float InVertexSize) :
+	WindowSize(InWindowSize), ChunkStride(InChunkStride), PlaneSize(InPlaneSize), VertexSize(InVertexSize)
+{
+	check(WindowSize > 0);
+	check(FMath::IsPowerOfTwo(ChunkStride) && ChunkStride >= 1 << PyramidFirstLevel);
+
+	Slots.SetNum(FMath::Square(WindowSize));
+	TopLevel = FMath::FloorLog2(ChunkStride);
+	PyramidNum = GetPyramidOffset(ChunkStride, TopLevel + 1);
+}
+
+void FTerrainHeightStore::SetWindow(const FIntPoint& WindowMin)
+{
+	check(IsInGameThread());
+
+	Window.Set(static_cast<int64>(static_cast<uint64>(static_cast<uint32>(WindowMin.X)) << 32 |
+		static_cast<uint32>(WindowMin.Y)));
+}
+
+FIntPoint FTerrainHeightStore::GetWindow() const
+{
+	const uint64 Packed = Window.GetValue();
+	return FIntPoint(static_cast<int32>(Packed >> 32), static_cast<int32>(static_cast<uint32>(Packed)));
+}
+
+int FTerrainHeightStore::GetSlot(const FIntPoint& Chunk) const
+{
+	const int SlotX = (Chunk.X % WindowSize + WindowSize) % WindowSize;
+	const int SlotY = (Chunk.Y % WindowSize + WindowSize) % WindowSize;
+	return SlotX + SlotY * WindowSize;
+}
+
+bool FTerrainHeightStore::IsInWindow(const FIntPoint& Chunk, const FIntPoint& WindowMin) const
+{
+	return Chunk.X >= WindowMin.X && Chunk.Y >= WindowMin.Y && Chunk.X < WindowMin.X + WindowSize &&
+		Chunk.Y < WindowMin.Y + WindowSize;
+}
+
+int FTerrainHeightStore::GetPyramidOffset(int ChunkStride, int Level)
+{
+	int Offset = 0;
+	for (int LowerLevel = PyramidFirstLevel; LowerLevel < Level; LowerLevel++)
+	{
+		Offset += FMath::Square(ChunkStride >> LowerLevel);
+	}
+	return Offset;
+}
+
+FFloatInterval FTerrainHeightStore::GetPlaneRange(const float* Heights, int PlaneSize, int Level,
+                                                  const FIntPoint& Cell)
+{
+	// Cell includes vertices on its far edges, plane starts one vertex before chunk origin
+	const int Size = 1 << Level;
+	FFloatInterval Range;
+	for (int y = Cell.Y * Size + 1; y <= (Cell.Y + 1) * Size + 1; y++)
+	{
+		for (int x = Cell.X * Size + 1; x <= (Cell.X + 1) * Size + 1; x++)
+		{
+			Range.Include(Heights[x + y * PlaneSize]);
+		}
+	}
+	return Range;
+}
+
+void FTerrainHeightStore::BuildPyramid(const TArray<float>& Heights, int ChunkStride, int PlaneSize,
+                                       TArray<FFloatInterval>& Pyramid)
+{
+	check(Heights.Num() == PlaneSize * PlaneSize);
+
+	const int TopLevel = FMath::FloorLog2(ChunkStride);
+	Pyramid.SetNumUninitialized(GetPyramidOffset(ChunkStride, TopLevel + 1));
+
+	const int FirstCells = ChunkStride >> PyramidFirstLevel;
+	for (int y = 0; y < FirstCells; y++)
+	{
+		for (int x = 0; x < FirstCells; x++)
+		{
+			Pyramid[x + y * FirstCells] = GetPlaneRange(Heights.GetData(), PlaneSize, PyramidFirstLevel,
+			                                            FIntPoint(x, y));
+		}
+	}
+
+	// Every cell joins the four cells below it
+	for (int Level = PyramidFirstLevel + 1; Level <= TopLevel; Level++)
+	{
+		const int Cells = ChunkStride >> Level;
+		const FFloatInterval* Lower = &Pyramid[GetPyramidOffset(ChunkStride, Level - 1)];
+		FFloatInterval* Current = &Pyramid[GetPyramidOffset(ChunkStride, Level)];
+
+		for (int y = 0; y < Cells; y++)
+		{
+			for (int x = 0; x < Cells; x++)
+			{
+				FFloatInterval Range;
+				for (int Child = 0; Child < 4; Child++)
+				{
+					const FFloatInterval& ChildRange = Lower[x * 2 + Child % 2 + (y * 2 + Child / 2) * Cells * 2];
+					Range.Include(ChildRange.Min);
+					Range.Include(ChildRange.Max);
+				}
+				Current[x + y * Cells] = Range;
+			}
+		}
+	}
+}
+
+void FTerrainHeightStore::SetHeights(const FIntPoint& Chunk, const TArray<float>& Heights,
+                                     const TArray<FFloatInterval>& Pyramid)
+{
+	check(IsInGameThread());
+	check(Heights.Num() == PlaneSize * PlaneSize);
+	check(Pyramid.Num() == PyramidNum);
+
+	// Chunk would take the slot of a chunk inside of the window
+	if (!IsInWindow(Chunk, GetWindow())) return;
+
+	FSlot& Slot = Slots[GetSlot(Chunk)];
+
+	// Increments are full barriers, plane writes stay between them
+	Slot.Version.Increment();
+	Slot.Chunk = Chunk;
+	if (!Slot.Heights.Num()) Slot.Heights.SetNumUninitialized(Heights.Num());
+	if (!Slot.Pyramid.Num()) Slot.Pyramid.SetNumUninitialized(Pyramid.Num());
+	FMemory::Memcpy(Slot.Heights.GetData(), Heights.GetData(), Heights.Num() * sizeof(float));
+	FMemory::Memcpy(Slot.Pyramid.GetData(), Pyramid.GetData(), Pyramid.Num() * sizeof(FFloatInterval));
+	Slot.Version.Increment();
+}
+
+void FTerrainHeightStore::RemoveHeights(const FIntPoint& Chunk)
+{
+	check(IsInGameThread());
+
+	FSlot& Slot = Slots[GetSlot(Chunk)];
+	if (Slot.Chunk != Chunk) return;
+
+	Slot.Version.Increment();
+	Slot.Chunk = FIntPoint(MAX_int32, MAX_int32);
+	Slot.Version.Increment();
+}
+
+SIZE_T FTerrainHeightStore::GetAllocatedSize() const
+{
+	SIZE_T Size = Slots.GetAllocatedSize();
+	for (const FSlot& Slot : Slots)
+	{
+		Size += Slot.Heights.GetAllocatedSize() + Slot.Pyramid.GetAllocatedSize();
+	}
+	return Size;
+}
+
+bool FTerrainHeightStore::FindSquare(const FVector2D& Position, const FIntPoint& WindowMin, FSquare& Square) const
+{
+	const float VertexX = Position.X / VertexSize;
+	const float VertexY = Position.Y / VertexSize;
+
+	// Written so that NaN is outside as well, far edge of the window belongs to the last chunk
+	const FIntPoint WindowVertices = WindowMin * ChunkStride;
+	const int WindowVertexNum = WindowSize * ChunkStride;
+	if (!(VertexX >= WindowVertices.X && VertexX <= WindowVertices.X + WindowVertexNum &&
+		VertexY >= WindowVertices.Y && VertexY <= WindowVertices.Y + WindowVertexNum))
+		return false;
+
+	const int GlobalX = FMath::FloorToInt(VertexX);
+	const int GlobalY = FMath::FloorToInt(VertexY);
+	// Plane of the chunk reaches one vertex beyond it
+	Square.Chunk = FIntPoint(FMath::Min(GlobalX >> TopLevel, WindowMin.X + WindowSize - 1),
+	                         FMath::Min(GlobalY >> TopLevel, WindowMin.Y + WindowSize - 1));
+	Square.Slot = GetSlot(Square.Chunk);
+	Square.Index = GlobalX - Square.Chunk.X * ChunkStride + 1 + (GlobalY - Square.Chunk.Y * ChunkStride + 1) *
+		PlaneSize;
+	Square.OffsetX = VertexX - GlobalX;
+	Square.OffsetY = VertexY - GlobalY;
+	return true;
+}
+
+template <typename TSample>
+int FTerrainHeightStore::SampleSquares(TArrayView<const FVector2D> Positions, TArrayView<bool> Found,
+                                       TSample&& Sample) const
+{
+	check(Found.Num() == Positions.Num());
+
+	int FoundNum = 0;
+	int Index = 0;
+	FSquare Square;
+	// Positions of one chunk stay in one slot while window moves during the call
+	const FIntPoint WindowMin = GetWindow();
+
+	const auto NextInSlot = [&](int SlotIndex)
+	{
+		return Index < Positions.Num() && FindSquare(Positions[Index], WindowMin, Square) && Square.Slot == SlotIndex;
+	};
+
+	while (Index < Positions.Num())
+	{
+		if (!FindSquare(Positions[Index], WindowMin, Square))
+		{
+			Found[Index++] = false;
+			continue;
+		}
+
+		const int SlotIndex = Square.Slot;
+		const FSlot& Slot = Slots[SlotIndex];
+		const int RunStart = Index;
+		const int32 Version = Slot.Version.GetValue();
+
+		// Plane is being written, game thread finishes it within microseconds
+		if (Version & 1)
+		{
+			FPlatformProcess::Sleep(0.f);
+			continue;
+		}
+
+		// Slot may be empty or hold another chunk that has not left it yet
+		const bool bStored = Version && Slot.Chunk == Square.Chunk;
+		const float* Heights = Slot.Heights.GetData();
+		int RunFound = 0;
+		do
+		{
+			if (bStored)
+			{
+				const FCorners Corners = {
+					Heights[Square.Index], Heights[Square.Index + 1], Heights[Square.Index + PlaneSize],
+					Heights[Square.Index + PlaneSize + 1]
+				};
+				Sample(Index, Square, Corners);
+				RunFound++;
+			}
+			Found[Index++] = bStored;
+		}
+		while (NextInSlot(SlotIndex));
+
+		// Plane changed while it was read, results of the run are overwritten by the next attempt
+		FPlatformMisc::MemoryBarrier();
+		if (Slot.Version.GetValue() != Version)
+		{
+			Index = RunStart;
+			continue;
+		}
+		FoundNum += RunFound;
+	}
+	return FoundNum;
+}
+
+float FTerrainHeightStore::SampleHeight(const FSquare& Square, const FCorners& Corners) const
+{
+	const float North = FMath::Lerp(Corners[0], Corners[1], Square.OffsetX);
+	const float South = FMath::Lerp(Corners[2], Corners[3], Square.OffsetX);
+	return FMath::Lerp(North, South, Square.OffsetY);
+}
+
+// Gradient of bilinear surface, same orientation as mesh normals
+FVector FTerrainHeightStore::SampleNormal(const FSquare& Square, const FCorners& Corners) const
+{
+	const float GradientX = FMath::Lerp(Corners[1] - Corners[0], Corners[3] - Corners[2], Square.OffsetY);
+	const float GradientY = FMath::Lerp(Corners[2] - Corners[0], Corners[3] - Corners[1], Square.OffsetX);
+	return FVector(-GradientX, -GradientY, VertexSize).GetSafeNormal();
+}
+
+int FTerrainHeightStore::GetHeightsAt(TArrayView<const FVector2D> Positions, TArrayView<float> Heights,
+                                      TArrayView<bool> Found) const
+{
+	check(Heights.Num() == Positions.Num());
+
+	return SampleSquares(Positions, Found, [&](int Index, const FSquare& Square, const FCorners& Corners)
+	{
+		Heights[Index] = SampleHeight(Square, Corners);
+	});
+}
+
+int FTerrainHeightStore::GetNormalsAt(TArrayView<const FVector2D> Positions, TArrayView<FVector> Normals,
+                                      TArrayView<bool> Found) const
+{
+	check(Normals.Num() == Positions.Num());
+
+	return SampleSquares(Positions, Found, [&](int Index, const FSquare& Square, const FCorners& Corners)
+	{
+		Normals[Index] = SampleNormal(Square, Corners);
+	});
+}
+
+bool FTerrainHeightStore::GetHeightAt(const FVector2D& Position, float& Height) const
+{
+	bool bFound = false;
+	GetHeightsAt(MakeArrayView(&Position, 1), MakeArrayView(&Height, 1), MakeArrayView(&bFound, 1));
+	return bFound;
+}
+
+bool FTerrainHeightStore::GetNormalAt(const FVector2D& Position, FVector& Normal) const
+{
+	bool bFound = false;
+	GetNormalsAt(MakeArrayView(&Position, 1), MakeArrayView(&Normal, 1), MakeArrayView(&bFound, 1));
+	return bFound;
+}
+
+double FTerrainHeightStore::ExitCell(const FRay& Ray, const FIntPoint& Square, int Level, double End,
+                                     FIntPoint& Next)
+{
+	const int Size = 1 << Level;
+	const FIntPoint CellStart(Square.X >> Level << Level, Square.Y >> Level << Level);
+
+	const double ExitU = Ray.DirectionU > 0.0
+		                     ? (CellStart.X + Size - Ray.U) / Ray.DirectionU
+		                     : Ray.DirectionU < 0.0
+		                     ? (CellStart.X - Ray.U) / Ray.DirectionU
+		                     : End;
+	const double ExitV = Ray.DirectionV > 0.0
+		                     ? (CellStart.Y + Size - Ray.V) / Ray.DirectionV
+		                     : Ray.DirectionV < 0.0
+		                     ? (CellStart.Y - Ray.V) / Ray.DirectionV
+		                     : End;
+
+	Next = Square;
+	if (FMath::Min(ExitU, ExitV) >= End) return End;
+
+	// Square on the other axis is clamped to the cell, so every step leaves the cell even with rounding errors
+	if (ExitU <= ExitV)
+	{
+		Next.X = Ray.DirectionU > 0.0 ? CellStart.X + Size : CellStart.X - 1;
+		Next.Y = FMath::Clamp(FMath::FloorToInt(Ray.V + ExitU * Ray.DirectionV), CellStart.Y, CellStart.Y + Size - 1);
+		return ExitU;
+	}
+	Next.X = FMath::Clamp(FMath::FloorToInt(Ray.U + ExitV * Ray.DirectionU), CellStart.X, CellStart.X + Size - 1);
+	Next.Y = Ray.DirectionV > 0.0 ? CellStart.Y + Size : CellStart.Y - 1;
+	return ExitV;
+}
+
+bool FTerrainHeightStore::IntersectSquare(const FRay& Ray, const float* Heights, const FIntPoint& Square,
+                                          const FIntPoint& Local, double Time, double Exit, double& HitTime) const
+{
+	const int Index = Local.X + 1 + (Local.Y + 1) * PlaneSize;
+	const double Height = Heights[Index];
+	const double SlopeU = Heights[Index + 1] - Height;
+	const double SlopeV = Heights[Index + PlaneSize] - Height;
+	const double Twist = Heights[Index + PlaneSize + 1] - Heights[Index + 1] - Heights[Index + PlaneSize] + Height;
+
+	// Ray height minus bilinear surface height is quadratic along the ray
+	const double U = Ray.U - Square.X;
+	const double V = Ray.V - Square.Y;
+	const double A = -Twist * Ray.DirectionU * Ray.DirectionV;
+	const double B = Ray.DirectionZ - SlopeU * Ray.DirectionU - SlopeV * Ray.DirectionV - Twist * (U * Ray.DirectionV +
+		V * Ray.DirectionU);
+	const double C = Ray.Z - Height - SlopeU * U - SlopeV * V - Twist * U * V;
+	const auto Above = [&](double T) { return (A * T + B) * T + C; };
+
+	if (Above(Time) <= 0.0)
+	{
+		HitTime = Time;
+		return true;
+	}
+
+	// Stable roots, the first one in range is where ray goes below the surface
+	double Roots[2] = {TNumericLimits<double>::Max(), TNumericLimits<double>::Max()};
+	if (A == 0.0)
+	{
+		if (B != 0.0) Roots[0] = -C / B;
+	}
+	else
+	{
+		const double Discriminant = B * B - 4.0 * A * C;
+		if (Discriminant >= 0.0)
+		{
+			const double Q = -0.5 * (B + (B < 0.0 ? -1.0 : 1.0) * FMath::Sqrt(Discriminant));
+			Roots[0] = Q / A;
+			if (Q != 0.0) Roots[1] = C / Q;
+		}
+	}
+
+	HitTime = TNumericLimits<double>::Max();
+	for (const double Root : Roots)
+	{
+		if (Root >= Time && Root <= Exit) HitTime = FMath::Min(HitTime, Root);
+	}
+	if (HitTime <= Exit) return true;
+
+	// Root lost to rounding right at the exit
+	HitTime = Exit;
+	return Above(Exit) <= 0.0;
+}
+
+FTerrainHeightStore::ETraceResult FTerrainHeightStore::TraceChunk(const FRay& Ray, const FSlot& Slot,
+                                                                  const FIntPoint& Chunk, double End,
+                                                                  double& Time, FIntPoint& Square) const
+{
+	const float* Heights = Slot.Heights.GetData();
+	const FFloatInterval* Pyramid = Slot.Pyramid.GetData();
+	const FIntPoint Origin = Chunk * ChunkStride;
+	int Level = TopLevel;
+
+	while (true)
+	{
+		FIntPoint Next;
+		const double Exit = FMath::Max(Time, ExitCell(Ray, Square, Level, End, Next));
+		const FIntPoint Local = Square - Origin;
+		const FIntPoint Cell(Local.X >> Level, Local.Y >> Level);
+
+		const FFloatInterval Range = Level >= PyramidFirstLevel
+			                             ? Pyramid[GetPyramidOffset(ChunkStride, Level) + Cell.X + Cell.Y * (
+				                             ChunkStride >> Level)]
+			                             : GetPlaneRange(Heights, PlaneSize, Level, Cell);
+		const double EntryZ = Ray.Z + Time * Ray.DirectionZ;
+		const double ExitZ = Ray.Z + Exit * Ray.DirectionZ;
+
+		// Segment below the whole cell is a hit as well, so only cells it passes above are skipped
+		if (FMath::Min(EntryZ, ExitZ) <= Range.Max)
+		{
+			// Square at Time lies in the lower cell the ray enters first
+			if (Level)
+			{
+				Level--;
+				continue;
+			}
+
+			double HitTime;
+			if (IntersectSquare(Ray, Heights, Square, Local, Time, Exit, HitTime))
+			{
+				Time = HitTime;
+				return ETraceResult::Hit;
+			}
+		}
+
+		if (Exit >= End) return ETraceResult::Finished;
+
+		Time = Exit;
+		Square = Next;
+		if (Square.X >> TopLevel != Chunk.X || Square.Y >> TopLevel != Chunk.Y) return ETraceResult::LeftChunk;
+
+		// Cells above are tried again after every step, so empty space is skipped in large steps
+		Level = FMath::Min(Level + 1, TopLevel);
+	}
+}
+
+bool FTerrainHeightStore::LineTrace(const FVector& Start, const FVector& End, FTerrainRayHit& Hit) const
+{
+	Hit = FTerrainRayHit();
+
+	FRay Ray;
+	Ray.U = Start.X / VertexSize;
+	Ray.V = Start.Y / VertexSize;
+	Ray.Z = Start.Z;
+	Ray.DirectionU = (End.X - Start.X) / VertexSize;
+	Ray.DirectionV = (End.Y - Start.Y) / VertexSize;
+	Ray.DirectionZ = End.Z - Start.Z;
+
+	// Clip segment to the window, written so that NaN is clipped away as well
+	const FIntPoint WindowMin = GetWindow();
+	const FIntPoint SquaresMin = WindowMin * ChunkStride;
+	const FIntPoint SquaresMax = SquaresMin + FIntPoint(WindowSize * ChunkStride, WindowSize * ChunkStride);
+	double Time = 0.0;
+	double EndTime = 1.0;
+	const auto Clip = [&Time, &EndTime](double Position, double Direction, double Min, double Max)
+	{
+		if (Direction == 0.0) return Position >= Min && Position <= Max;
+
+		const double Enter = (Direction > 0.0 ? Min : Max) - Position;
+		const double Leave = (Direction > 0.0 ? Max : Min) - Position;
+		Time = FMath::Max(Time, Enter / Direction);
+		EndTime = FMath::Min(EndTime, Leave / Direction);
+		return Time <= EndTime;
+	};
+	if (!Clip(Ray.U, Ray.DirectionU, SquaresMin.X, SquaresMax.X) ||
+		!Clip(Ray.V, Ray.DirectionV, SquaresMin.Y, SquaresMax.Y))
+		return false;
+
+	FIntPoint Square(
+		FMath::Clamp(FMath::FloorToInt(Ray.U + Time * Ray.DirectionU), SquaresMin.X, SquaresMax.X - 1),
+		FMath::Clamp(FMath::FloorToInt(Ray.V + Time * Ray.DirectionV), SquaresMin.Y, SquaresMax.Y - 1));
+
+	while (true)
+	{
+		const FIntPoint Chunk(Square.X >> TopLevel, Square.Y >> TopLevel);
+		const FSlot& Slot = Slots[GetSlot(Chunk)];
+		const int32 Version = Slot.Version.GetValue();
+
+		// Plane is being written, game thread finishes it within microseconds
+		if (Version & 1)
+		{
+			FPlatformProcess::Sleep(0.f);
+			continue;
+		}
+
+		ETraceResult Result;
+		if (!Version || Slot.Chunk != Chunk)
+		{
+			// Chunk has no final heights yet or left the window, crossed in a single step
+			Hit.bIncomplete = true;
+			FIntPoint Next;
+			const double Exit = FMath::Max(Time, ExitCell(Ray, Square, TopLevel, EndTime, Next));
+			Result = Exit >= EndTime ? ETraceResult::Finished : ETraceResult::LeftChunk;
+			Time = Exit;
+			Square = Next;
+		}
+		else
+		{
+			const double EntryTime = Time;
+			const FIntPoint EntrySquare = Square;
+			Result = TraceChunk(Ray, Slot, Chunk, EndTime, Time, Square);
+
+			// Plane changed while it was read, chunk is traced again
+			FPlatformMisc::MemoryBarrier();
+			if (Slot.Version.GetValue() != Version)
+			{
+				Time = EntryTime;
+				Square = EntrySquare;
+				continue;
+			}
+		}
+
+		if (Result == ETraceResult::Hit)
+		{
+			Hit.bHit = true;
+			Hit.Time = Time;
+			Hit.Location = Start + (End - Start) * Time;
+			GetNormalAt(FVector2D(Hit.Location), Hit.Normal);
+			return true;
+		}
+
+		if (Result == ETraceResult::Finished || Square.X < SquaresMin.X || Square.Y < SquaresMin.Y ||
+			Square.X >= SquaresMax.X || Square.Y >= SquaresMax.Y)
+			return false;
+	}
+}
+
+int FTerrainHeightStore::LineTrace(TArrayView<const FVector> Starts, TArrayView<const FVector> Ends,
+                                   TArrayView<FTerrainRayHit> Hits) const
+{
+	check(Ends.Num() == Starts.Num() && Hits.Num() == Starts.Num());
+
+	int HitNum = 0;
+	for (int i = 0; i < Starts.Num(); i++)
+	{
+		HitNum += LineTrace(Starts[i], Ends[i], Hits[i]);
+	}
+	return HitNum;
+}
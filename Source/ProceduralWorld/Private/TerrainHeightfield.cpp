@@ -0,0 +1,224 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#include "TerrainHeightfield.h"
+
+namespace
+{
+	// Rounds towards negative infinity, so chunks with negative coordinates are handled the same way
+	int FloorDivide(int Value, int Divisor)
+	{
+		return Value >= 0 ? Value / Divisor : (Value - Divisor + 1) / Divisor;
+	}
+}
+
+FTerrainHeightfield::FTerrainHeightfield(int InChunkStride, int InPlaneSize) : ChunkStride(InChunkStride),
+                                                                              PlaneSize(InPlaneSize)
+{
+}
+
+void FTerrainHeightfield::AddChunk(const FIntPoint& Chunk)
+{
+	check(IsInGameThread());
+
+	Cells.Add(Chunk, MakeUnique<FCell>());
+	MinChunk = MinChunk.ComponentMin(Chunk);
+	MaxChunk = MaxChunk.ComponentMax(Chunk);
+}
+
+void FTerrainHeightfield::SetHeights(const FIntPoint& Chunk, TArray<float>&& Heights)
+{
+	FCell& Cell = *Cells.FindChecked(Chunk);
+	check(Heights.Num() == PlaneSize * PlaneSize);
+
+	AllocatedSize.Add(Heights.GetAllocatedSize() - Cell.Heights.GetAllocatedSize());
+	Cell.Heights = MoveTemp(Heights);
+	Cell.Progress.Set(HeightsReady);
+}
+
+void FTerrainHeightfield::GetNeighbourhood(const FIntPoint& Chunk, FNeighbourhood& Neighbourhood) const
+{
+	for (int y = 0; y < 3; y++)
+	{
+		for (int x = 0; x < 3; x++)
+		{
+			const TUniquePtr<FCell>* Cell = Cells.Find(Chunk + FIntPoint(x - 1, y - 1));
+			Neighbourhood[y][x] = Cell ? Cell->Get() : nullptr;
+		}
+	}
+}
+
+bool FTerrainHeightfield::IsErosionReady(const FIntPoint& Chunk) const
+{
+	FNeighbourhood Neighbourhood;
+	GetNeighbourhood(Chunk, Neighbourhood);
+
+	for (int y = 0; y < 3; y++)
+	{
+		for (int x = 0; x < 3; x++)
+		{
+			const FCell* Cell = Neighbourhood[y][x];
+			if (!Cell) continue;
+
+			const int Progress = Cell->Progress.GetValue();
+			if (Progress < HeightsReady) return false;
+
+			// Neighbours always have a different colour than the chunk itself
+			const FIntPoint Neighbour = Chunk + FIntPoint(x - 1, y - 1);
+			if (Neighbour != Chunk && GetColour(Neighbour) < GetColour(Chunk) && Progress < Eroded) return false;
+		}
+	}
+	return true;
+}
+
+bool FTerrainHeightfield::IsMeshReady(const FIntPoint& Chunk) const
+{
+	FNeighbourhood Neighbourhood;
+	GetNeighbourhood(Chunk, Neighbourhood);
+
+	for (int y = 0; y < 3; y++)
+	{
+		for (int x = 0; x < 3; x++)
+		{
+			if (Neighbourhood[y][x] && Neighbourhood[y][x]->Progress.GetValue() < Eroded) return false;
+		}
+	}
+	return true;
+}
+
+bool FTerrainHeightfield::IsNeighbourhoodMeshed(const FIntPoint& Chunk) const
+{
+	FNeighbourhood Neighbourhood;
+	GetNeighbourhood(Chunk, Neighbourhood);
+
+	for (int y = 0; y < 3; y++)
+	{
+		for (int x = 0; x < 3; x++)
+		{
+			if (Neighbourhood[y][x] && Neighbourhood[y][x]->Progress.GetValue() < Meshed) return false;
+		}
+	}
+	return true;
+}
+
+FIntRect FTerrainHeightfield::GetWorldArea(const FIntPoint& Chunk, int Margin) const
+{
+	const int WindowSize = PlaneSize + 2 * Margin;
+	const FIntPoint Origin = Chunk * ChunkStride - FIntPoint(1 + Margin, 1 + Margin);
+	const FIntPoint WorldMin = MinChunk * ChunkStride - FIntPoint(1, 1);
+	const FIntPoint WorldMax = MaxChunk * ChunkStride + FIntPoint(PlaneSize - 2, PlaneSize - 2);
+
+	return FIntRect((WorldMin - Origin).ComponentMax(FIntPoint(0, 0)),
+	                (WorldMax - Origin).ComponentMin(FIntPoint(WindowSize - 1, WindowSize - 1)));
+}
+
+void FTerrainHeightfield::Gather(const FIntPoint& Chunk, int Margin, TArray<float>& Window) const
+{
+	checkf(Margin < ChunkStride - 1, TEXT("Window has to stay within direct neighbours"));
+
+	const int WindowSize = PlaneSize + 2 * Margin;
+	const FIntPoint Origin = Chunk * ChunkStride - FIntPoint(1 + Margin, 1 + Margin);
+	const FIntPoint WorldMin = MinChunk * ChunkStride - FIntPoint(1, 1);
+	const FIntPoint WorldMax = MaxChunk * ChunkStride + FIntPoint(PlaneSize - 2, PlaneSize - 2);
+
+	FNeighbourhood Neighbourhood;
+	GetNeighbourhood(Chunk, Neighbourhood);
+	const FCell& Centre = *Neighbourhood[1][1];
+	check(Centre.Heights.Num() == PlaneSize * PlaneSize);
+
+	// Neighbour and its local coordinate for every window column and row, both axes are resolved the same way
+	TArray<int> Neighbours[2];
+	TArray<int> Locals[2];
+	TArray<int> CentreLocals[2];
+
+	for (int Axis = 0; Axis < 2; Axis++)
+	{
+		Neighbours[Axis].SetNumUninitialized(WindowSize);
+		Locals[Axis].SetNumUninitialized(WindowSize);
+		CentreLocals[Axis].SetNumUninitialized(WindowSize);
+
+		for (int i = 0; i < WindowSize; i++)
+		{
+			const int Global = FMath::Clamp(Origin[Axis] + i, WorldMin[Axis], WorldMax[Axis]);
+			const int Owner = FMath::Clamp(FloorDivide(Global, ChunkStride), MinChunk[Axis], MaxChunk[Axis]);
+
+			Neighbours[Axis][i] = Owner - Chunk[Axis] + 1;
+			Locals[Axis][i] = Global - Owner * ChunkStride + 1;
+			CentreLocals[Axis][i] = FMath::Clamp(Global - Chunk[Axis] * ChunkStride + 1, 0, PlaneSize - 1);
+		}
+	}
+
+	Window.SetNumUninitialized(FMath::Square(WindowSize));
+
+	for (int y = 0; y < WindowSize; y++)
+	{
+		for (int x = 0; x < WindowSize; x++)
+		{
+			const FCell* Cell = Neighbourhood[Neighbours[1][y]][Neighbours[0][x]];
+
+			// Missing corner of irregular world falls back to the chunk itself
+			Window[x + y * WindowSize] = Cell && Cell->Heights.Num()
+				                             ? Cell->Heights[Locals[0][x] + Locals[1][y] * PlaneSize]
+				                             : Centre.Heights[CentreLocals[0][x] + CentreLocals[1][y] * PlaneSize];
+		}
+	}
+}
+
+void FTerrainHeightfield::Scatter(const FIntPoint& Chunk, int Margin, const TArray<float>& Window)
+{
+	const int WindowSize = PlaneSize + 2 * Margin;
+	const FIntPoint Origin = Chunk * ChunkStride - FIntPoint(1 + Margin, 1 + Margin);
+	check(Window.Num() == FMath::Square(WindowSize));
+
+	FNeighbourhood Neighbourhood;
+	GetNeighbourhood(Chunk, Neighbourhood);
+
+	for (int y = 0; y < 3; y++)
+	{
+		for (int x = 0; x < 3; x++)
+		{
+			FCell* Cell = Neighbourhood[y][x];
+			if (!Cell || !Cell->Heights.Num()) continue;
+
+			// Overlap of neighbour plane and window in global coordinates
+			const FIntPoint PlaneOrigin = (Chunk + FIntPoint(x - 1, y - 1)) * ChunkStride - FIntPoint(1, 1);
+			const FIntPoint Min = PlaneOrigin.ComponentMax(Origin);
+			const FIntPoint Max = (PlaneOrigin + FIntPoint(PlaneSize, PlaneSize)).ComponentMin(
+				Origin + FIntPoint(WindowSize, WindowSize));
+			if (Min.X >= Max.X || Min.Y >= Max.Y) continue;
+
+			for (int GlobalY = Min.Y; GlobalY < Max.Y; GlobalY++)
+			{
+				FMemory::Memcpy(&Cell->Heights[Min.X - PlaneOrigin.X + (GlobalY - PlaneOrigin.Y) * PlaneSize],
+				                &Window[Min.X - Origin.X + (GlobalY - Origin.Y) * WindowSize],
+				                (Max.X - Min.X) * sizeof(float));
+			}
+		}
+	}
+}
+
+void FTerrainHeightfield::MarkEroded(const FIntPoint& Chunk)
+{
+	Cells.FindChecked(Chunk)->Progress.Set(Eroded);
+}
+
+void FTerrainHeightfield::MarkMeshed(const FIntPoint& Chunk)
+{
+	Cells.FindChecked(Chunk)->Progress.Set(Meshed);
+
+	// Plane is read by meshing and erosion of its neighbours, every one of them is finished once they are meshed
+	for (int y = -1; y <= 1; y++)
+	{
+		for (int x = -1; x <= 1; x++)
+		{
+			const FIntPoint Neighbour = Chunk + FIntPoint(x, y);
+			const TUniquePtr<FCell>* Cell = Cells.Find(Neighbour);
+
+			// Counter makes sure only one of the finishing neighbours releases the plane
+			if (Cell && IsNeighbourhoodMeshed(Neighbour) && (*Cell)->Released.Set(1) == 0)
+			{
+				AllocatedSize.Subtract((*Cell)->Heights.GetAllocatedSize());
+				(*Cell)->Heights.Empty();
+			}
+		}
+	}
+}
@@ -0,0 +1,145 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#include "TerrainMemoryBudget.h"
+#include "Misc/ScopeLock.h"
+#include "ProceduralWorld.h"
+
+DECLARE_MEMORY_STAT(TEXT("Terrain memory"), STAT_TerrainMemory, STATGROUP_ProceduralWorld);
+DECLARE_MEMORY_STAT(TEXT("Terrain memory peak"), STAT_TerrainMemoryPeak, STATGROUP_ProceduralWorld);
+DECLARE_MEMORY_STAT(TEXT("Terrain mask"), STAT_TerrainMaskMemory, STATGROUP_ProceduralWorld);
+DECLARE_MEMORY_STAT(TEXT("Terrain erosion tables"), STAT_TerrainErosionTablesMemory, STATGROUP_ProceduralWorld);
+DECLARE_MEMORY_STAT(TEXT("Terrain heightfield"), STAT_TerrainHeightfieldMemory, STATGROUP_ProceduralWorld);
+DECLARE_MEMORY_STAT(TEXT("Terrain job buffers"), STAT_TerrainJobBuffersMemory, STATGROUP_ProceduralWorld);
+DECLARE_MEMORY_STAT(TEXT("Terrain height store"), STAT_TerrainHeightStoreMemory, STATGROUP_ProceduralWorld);
+DECLARE_MEMORY_STAT(TEXT("Terrain meshes"), STAT_TerrainMeshesMemory, STATGROUP_ProceduralWorld);
+DECLARE_MEMORY_STAT(TEXT("Terrain collision"), STAT_TerrainCollisionMemory, STATGROUP_ProceduralWorld);
+DECLARE_MEMORY_STAT(TEXT("Terrain mesh pool"), STAT_TerrainMeshPoolMemory, STATGROUP_ProceduralWorld);
+
+FTerrainMemoryBudget::FTerrainMemoryBudget(int64 InLimit) : Limit(InLimit)
+{
+}
+
+void FTerrainMemoryBudget::SetLimit(int64 InLimit)
+{
+	FScopeLock ScopeLock(&Lock);
+	Limit = InLimit;
+}
+
+int64 FTerrainMemoryBudget::GetLimit() const
+{
+	FScopeLock ScopeLock(&Lock);
+	return Limit;
+}
+
+void FTerrainMemoryBudget::AddChunkBytes(ETerrainMemory Category, const FIntPoint& Chunk, int64 Delta)
+{
+	if (!Delta) return;
+
+	FScopeLock ScopeLock(&Lock);
+	FChunkUsage& Usage = Chunks.FindOrAdd(Chunk);
+	Usage.Bytes[static_cast<int>(Category)] += Delta;
+	Usage.Total += Delta;
+	if (!Usage.Total) Chunks.Remove(Chunk);
+
+	Add(Category, Delta);
+}
+
+void FTerrainMemoryBudget::SetChunkBytes(ETerrainMemory Category, const FIntPoint& Chunk, int64 Bytes)
+{
+	FScopeLock ScopeLock(&Lock);
+	const FChunkUsage* Usage = Chunks.Find(Chunk);
+	const int64 Delta = Bytes - (Usage ? Usage->Bytes[static_cast<int>(Category)] : 0);
+
+	// Lock is recursive
+	AddChunkBytes(Category, Chunk, Delta);
+}
+
+int64 FTerrainMemoryBudget::GetChunkBytes(const FIntPoint& Chunk) const
+{
+	FScopeLock ScopeLock(&Lock);
+	const FChunkUsage* Usage = Chunks.Find(Chunk);
+	return Usage ? Usage->Total : 0;
+}
+
+void FTerrainMemoryBudget::SetSharedBytes(ETerrainMemory Category, int64 Bytes)
+{
+	FScopeLock ScopeLock(&Lock);
+	int64& Shared = SharedBytes[static_cast<int>(Category)];
+	Add(Category, Bytes - Shared);
+	Shared = Bytes;
+}
+
+int64 FTerrainMemoryBudget::GetUsed() const
+{
+	FScopeLock ScopeLock(&Lock);
+	return Total.Used;
+}
+
+int64 FTerrainMemoryBudget::GetPeak() const
+{
+	FScopeLock ScopeLock(&Lock);
+	return Total.Peak;
+}
+
+int64 FTerrainMemoryBudget::GetUsed(ETerrainMemory Category) const
+{
+	FScopeLock ScopeLock(&Lock);
+	return Categories[static_cast<int>(Category)].Used;
+}
+
+int64 FTerrainMemoryBudget::GetPeak(ETerrainMemory Category) const
+{
+	FScopeLock ScopeLock(&Lock);
+	return Categories[static_cast<int>(Category)].Peak;
+}
+
+int64 FTerrainMemoryBudget::GetExcess() const
+{
+	FScopeLock ScopeLock(&Lock);
+	return Limit > 0 ? FMath::Max<int64>(Total.Used - Limit, 0) : 0;
+}
+
+bool FTerrainMemoryBudget::CanAllocate(int64 Bytes) const
+{
+	FScopeLock ScopeLock(&Lock);
+	return Limit <= 0 || Total.Used + Bytes <= Limit;
+}
+
+void FTerrainMemoryBudget::PublishStats() const
+{
+	FScopeLock ScopeLock(&Lock);
+	const auto Used = [this](ETerrainMemory Category) { return Categories[static_cast<int>(Category)].Used; };
+
+	SET_MEMORY_STAT(STAT_TerrainMemory, Total.Used);
+	SET_MEMORY_STAT(STAT_TerrainMemoryPeak, Total.Peak);
+	SET_MEMORY_STAT(STAT_TerrainMaskMemory, Used(ETerrainMemory::Mask));
+	SET_MEMORY_STAT(STAT_TerrainErosionTablesMemory, Used(ETerrainMemory::ErosionTables));
+	SET_MEMORY_STAT(STAT_TerrainHeightfieldMemory, Used(ETerrainMemory::Heightfield));
+	SET_MEMORY_STAT(STAT_TerrainJobBuffersMemory, Used(ETerrainMemory::JobBuffers));
+	SET_MEMORY_STAT(STAT_TerrainHeightStoreMemory, Used(ETerrainMemory::HeightStore));
+	SET_MEMORY_STAT(STAT_TerrainMeshesMemory, Used(ETerrainMemory::Meshes));
+	SET_MEMORY_STAT(STAT_TerrainCollisionMemory, Used(ETerrainMemory::Collision));
+	SET_MEMORY_STAT(STAT_TerrainMeshPoolMemory, Used(ETerrainMemory::MeshPool));
+}
+
+void FTerrainMemoryBudget::LogStats() const
+{
+	const UEnum* CategoryEnum = StaticEnum<ETerrainMemory>();
+
+	FScopeLock ScopeLock(&Lock);
+	UE_LOG(LogTemp, Warning, TEXT("TerrainMemoryBudget: %.1f MB, peak %.1f MB, limit %.1f MB, %d chunks"),
+	       Total.Used / (1024.0 * 1024.0), Total.Peak / (1024.0 * 1024.0), Limit / (1024.0 * 1024.0), Chunks.Num());
+
+	for (int Category = 0; Category < static_cast<int>(ETerrainMemory::Num); Category++)
+	{
+		UE_LOG(LogTemp, Warning, TEXT("TerrainMemoryBudget: %s - %.1f MB, peak %.1f MB"),
+		       *CategoryEnum->GetNameStringByIndex(Category), Categories[Category].Used / (1024.0 * 1024.0),
+		       Categories[Category].Peak / (1024.0 * 1024.0));
+	}
+}
+
+void FTerrainMemoryBudget::Add(ETerrainMemory Category, int64 Delta)
+{
+	Categories[static_cast<int>(Category)].Add(Delta);
+	Total.Add(Delta);
+}
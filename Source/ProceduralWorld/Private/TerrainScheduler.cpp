@@ -0,0 +1,292 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#include "TerrainScheduler.h"
+#include "Async/Async.h"
+#include "Misc/QueuedThreadPool.h"
+#include "TerrainMemoryBudget.h"
+
+namespace
+{
+	constexpr int UploadStageIndex = static_cast<int>(ETerrainStage::Upload);
+	constexpr int StageNum = static_cast<int>(ETerrainStage::Num);
+
+	struct FJobPriority
+	{
+		bool operator()(const FTerrainChunkJobPtr& A, const FTerrainChunkJobPtr& B) const
+		{
+			return A->Priority < B->Priority;
+		}
+	};
+}
+
+FTerrainChunkJob::~FTerrainChunkJob()
+{
+	if (MemoryBudget) MemoryBudget->AddChunkBytes(ETerrainMemory::JobBuffers, ChunkCoordinates, -TrackedBytes);
+}
+
+void FTerrainChunkJob::TrackMemory(bool bIncludeEstimate)
+{
+	if (!MemoryBudget) return;
+
+	const int64 Bytes = NoiseData.GetAllocatedSize() + Heights.GetAllocatedSize() + HeightPyramid.GetAllocatedSize() +
+		TrueVertices.GetAllocatedSize() + TrueNormals.GetAllocatedSize() + WaterVertices.GetAllocatedSize() +
+		WaterNormals.GetAllocatedSize() + UV.GetAllocatedSize() + Triangles.GetAllocatedSize();
+	const int64 Tracked = bIncludeEstimate ? FMath::Max(Bytes, MemoryEstimate) : Bytes;
+
+	MemoryBudget->AddChunkBytes(ETerrainMemory::JobBuffers, ChunkCoordinates, Tracked - TrackedBytes);
+	TrackedBytes = Tracked;
+}
+
+FTerrainScheduler::FTerrainScheduler(int InWorkerCount)
+{
+	// Leave one core for the game thread when count is not specified
+	WorkerCount = InWorkerCount > 0 ? InWorkerCount : FMath::Max(1, FPlatformMisc::NumberOfCoresIncludingHyperthreads() - 1);
+
+	Pool = FQueuedThreadPool::Allocate();
+	verify(Pool->Create(WorkerCount, 512 * 1024, TPri_BelowNormal));
+
+	TickerHandle = FTicker::GetCoreTicker().AddTicker(FTickerDelegate::CreateRaw(this, &FTerrainScheduler::Tick));
+}
+
+// Blocks until chunks that are currently processed are finished, queued ones are dropped
+FTerrainScheduler::~FTerrainScheduler()
+{
+	FTicker::GetCoreTicker().RemoveTicker(TickerHandle);
+
+	for (FStage& Stage : Stages)
+	{
+		Stage.Queue.Reset();
+		Stage.Blocked.Reset();
+	}
+	Pool->Destroy();
+	delete Pool;
+}
+
+void FTerrainScheduler::SetStage(ETerrainStage Stage, const FTerrainStageLimits& Limits, FStageWork Work)
+{
+	Stages[static_cast<int>(Stage)].Limits = Limits;
+	Stages[static_cast<int>(Stage)].Work = MoveTemp(Work);
+}
+
+void FTerrainScheduler::SetStageGate(ETerrainStage Stage, FStageGate Gate)
+{
+	Stages[static_cast<int>(Stage)].Gate = MoveTemp(Gate);
+}
+
+void FTerrainScheduler::SetAdmission(FAdmission InAdmission)
+{
+	Admission = MoveTemp(InAdmission);
+}
+
+void FTerrainScheduler::Enqueue(const FTerrainChunkJobPtr& Job)
+{
+	FStage& Stage = Stages[static_cast<int>(Job->Stage)];
+
+	if (Stage.Gate && !Stage.Gate(*Job))
+	{
+		// Chunk may wait at the gate for long, so only buffers it holds count until it starts again
+		Job->TrackMemory(false);
+		Stage.Blocked.Add(Job);
+	}
+	else
+	{
+		Stage.Queue.HeapPush(Job, FJobPriority());
+	}
+}
+
+// Moves chunks that passed their gate to the queue, stale ones are dropped
+void FTerrainScheduler::UnblockJobs()
+{
+	for (FStage& Stage : Stages)
+	{
+		for (int i = Stage.Blocked.Num() - 1; i >= 0; i--)
+		{
+			const FTerrainChunkJobPtr& Job = Stage.Blocked[i];
+
+			if (Job->IsStale())
+				DroppedJobs++;
+			else if (Stage.Gate(*Job))
+				Stage.Queue.HeapPush(Job, FJobPriority());
+			else
+				continue;
+
+			Stage.Blocked.RemoveAtSwap(i, 1, false);
+		}
+	}
+}
+
+void FTerrainScheduler::DropStaleJobs()
+{
+	for (FStage& Stage : Stages)
+	{
+		DroppedJobs += Stage.Queue.RemoveAll([](const FTerrainChunkJobPtr& Job) { return Job->IsStale(); });
+		DroppedJobs += Stage.Blocked.RemoveAll([](const FTerrainChunkJobPtr& Job) { return Job->IsStale(); });
+		Stage.Queue.Heapify(FJobPriority());
+	}
+}
+
+bool FTerrainScheduler::IsIdle() const
+{
+	if (ActiveWorkers) return false;
+
+	for (const FStage& Stage : Stages)
+	{
+		if (Stage.Queue.Num() || Stage.Blocked.Num()) return false;
+	}
+	return true;
+}
+
+// Checks concurrency of the stage and free space in the queue of the next stage
+bool FTerrainScheduler::CanStart(int StageIndex) const
+{
+	const FStage& Stage = Stages[StageIndex];
+	const int MaxConcurrency = Stage.Limits.MaxConcurrency > 0 ? Stage.Limits.MaxConcurrency : WorkerCount;
+
+	if (!Stage.Queue.Num() || Stage.InFlight >= MaxConcurrency) return false;
+	if (!StageIndex && Admission && !Admission(*Stage.Queue.HeapTop()) && !IsStalled()) return false;
+
+	if (StageIndex + 1 < StageNum)
+	{
+		const FStage& NextStage = Stages[StageIndex + 1];
+		if (NextStage.Queue.Num() + Stage.InFlight >= NextStage.Limits.QueueCapacity) return false;
+	}
+	return true;
+}
+
+// Nothing runs and nothing queued past the first stage, chunks left are waiting at gates or not admitted yet
+bool FTerrainScheduler::IsStalled() const
+{
+	if (ActiveWorkers) return false;
+
+	for (int StageIndex = 1; StageIndex < StageNum; StageIndex++)
+	{
+		if (Stages[StageIndex].Queue.Num()) return false;
+	}
+	return true;
+}
+
+void FTerrainScheduler::Dispatch()
+{
+	check(IsInGameThread());
+
+	// Later stages go first, so finished work drains before new chunks are started
+	for (int StageIndex = UploadStageIndex - 1; StageIndex >= 0; StageIndex--)
+	{
+		// Never queue more work than there are workers, so priority is decided as late as possible
+		while (ActiveWorkers < WorkerCount && CanStart(StageIndex))
+		{
+			FTerrainChunkJobPtr Job;
+			Stages[StageIndex].Queue.HeapPop(Job, FJobPriority(), false);
+			StartOnPool(StageIndex, Job);
+		}
+	}
+}
+
+void FTerrainScheduler::StartOnPool(int StageIndex, const FTerrainChunkJobPtr& Job)
+{
+	Stages[StageIndex].InFlight++;
+	ActiveWorkers++;
+	// Buffers of the previous stage, or the estimate of a new chunk, count before the next admission
+	Job->TrackMemory();
+
+	TWeakPtr<FTerrainScheduler, ESPMode::ThreadSafe> WeakScheduler = AsShared();
+	AsyncPool(*Pool, [this, WeakScheduler, StageIndex, Job]
+	{
+		const double StartTime = FPlatformTime::Seconds();
+		if (!Job->IsStale()) Stages[StageIndex].Work(*Job);
+		const double Seconds = FPlatformTime::Seconds() - StartTime;
+
+		AsyncTask(ENamedThreads::GameThread, [WeakScheduler, StageIndex, Job, Seconds]
+		{
+			if (const TSharedPtr<FTerrainScheduler, ESPMode::ThreadSafe> Scheduler = WeakScheduler.Pin())
+				Scheduler->OnStageCompleted(StageIndex, Job, Seconds);
+		});
+	});
+}
+
+void FTerrainScheduler::OnStageCompleted(int StageIndex, const FTerrainChunkJobPtr& Job, double Seconds)
+{
+	FStage& Stage = Stages[StageIndex];
+
+	Stage.InFlight--;
+	ActiveWorkers--;
+	Stage.Completed++;
+	Stage.TotalSeconds += Seconds;
+	Stage.MaxSeconds = FMath::Max(Stage.MaxSeconds, Seconds);
+
+	if (Job->IsStale())
+	{
+		DroppedJobs++;
+	}
+	else
+	{
+		Job->Stage = Job->NextStage.Get(static_cast<ETerrainStage>(StageIndex + 1));
+		Job->NextStage.Reset();
+		Enqueue(Job);
+	}
+
+	// Finished stage may be what other chunks were waiting for
+	UnblockJobs();
+	Dispatch();
+}
+
+// Runs game thread stage with a per frame limit and keeps pool stages busy
+bool FTerrainScheduler::Tick(float DeltaTime)
+{
+	FStage& UploadStage = Stages[UploadStageIndex];
+	const int MaxUploads = UploadStage.Limits.MaxConcurrency > 0 ? UploadStage.Limits.MaxConcurrency : MAX_int32;
+	int Uploads = 0;
+
+	while (Uploads < MaxUploads && UploadStage.Queue.Num())
+	{
+		FTerrainChunkJobPtr Job;
+		UploadStage.Queue.HeapPop(Job, FJobPriority(), false);
+
+		if (Job->IsStale())
+		{
+			DroppedJobs++;
+			continue;
+		}
+
+		const double StartTime = FPlatformTime::Seconds();
+		UploadStage.Work(*Job);
+		const double Seconds = FPlatformTime::Seconds() - StartTime;
+
+		UploadStage.Completed++;
+		UploadStage.TotalSeconds += Seconds;
+		UploadStage.MaxSeconds = FMath::Max(UploadStage.MaxSeconds, Seconds);
+		Uploads++;
+
+		// Uploaded mesh may be an intermediate one, chunk then goes back for more work
+		if (Job->NextStage.IsSet())
+		{
+			Job->Stage = Job->NextStage.GetValue();
+			Job->NextStage.Reset();
+			Enqueue(Job);
+		}
+	}
+
+	if (Uploads)
+	{
+		Dispatch();
+		if (IsIdle()) LogStageTimings();
+	}
+	return true;
+}
+
+void FTerrainScheduler::LogStageTimings() const
+{
+	const UEnum* StageEnum = StaticEnum<ETerrainStage>();
+
+	if (DroppedJobs) UE_LOG(LogTemp, Warning, TEXT("TerrainScheduler: %d stale chunks dropped"), DroppedJobs);
+
+	for (int StageIndex = 0; StageIndex < StageNum; StageIndex++)
+	{
+		const FStage& Stage = Stages[StageIndex];
+		if (!Stage.Completed) continue;
+
+		UE_LOG(LogTemp, Warning, TEXT("TerrainScheduler: %s - %d chunks, average %.2f ms, max %.2f ms"),
+		       *StageEnum->GetNameStringByIndex(StageIndex), Stage.Completed,
+		       Stage.TotalSeconds * 1000.0 / Stage.Completed, Stage.MaxSeconds * 1000.0);
+	}
+}
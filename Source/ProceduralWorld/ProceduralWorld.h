@@ -3,4 +3,14 @@
 #pragma once
 
 #include "CoreMinimal.h"
+#include "Hash/CityHash.h"
 
+
+DECLARE_STATS_GROUP(TEXT("ProceduralWorld"), STATGROUP_ProceduralWorld, STATCAT_Advanced);
+
+// Mixes raw bytes of the value into running hash, so the value must not have padding
+template <typename T>
+FORCEINLINE void HashCombineBytes(uint64& Hash, const T& Value)
+{
+	Hash = CityHash64WithSeed(reinterpret_cast<const char*>(&Value), sizeof(Value), Hash);
+}
@@ -0,0 +1,68 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "HAL/ThreadSafeCounter.h"
+
+class FErosionSolver;
+struct FErosionContext;
+
+/* Eroded height planes stored on disk, one file per plane named by the hash of everything the result depends on.
+ * Equal pre-erosion heights with equal settings, seed and chunk are loaded instead of simulated again.
+ * Every file carries its key and a checksum of its heights, files that do not match are deleted on load.
+ * Once the directory grows over its size limit, files used least recently are evicted.
+ * Load and Store can be called from any thread.
+ */
+class PROCEDURALWORLD_API FErosionCache
+{
+public:
+	FErosionCache(const FString& InDirectory, int64 InSizeLimit);
+
+	// Hash of pre-erosion plane, solver settings and everything in context that changes simulation result
+	static uint64 MakeKey(const TArray<float>& HeightMap, const FErosionSolver& Solver,
+	                      const FErosionContext& Context);
+
+	// Replaces heights with stored ones, returns false when there is no valid entry of the same plane size
+	bool Load(uint64 Key, TArray<float>& HeightMap);
+	void Store(uint64 Key, const TArray<float>& HeightMap);
+
+	// Evicts entries right away when the limit is lowered
+	void SetSizeLimit(int64 InSizeLimit);
+	void LogStats() const;
+
+private:
+	struct FEntry
+	{
+		int64 Size = 0;
+		FDateTime AccessTime;
+	};
+
+	// Written in front of heights, native byte order
+	struct FHeader
+	{
+		uint32 Magic = 0;
+		uint32 Version = 0;
+		uint64 Key = 0;
+		int32 HeightNum = 0;
+		uint32 Padding = 0;
+		uint64 Checksum = 0;
+	};
+
+	FString GetPath(uint64 Key) const;
+	void Remove(uint64 Key);
+	// Caller holds the lock
+	void EvictOverLimit();
+
+	FString Directory;
+	int64 SizeLimit = 0;
+
+	// Guards entries and total size, file contents are written and read outside of it
+	mutable FCriticalSection Lock;
+	TMap<uint64, FEntry> Entries;
+	int64 TotalSize = 0;
+
+	FThreadSafeCounter Hits;
+	FThreadSafeCounter Misses;
+	FThreadSafeCounter Rejected;
+};
@@ -6,6 +6,53 @@
 #include "Components/ActorComponent.h"
 #include "ErosionSimulator.generated.h"
 
+class FErosionCache;
+
+UENUM()
+enum class EErosionEngine : uint8
+{
+	// Droplets simulated one after another
+	Droplet,
+	// Droplets grouped into tiles by spawn position, tiles that cannot overlap run in parallel outside the scheduler
+	TiledDroplet,
+	// Four droplets advanced in lockstep with vector math
+	SimdDroplet,
+	// Water, flux, velocity and sediment grids updated with regular stencils on vector registers, rows run in parallel
+	PipeModel
+};
+
+UENUM()
+enum class EErosionBlurKernel : uint8
+{
+	// Equal weights, cheapest smoothing
+	Box,
+	// Weights fall off with distance, radius covers three standard deviations
+	Gaussian
+};
+
+UENUM()
+enum class EErosionSpawnDistribution : uint8
+{
+	// Every point of spawn area is equally likely
+	Uniform,
+	// Steep areas get more droplets, droplets on flat ground stop almost immediately
+	Slope,
+	// High areas get more droplets, they have the longest way down
+	Height
+};
+
+UENUM()
+enum class EErosionHeightLayout : uint8
+{
+	// Rows one after another, layout of planes outside of erosion
+	RowMajor,
+	// Square blocks stored one after another, vertices of a block row by row
+	Tiled,
+	// Square blocks stored one after another, vertices of a block in Z-order, so close vertices share cache lines
+	// along both axes
+	Morton
+};
+
 USTRUCT()
 struct FGradientAndHeight
 {
@@ -20,6 +67,297 @@ struct FGradientAndHeight
 	float Height = 0.f;
 };
 
+// Copy of simulator properties, see UErosionSimulator for descriptions
+struct FErosionSettings
+{
+	int BorderSize = 0;
+	bool bApplyBlur = false;
+	EErosionBlurKernel BlurKernel = EErosionBlurKernel::Box;
+	int BlurRadius = 0;
+	float BaseWaterSpeed = 0.f;
+	float Inertia = 0.f;
+	float SedimentCapacityFactor = 0.f;
+	float MinSedimentCapacity = 0.f;
+	int ErosionRadius = 0;
+	float ErosionSpeed = 0.f;
+	float DepositionSpeed = 0.f;
+	float EvaporationSpeed = 0.f;
+	int DropletLifetime = 0;
+	int IterationNumber = 0;
+	EErosionEngine ErosionEngine = EErosionEngine::Droplet;
+	int ErosionTileSize = 0;
+	int PipeStepNumber = 0;
+	float PipeTimeStep = 0.f;
+	float PipeRainAmount = 0.f;
+	float PipeSedimentCapacity = 0.f;
+	bool bMultiResolution = false;
+	int CoarseFactor = 0;
+	float FinePassFraction = 0.f;
+	EErosionSpawnDistribution SpawnDistribution = EErosionSpawnDistribution::Uniform;
+	float SpawnUniformShare = 0.f;
+	bool bAdaptiveIterations = false;
+	int ConvergenceBatchSize = 0;
+	float ConvergenceThreshold = 0.f;
+	EErosionHeightLayout HeightLayout = EErosionHeightLayout::RowMajor;
+	int ChunkSize = 0;
+	float VertexSize = 0.f;
+};
+
+// Erosion kernel shared by every vertex of a plane. Vertices closer to the edge than radius use precalculated
+// variants with clipped and renormalized weights, so the brush is independent of plane area.
+struct PROCEDURALWORLD_API FErosionBrush
+{
+	struct FTap
+	{
+		// Index offset from brush centre in row-major plane
+		int16 Offset;
+		int8 OffsetX;
+		int8 OffsetY;
+		float Weight;
+	};
+
+	void Initialize(int InRadius, int InPlaneSize);
+
+	// Taps of brush centred at given vertex
+	FORCEINLINE TArrayView<const FTap> GetTaps(int X, int Y) const
+	{
+		const int Variant = GetAxisClass(X) + GetAxisClass(Y) * ClassNum;
+		return TArrayView<const FTap>(Taps.GetData() + VariantStarts[Variant],
+		                              VariantStarts[Variant + 1] - VariantStarts[Variant]);
+	}
+
+	SIZE_T GetAllocatedSize() const { return Taps.GetAllocatedSize() + VariantStarts.GetAllocatedSize(); }
+
+private:
+	// 0..Radius-1 near low edge, Radius in the interior, Radius+1..2*Radius near high edge
+	FORCEINLINE int GetAxisClass(int Coordinate) const
+	{
+		if (Coordinate < Radius) return Coordinate;
+		if (Coordinate >= PlaneSize - Radius) return 2 * Radius - (PlaneSize - 1 - Coordinate);
+		return Radius;
+	}
+
+	int Radius = 0;
+	int PlaneSize = 0;
+	int ClassNum = 0;
+	TArray<FTap> Taps;
+	// Start of every variant in Taps, with an extra end entry
+	TArray<int> VariantStarts;
+};
+
+/* Position of every vertex of a square plane in memory of given layout. Column and row add independent offsets, so
+ * index of any vertex costs two table reads. Block layouts pad the plane to whole blocks, padding is never read.
+ */
+struct PROCEDURALWORLD_API FErosionHeightLayout
+{
+	// One cache line per block row
+	static constexpr int BlockSize = 16;
+
+	void Initialize(EErosionHeightLayout InLayout, int InPlaneSize);
+
+	FORCEINLINE int GetIndex(int X, int Y) const { return ColumnOffsets[X] + RowOffsets[Y]; }
+	const int* GetColumnOffsets() const { return ColumnOffsets.GetData(); }
+	const int* GetRowOffsets() const { return RowOffsets.GetData(); }
+
+	EErosionHeightLayout GetLayout() const { return Layout; }
+	int GetPlaneSize() const { return PlaneSize; }
+	// Floats taken by plane in this layout, padding included
+	int GetNum() const { return Num; }
+
+	void FromRowMajor(const float* Source, float* Destination) const;
+	void ToRowMajor(const float* Source, float* Destination) const;
+
+	SIZE_T GetAllocatedSize() const { return ColumnOffsets.GetAllocatedSize() + RowOffsets.GetAllocatedSize(); }
+
+private:
+	EErosionHeightLayout Layout = EErosionHeightLayout::RowMajor;
+	int PlaneSize = 0;
+	int Num = 0;
+	TArray<int> ColumnOffsets;
+	TArray<int> RowOffsets;
+};
+
+// Counter-based random numbers, value depends only on seed, chunk and droplet index, never on previous draws.
+// Any range of droplets can be simulated independently and every chunk gets its own spawn sequence.
+struct FErosionRandom
+{
+	FErosionRandom(int Seed, const FIntPoint& ChunkCoordinates)
+	{
+		Key = Mix(Mix(static_cast<uint32>(Seed)) ^ (static_cast<uint64>(static_cast<uint32>(ChunkCoordinates.X)) << 32 |
+			static_cast<uint32>(ChunkCoordinates.Y)));
+	}
+
+	// Uniform value in [Min, Max) for given droplet, Dimension selects independent value of the same droplet
+	FORCEINLINE float GetRange(uint32 DropletIndex, uint32 Dimension, float Min, float Max) const
+	{
+		const uint64 Counter = static_cast<uint64>(DropletIndex) << 8 | Dimension;
+		// Top 24 bits fill float mantissa exactly
+		const float Fraction = (Mix(Key + Counter * 0x9E3779B97F4A7C15ull) >> 40) * (1.f / 16777216.f);
+		return Min + (Max - Min) * Fraction;
+	}
+
+private:
+	// SplitMix64 finalizer
+	static FORCEINLINE uint64 Mix(uint64 Value)
+	{
+		Value = (Value ^ Value >> 30) * 0xBF58476D1CE4E5B9ull;
+		Value = (Value ^ Value >> 27) * 0x94D049BB133111EBull;
+		return Value ^ Value >> 31;
+	}
+
+	uint64 Key = 0;
+};
+
+// Rectangle in height plane coordinates
+struct FErosionBounds
+{
+	float MinX = 0.f;
+	float MinY = 0.f;
+	float MaxX = 0.f;
+	float MaxY = 0.f;
+};
+
+// Part of height plane simulation works in
+struct FErosionArea
+{
+	// Droplets spawn uniformly in [Min, Max)
+	FErosionBounds Spawn;
+	// Droplets die once they leave it
+	FErosionBounds Droplet;
+	// Only vertices inside, inclusive, are eroded
+	FErosionBounds Erode;
+};
+
+// Spawn density over square cells of spawn area
+struct FErosionSpawnMap
+{
+	FErosionBounds Bounds;
+	int CellSize = 0;
+	int CellNumX = 0;
+	// Running total of cell probabilities
+	TArray<float> Cumulative;
+	// Height change multiplier of droplets spawned in the cell, uniform density divided by cell density
+	TArray<float> Scales;
+};
+
+struct FErosionSpawn
+{
+	float X = 0.f;
+	float Y = 0.f;
+	// Multiplies height changes of the droplet, so uneven spawn density keeps expected erosion per unit area
+	float Scale = 1.f;
+};
+
+// Per call state of erosion simulation, every concurrent simulation needs its own
+struct FErosionContext
+{
+	explicit FErosionContext(int InSeed, const FIntPoint& InChunkCoordinates = FIntPoint::ZeroValue) :
+		Seed(InSeed), ChunkCoordinates(InChunkCoordinates), Random(InSeed, InChunkCoordinates)
+	{
+	}
+
+	int Seed = 0;
+	FIntPoint ChunkCoordinates;
+	// Polled between droplets, simulation stops when it returns true
+	TFunction<bool()> ShouldCancel;
+	// Tiles and grid rows run on task graph. Callers on a bounded worker pool clear it, so a chunk keeps to its worker.
+	bool bParallel = true;
+	// Unset simulates whole chunk except its border
+	TOptional<FErosionArea> Area;
+
+	// Global index makes simulation tracking easier
+	int IterationIndex = 0;
+	// Droplet engines pause once IterationIndex reaches it, calling SimulateErosion again continues from there
+	int IterationEnd = MAX_int32;
+	// Coarse pass of multi-resolution erosion is finished, resumed simulation continues with the fine one
+	bool bCoarsePassDone = false;
+	// Every droplet is simulated and blur is applied
+	bool bFinished = false;
+	// Adaptive iteration budget ended simulation before IterationNumber, IterationIndex is the droplet count then
+	bool bConverged = false;
+	// Built from heights before the first droplet of non-uniform spawn distribution, resumed simulation keeps it
+	TOptional<FErosionSpawnMap> SpawnMap;
+	// Steps taken by droplets of droplet and tiled engines, for benchmarks
+	int64 DropletSteps = 0;
+	FErosionRandom Random;
+};
+
+// Immutable erosion settings with precalculated brush, can be shared by any number of threads
+class PROCEDURALWORLD_API FErosionSolver
+{
+public:
+	// Calculates erosion brush
+	explicit FErosionSolver(const FErosionSettings& InSettings);
+
+	// Erodes row-major ChunkSize x ChunkSize height plane, returns false when cancelled by context.
+	// Returns true as well when paused at context IterationEnd, bFinished of context tells the two apart.
+	bool SimulateErosion(TArray<float>& HeightMap, FErosionContext& Context) const;
+
+	// Applies blur to row-major PlaneSize x PlaneSize plane, independent of simulation settings
+	void BlurHeights(TArray<float>& HeightPlane, int PlaneSize) const;
+
+	// Erodes Z component of vertices, slower than height plane version because of conversion
+	bool SimulateErosion(TArray<FVector>& HeightMap, FErosionContext& Context) const;
+
+	// Settings solver was created with
+	const FErosionSettings& GetSettings() const { return Settings; }
+
+	// Droplets a chunk simulates and IterationIndex of context counts up to, only the fine pass with multi-resolution
+	int GetIterationNumber() const { return FineIterationNumber; }
+
+	// Hash of every setting solver was created with, equal settings always give equal hash
+	uint64 GetSettingsHash() const { return SettingsHash; }
+
+	// Precalculated tables, coarse solver included
+	SIZE_T GetAllocatedSize() const;
+
+private:
+	FErosionArea GetChunkArea() const;
+	void BuildSpawnMap(const float* HeightMap, const FErosionBounds& Bounds, FErosionSpawnMap& SpawnMap) const;
+	FErosionSpawn GetDropletSpawn(const FErosionContext& Context, const FErosionArea& Area, int DropletIndex) const;
+	bool SimulateDroplets(float* HeightMap, FErosionContext& Context) const;
+	bool SimulateTiledDroplets(float* HeightMap, FErosionContext& Context) const;
+	bool SimulateDropletLanes(float* HeightMap, FErosionContext& Context) const;
+	bool SimulatePipeModel(float* HeightMap, FErosionContext& Context) const;
+	bool SimulateCoarsePass(float* HeightMap, const FErosionContext& Context) const;
+	bool SimulateEngine(float* HeightMap, FErosionContext& Context) const;
+	bool SimulateUntilConverged(float* HeightMap, FErosionContext& Context) const;
+	void SeparableBlur(float* HeightMap, int PlaneSize) const;
+
+	// Indexer maps vertex coordinates to plane memory, see FErosionHeightLayout
+	template <typename TWork>
+	bool SimulateInLayout(float* HeightMap, TWork&& Work) const;
+	template <typename TIndexer>
+	int SimulateDroplet(float* HeightMap, const TIndexer& Indexer, const FErosionSpawn& Spawn,
+	                    const FErosionBounds& Bounds, const FErosionBounds& ErodeBounds) const;
+	template <typename TIndexer>
+	FGradientAndHeight CalculateGradientAndHeight(const float* HeightMap, const TIndexer& Indexer,
+	                                              float RealPositionX, float RealPositionY) const;
+	template <typename TIndexer>
+	void DepositSediment(float* HeightMap, const TIndexer& Indexer, int IndexPositionX, int IndexPositionY,
+	                     float HeightDelta, float& Sediment, float SedimentCapacity, float Scale) const;
+	template <typename TIndexer>
+	void ErodeTerrain(float* HeightMap, const TIndexer& Indexer, int IndexPositionX, int IndexPositionY,
+	                  float HeightDelta, float& Sediment, float SedimentCapacity, float Scale,
+	                  const FErosionBounds& ErodeBounds) const;
+
+	FErosionSettings Settings;
+	uint64 SettingsHash = 0;
+	// Droplet and pipe step numbers of settings, reduced to the fine pass with multi-resolution erosion
+	int FineIterationNumber = 0;
+	int FinePipeStepNumber = 0;
+	// Index offsets and weights used for erosion
+	FErosionBrush Brush;
+	// Memory order of heights in droplet and tiled engines
+	FErosionHeightLayout HeightLayout;
+	// Weights of 2 * BlurRadius + 1 blur taps
+	TArray<float> BlurWeights;
+	// Erodes downsampled plane before the fine pass, set only with multi-resolution erosion
+	TUniquePtr<const FErosionSolver> CoarseSolver;
+};
+
+using FErosionSolverPtr = TSharedPtr<const FErosionSolver, ESPMode::ThreadSafe>;
+
 UCLASS(ClassGroup=(Custom), meta=(BlueprintSpawnableComponent))
 class PROCEDURALWORLD_API UErosionSimulator final : public UActorComponent
 {
@@ -29,21 +367,51 @@ public:
 	// Sets default values for this component's properties
 	UErosionSimulator();
 
+	// Creates solver from current properties, chunks already eroding keep the previous one
 	UFUNCTION(BlueprintCallable)
 	void PrecalculateIndicesAndWeights();
 
 	UFUNCTION(BlueprintCallable)
 	void SimulateErosion(TArray<FVector>& HeightMap);
 
+	// Polls ShouldCancel between droplets, returns false when simulation was cancelled
+	bool SimulateErosion(TArray<FVector>& HeightMap, TFunctionRef<bool()> ShouldCancel);
+
+	// Erodes copies of the vertices with and without multi-resolution, otherwise equal settings, and logs time of
+	// both and how close multi-resolution result is
+	UFUNCTION(BlueprintCallable)
+	void CompareMultiResolution(const TArray<FVector>& HeightMap);
+
+	// Erodes copies of the vertices in every height layout, otherwise equal settings, and logs time per droplet step
+	// and cache lines touched per droplet step of each. Pipe model and vector engines are benchmarked as droplet one.
+	UFUNCTION(BlueprintCallable)
+	void BenchmarkHeightLayouts(const TArray<FVector>& HeightMap);
+
+	// Solver created by last PrecalculateIndicesAndWeights call
+	FErosionSolverPtr GetSolver() const { return Solver; }
+
+	// Solver for chunk planes extended by halo on every side, valid when seamless erosion is enabled
+	FErosionSolverPtr GetSeamlessSolver() const { return SeamlessSolver; }
+
+	// Cache of eroded chunks, valid when caching is enabled
+	TSharedPtr<FErosionCache, ESPMode::ThreadSafe> GetCache() const { return Cache; }
+
 	UPROPERTY(EditAnywhere, Category="Erosion settings", Meta=(ClampMin=0, ClampMax=20))
 	int BorderSize = 3;
 
 	UPROPERTY(EditAnywhere, Category="Erosion settings")
 	bool bApplyBlur = true;
 
+	UPROPERTY(EditAnywhere, Category="Erosion settings")
+	EErosionBlurKernel BlurKernel = EErosionBlurKernel::Box;
+
+	// Vertices on every side of a vertex that blur averages
+	UPROPERTY(EditAnywhere, Category="Erosion settings", Meta=(ClampMin=1, ClampMax=8))
+	int BlurRadius = 1;
+
 	UPROPERTY(EditAnywhere, Category="Erosion settings", Meta=(ClampMin=1.f, ClampMax=1000.f))
 	float BaseWaterSpeed = 4.f;
-	
+
 	UPROPERTY(EditAnywhere, Category="Erosion settings", Meta=(ClampMin=0.f, ClampMax=0.999f))
 	float Inertia = 0.1f;
 
@@ -71,22 +439,99 @@ public:
 	UPROPERTY(EditAnywhere, Category="Erosion settings", Meta=(ClampMin=1, ClampMax=1000000))
 	int IterationNumber = 70000;
 
+	UPROPERTY(EditAnywhere, Category="Erosion settings")
+	EErosionEngine ErosionEngine = EErosionEngine::Droplet;
+
+	// Side of droplet tile in vertices, at least twice the erosion radius plus two
+	UPROPERTY(EditAnywhere, Category="Erosion settings", Meta=(ClampMin=16, ClampMax=256))
+	int ErosionTileSize = 64;
+
+	// Steps of pipe model engine, cost per chunk depends only on this and chunk size
+	UPROPERTY(EditAnywhere, Category="Erosion settings", Meta=(ClampMin=1, ClampMax=10000))
+	int PipeStepNumber = 300;
+
+	UPROPERTY(EditAnywhere, Category="Erosion settings", Meta=(ClampMin=0.001f, ClampMax=0.5f))
+	float PipeTimeStep = 0.05f;
+
+	// Water added to every vertex each step, in vertex size units
+	UPROPERTY(EditAnywhere, Category="Erosion settings", Meta=(ClampMin=0.f, ClampMax=1.f))
+	float PipeRainAmount = 0.002f;
+
+	// Sediment carried by water per unit of its speed and depth on a steep slope. Pipe model uses erosion, deposition
+	// and evaporation speed as well, scaled by time step.
+	UPROPERTY(EditAnywhere, Category="Erosion settings", Meta=(ClampMin=0.f, ClampMax=10.f))
+	float PipeSedimentCapacity = 0.5f;
+
+	// Droplet engines spawn more droplets where they erode the most, height changes of every droplet are scaled
+	// back by its spawn density. Similar result is then reached with lower IterationNumber.
+	UPROPERTY(EditAnywhere, Category="Erosion settings")
+	EErosionSpawnDistribution SpawnDistribution = EErosionSpawnDistribution::Uniform;
+
+	// Part of spawn density kept uniform, also limits height change multiplier of a droplet to its inverse
+	UPROPERTY(EditAnywhere, Category="Erosion settings", Meta=(ClampMin=0.05f, ClampMax=1.f))
+	float SpawnUniformShare = 0.25f;
+
+	// Droplet engines run in batches and stop once a batch barely changes the terrain, IterationNumber is then
+	// only the upper limit. Flat chunks finish early.
+	UPROPERTY(EditAnywhere, Category="Erosion settings")
+	bool bAdaptiveIterations = false;
+
+	// Droplets between two convergence checks
+	UPROPERTY(EditAnywhere, Category="Erosion settings", Meta=(ClampMin=256, ClampMax=65536))
+	int ConvergenceBatchSize = 4096;
+
+	// Mean absolute height change of eroded vertices caused by one batch, erosion stops below it
+	UPROPERTY(EditAnywhere, Category="Erosion settings", Meta=(ClampMin=0.f, ClampMax=100.f))
+	float ConvergenceThreshold = 0.5f;
+
+	// Memory order of heights while droplet and tiled engines run, result is the same in every layout.
+	// Plane is converted from row-major and back once per simulation.
+	UPROPERTY(EditAnywhere, Category="Erosion settings")
+	EErosionHeightLayout HeightLayout = EErosionHeightLayout::RowMajor;
+
+	// Erodes plane downsampled by CoarseFactor first, with erosion radius, droplet lifetime and droplet number
+	// scaled to cover the same area. Upsampled height change is then refined by a shorter pass on the full plane,
+	// both passes together use the droplet budget of IterationNumber.
+	UPROPERTY(EditAnywhere, Category="Erosion settings")
+	bool bMultiResolution = false;
+
+	// Vertex spacing of the coarse plane in vertices of the full plane
+	UPROPERTY(EditAnywhere, Category="Erosion settings", Meta=(ClampMin=2, ClampMax=8))
+	int CoarseFactor = 2;
+
+	// Part of droplets, or pipe model steps, simulated on the full plane after the coarse pass
+	UPROPERTY(EditAnywhere, Category="Erosion settings", Meta=(ClampMin=0.01f, ClampMax=1.f))
+	float FinePassFraction = 0.25f;
+
+	// Erodes chunks together with a halo of their neighbours, so droplets cross chunk borders without seams.
+	// BorderSize is then only kept at the edge of the world.
+	UPROPERTY(EditAnywhere, Category="Erosion settings")
+	bool bSeamlessErosion = true;
+
+	// Vertices of neighbouring chunks eroded together with a chunk, droplets die at its edge.
+	// Droplet lifetime plus erosion radius avoids any clipping.
+	UPROPERTY(EditAnywhere, Category="Erosion settings", Meta=(ClampMin=1, ClampMax=64))
+	int HaloSize = 40;
+
+	// Opt-in. Eroded chunks are stored under Saved/ErosionCache and loaded instead of simulated when their heights
+	// before erosion and every erosion setting match, so unchanged chunks skip erosion in later sessions.
+	UPROPERTY(EditAnywhere, Category="Erosion settings")
+	bool bCacheResults = false;
+
+	// Disk space of erosion cache, least recently used chunks are evicted over it
+	UPROPERTY(EditAnywhere, Category="Erosion settings", Meta=(ClampMin=1, ClampMax=65536))
+	int CacheSizeLimitMB = 512;
+
 	// Should be set up by parent
 	int ChunkSize;
 	float VertexSize;
 	int ErosionSeed;
-	
+
 private:
-	void GaussianBlur(TArray<FVector>& HeightMap);
-	FGradientAndHeight* CalculateGradientAndHeight(TArray<FVector>& HeightMap, float RealPositionX, float RealPositionY);
-	void DepositSediment(TArray<FVector>& HeightMap, int CombinedIndexPosition, float HeightDelta, float& Sediment, float SedimentCapacity );
-	void ErodeTerrain(TArray<FVector>& HeightMap, int CombinedIndexPosition, float HeightDelta, float& Sediment, float SedimentCapacity);
+	FErosionSettings CreateSettings() const;
 
-	// Global indexes make simulation tracking easier
-	int IterationIndex = 0;
-	int DropletLifeIndex = 0;
-	// An array of index offsets used for erosion
-	TArray<TArray<int>> ErosionIndicesMap;
-	// An array of weights applied to previous array of indexes
-	TArray<TArray<float>> ErosionWeightsMap;
+	FErosionSolverPtr Solver;
+	FErosionSolverPtr SeamlessSolver;
+	// Kept between solvers, so its index is built only once
+	TSharedPtr<FErosionCache, ESPMode::ThreadSafe> Cache;
 };
@@ -7,9 +7,15 @@
 #include "ProceduralMeshComponent.h"
 
 #include "ErosionSimulator.h"
+#include "TerrainMemoryBudget.h"
+#include "TerrainScheduler.h"
 
 #include "NoiseGenerator.generated.h"
 
+class FTerrainChunkCache;
+class FTerrainHeightStore;
+struct FTerrainRayHit;
+
 USTRUCT()
 struct FChunkProperties
 {
@@ -32,6 +38,79 @@ struct FChunkProperties
 
 	UPROPERTY()
 	UProceduralMeshComponent* WaterMesh = nullptr;
+
+	// Final mesh of current epoch is uploaded
+	bool bFinalMesh = false;
+	// Streamed chunk has a job of current epoch
+	bool bScheduled = false;
+	// Streamed chunk was loaded ahead of the player and has not entered load radius yet
+	bool bPrefetched = false;
+	// Far chunk dropped cooked collision of its terrain to stay within memory budget
+	bool bCollisionDropped = false;
+	// Set when streamed chunk is unloaded, cancels its job
+	TSharedPtr<FThreadSafeCounter, ESPMode::ThreadSafe> UnloadCounter;
+};
+
+// Streamed chunks entering load radius, see ANoiseGenerator::PrefetchSeconds
+USTRUCT(BlueprintType)
+struct FTerrainPrefetchStats
+{
+	GENERATED_BODY()
+
+	// Final mesh was uploaded already
+	UPROPERTY(BlueprintReadOnly)
+	int Hits = 0;
+
+	// Chunk was missing or still generating, the player may see it appear
+	UPROPERTY(BlueprintReadOnly)
+	int Misses = 0;
+
+	// Loaded ahead and unloaded again without entering load radius
+	UPROPERTY(BlueprintReadOnly)
+	int Wasted = 0;
+};
+
+// Copy of generator settings shared by all chunk jobs of one generation epoch, safe to read from any thread.
+// Holds values and thread-safe shared pointers only, never a UObject, so jobs keep everything they read alive.
+struct FTerrainGenerationSettings
+{
+	FastNoiseLite NoiseGen;
+	float NoiseScale = 0.f;
+	int GlobalOffsetX = 0;
+	int GlobalOffsetY = 0;
+
+	bool bApplyMask = false;
+	TSharedPtr<const TArray<float>, ESPMode::ThreadSafe> Mask;
+
+	bool bApplyErosion = false;
+	int ErosionSeed = 0;
+	FErosionSolverPtr ErosionSolver;
+	// Chunks are eroded with a halo of their neighbours in a shared heightfield
+	bool bSeamlessErosion = false;
+	int ErosionHalo = 0;
+	FErosionSolverPtr SeamlessErosionSolver;
+	// Unset when erosion results are not cached
+	TSharedPtr<FErosionCache, ESPMode::ThreadSafe> ErosionCache;
+	// Mesh is uploaded before erosion and refreshed at checkpoints while erosion runs in slices
+	bool bProgressiveErosion = false;
+	int ErosionCheckpoints = 0;
+	int ErosionSliceSize = 0;
+	// Erosion of a chunk runs on task graph, only outside the scheduler whose workers bound CPU use
+	bool bParallelErosion = false;
+
+	// Unset when chunks are not cached
+	TSharedPtr<FTerrainChunkCache, ESPMode::ThreadSafe> ChunkCache;
+	bool bCacheChunkMeshes = false;
+	// Hash of everything final chunks depend on, chunk cache keeps chunks of every hash apart
+	uint64 SettingsHash = 0;
+
+	FRichCurve TerrainHeightCurve;
+	int MapSize = 0;
+	int MapArraySize = 0;
+	int EdgeArraySize = 0;
+	int NoiseArraySize = 0;
+	float VertexSize = 0.f;
+	float HeightMultiplier = 0.f;
 };
 
 UCLASS(BlueprintType, Blueprintable)
@@ -84,18 +163,136 @@ public:
 	UPROPERTY(EditAnywhere, Category="Map settings")
 	UMaterialInstance* WaterMaterial = nullptr;
 
+	// Number of chunk generation threads, 0 uses all cores except one
+	UPROPERTY(EditAnywhere, Category="Generation settings", Meta=(ClampMin=0, ClampMax=64))
+	int GenerationWorkers = 0;
+
+	UPROPERTY(EditAnywhere, Category="Generation settings")
+	FTerrainStageLimits NoiseStageLimits = FTerrainStageLimits(0, 8);
+
+	UPROPERTY(EditAnywhere, Category="Generation settings")
+	FTerrainStageLimits MaskStageLimits = FTerrainStageLimits(0, 8);
+
+	// Erosion holds the most memory per chunk, keep it throttled separately
+	UPROPERTY(EditAnywhere, Category="Generation settings")
+	FTerrainStageLimits ErosionStageLimits = FTerrainStageLimits(0, 4);
+
+	UPROPERTY(EditAnywhere, Category="Generation settings")
+	FTerrainStageLimits MeshStageLimits = FTerrainStageLimits(0, 8);
+
+	// Uploads un-eroded mesh of every chunk first, then refreshes it while erosion runs in time slices
+	UPROPERTY(EditAnywhere, Category="Generation settings")
+	bool bProgressiveErosion = false;
+
+	// Intermediate mesh refreshes while a chunk erodes, evenly spread over its droplets
+	UPROPERTY(EditAnywhere, Category="Generation settings", Meta=(ClampMin=0, ClampMax=16))
+	int ErosionCheckpoints = 2;
+
+	// Droplets simulated before chunk hands its worker over to other chunks
+	UPROPERTY(EditAnywhere, Category="Generation settings", Meta=(ClampMin=256, ClampMax=1000000))
+	int ErosionSliceSize = 8192;
+
+	// Final heights of generated chunks are stored under Saved/ChunkCache and loaded on later runs with equal settings,
+	// those chunks skip noise, mask and erosion. Seamless erosion loads chunks only when all of them are cached.
+	UPROPERTY(EditAnywhere, Category="Generation settings")
+	bool bCacheChunks = false;
+
+	// Terrain vertices and normals are cached along with heights, cached chunks then skip most of mesh stage as well
+	UPROPERTY(EditAnywhere, Category="Generation settings")
+	bool bCacheChunkMeshes = false;
+
+	// Concurrency is a number of uploads per frame
+	UPROPERTY(EditAnywhere, Category="Generation settings")
+	FTerrainStageLimits UploadStageLimits = FTerrainStageLimits(2, 8);
+
+	// Generates chunks around the player without world size limit instead of MapSize x MapSize chunks.
+	// Mask and erosion across chunk borders need the whole world, so they are not applied.
+	UPROPERTY(EditAnywhere, Category="Streaming settings")
+	bool bStreamWorld = false;
+
+	// Chunks at most this many chunks away from the player are generated
+	UPROPERTY(EditAnywhere, Category="Streaming settings", Meta=(ClampMin=0, ClampMax=32))
+	int LoadRadius = 3;
+
+	// Chunks further away are unloaded, at least one more than load radius, so chunks at the edge of load radius
+	// are not reloaded whenever the player moves back and forth
+	UPROPERTY(EditAnywhere, Category="Streaming settings", Meta=(ClampMin=1, ClampMax=33))
+	int UnloadRadius = 5;
+
+	// Chunks started per frame
+	UPROPERTY(EditAnywhere, Category="Streaming settings", Meta=(ClampMin=1, ClampMax=64))
+	int StreamingLoadsPerFrame = 4;
+
+	// Chunks unloaded per frame
+	UPROPERTY(EditAnywhere, Category="Streaming settings", Meta=(ClampMin=1, ClampMax=64))
+	int StreamingUnloadsPerFrame = 8;
+
+	// Chunks without final mesh, no more chunks are started until some of them finish
+	UPROPERTY(EditAnywhere, Category="Streaming settings", Meta=(ClampMin=1, ClampMax=256))
+	int MaxPendingChunks = 16;
+
+	// Chunks within load radius of the path the player travels in this many seconds are generated ahead of time, up
+	// to unload radius. Path follows current velocity turning at current rate, 0 disables prefetch.
+	UPROPERTY(EditAnywhere, Category="Streaming settings", Meta=(ClampMin=0.f, ClampMax=60.f))
+	float PrefetchSeconds = 3.f;
+
+	// Terrain data is kept within this many megabytes by trimming sections of pooled components, dropping collision of
+	// far chunks and unloading streamed chunks beyond load radius, farthest first. New chunks start only while their
+	// buffers fit. 0 only tracks usage.
+	UPROPERTY(EditAnywhere, Category="Memory settings", Meta=(ClampMin=0, ClampMax=65536))
+	int MemoryBudgetMB = 0;
+
 	UFUNCTION(BlueprintCallable)
 	TArray<float> CreateNoiseData(float LocalOffsetX, float LocalOffsetY);
 
+	// Applies new seed, chunks that are still generated with the previous one are cancelled
 	UFUNCTION(BlueprintCallable)
 	void UpdateGenerator();
 
+	// Cancels current generation and generates every chunk again with current settings
+	UFUNCTION(BlueprintCallable)
+	void RegenerateWorld();
+
 	UFUNCTION(BlueprintCallable)
 	TArray<float> CreateMask();
 
 	UFUNCTION(BlueprintCallable)
 	void GenerateTerrain(int TerrainIndex);
 
+	// Bilinear height of final terrain at position in generator space, false until chunk under it gets its final
+	// mesh. Safe on any thread from BeginPlay on, never locks.
+	UFUNCTION(BlueprintCallable)
+	bool GetHeightAt(const FVector2D& Position, float& Height) const;
+
+	// Normal of bilinear terrain surface, see GetHeightAt
+	UFUNCTION(BlueprintCallable)
+	bool GetNormalAt(const FVector2D& Position, FVector& Normal) const;
+
+	// Batched queries, cheaper per position when neighbouring positions are close to each other.
+	// Found marks positions with a result, returns their number.
+	int GetHeightAt(TArrayView<const FVector2D> Positions, TArrayView<float> Heights, TArrayView<bool> Found) const;
+	int GetNormalAt(TArrayView<const FVector2D> Positions, TArrayView<FVector> Normals, TArrayView<bool> Found) const;
+
+	// First point of segment at or below final terrain, without physics. Chunks without final mesh count as empty.
+	// Safe on any thread like GetHeightAt.
+	UFUNCTION(BlueprintCallable)
+	bool LineTraceTerrain(const FVector& Start, const FVector& End, FVector& HitLocation, FVector& HitNormal) const;
+
+	// Batched traces, e.g. line of sight of many agents, returns number of hits
+	int LineTraceTerrain(TArrayView<const FVector> Starts, TArrayView<const FVector> Ends,
+	                     TArrayView<FTerrainRayHit> Hits) const;
+
+	// Counted since BeginPlay while streaming
+	UFUNCTION(BlueprintCallable)
+	FTerrainPrefetchStats GetPrefetchStats() const { return PrefetchStats; }
+
+	// Bytes of terrain data, see MemoryBudgetMB
+	UFUNCTION(BlueprintCallable)
+	void GetMemoryUsage(int64& CurrentBytes, int64& PeakBytes) const;
+
+	// Usage per category and per chunk
+	const FTerrainMemoryBudget& GetMemoryBudget() const { return *MemoryBudget; }
+
 protected:
 	// How many rendered squares per chunk, MapArraySize x MapArraySize
 	int MapArraySize = 256;
@@ -111,7 +308,35 @@ protected:
 private:
 	UPROPERTY()
 	TArray<FChunkProperties> World;
-	TArray<float> Mask;
+	TSharedPtr<const TArray<float>, ESPMode::ThreadSafe> Mask;
+	// Created in BeginPlay when chunks are cached
+	TSharedPtr<FTerrainChunkCache, ESPMode::ThreadSafe> ChunkCache;
+	// Final heights of uploaded chunks for queries, created with the world
+	TSharedPtr<FTerrainHeightStore, ESPMode::ThreadSafe> HeightStore;
+
+	// Registered components of unloaded chunks, hidden with their sections kept until another chunk takes them
+	UPROPERTY()
+	TArray<UProceduralMeshComponent*> TerrainMeshPool;
+	UPROPERTY()
+	TArray<UProceduralMeshComponent*> WaterMeshPool;
+
+	// Streamed chunks by coordinates, indices of unloaded ones are reused
+	TMap<FIntPoint, int> LoadedChunks;
+	TArray<int> FreeChunkIndices;
+	// Chunk the player was in during last streaming update
+	FIntPoint StreamingCenter = FIntPoint(MAX_int32, MAX_int32);
+	// Horizontal movement of the player extrapolated by prefetch, turn rate in radians per second
+	FVector StreamingViewLocation = FVector::ZeroVector;
+	FVector2D StreamingVelocity = FVector2D::ZeroVector;
+	float StreamingTurnRate = 0.f;
+	FTerrainPrefetchStats PrefetchStats;
+	// Streamed chunks unloaded in current frame by streaming and memory budget together
+	int FrameUnloads = 0;
+
+	// Chunks with bCollisionDropped
+	int DroppedCollisionNum = 0;
+	// Tracked chunk memory changed since memory budget was last enforced
+	bool bMemoryChanged = true;
 
 	FastNoiseLite NoiseGen;
 	// Size of square made of 2 triangles
@@ -119,6 +344,70 @@ private:
 	// Multiplier for ThirdPerson module
 	float HeightMultiplier = VertexSize * 10.f;
 
+	// Bounded worker pool generating chunks closest to the player first
+	TSharedPtr<FTerrainScheduler, ESPMode::ThreadSafe> Scheduler;
+	// Incremented whenever started generation becomes outdated, shared with in-flight jobs
+	TSharedRef<FThreadSafeCounter, ESPMode::ThreadSafe> GenerationEpoch = MakeShared<
+		FThreadSafeCounter, ESPMode::ThreadSafe>();
+
+	// Counts terrain data of every category, shared with jobs
+	TSharedRef<FTerrainMemoryBudget, ESPMode::ThreadSafe> MemoryBudget = MakeShared<
+		FTerrainMemoryBudget, ESPMode::ThreadSafe>(0);
+
+	// Shared by jobs of current epoch, streamed chunks get them when they are loaded later
+	TSharedPtr<const FTerrainGenerationSettings, ESPMode::ThreadSafe> EpochSettings;
+	TSharedPtr<FTerrainHeightfield, ESPMode::ThreadSafe> EpochHeightfield;
+
+	// Uploads of current epoch, time to first and final mesh is measured from its start
+	double GenerationStartTime = 0.0;
+	double FirstMeshSeconds = 0.0;
+	int FirstMeshNum = 0;
+	int FinalMeshNum = 0;
+
+	TSharedRef<const FTerrainGenerationSettings, ESPMode::ThreadSafe> CreateGenerationSettings() const;
+	static bool SampleNoise(const FTerrainGenerationSettings& Settings, float LocalOffsetX, float LocalOffsetY,
+	                        TArray<float>& NoiseData, TFunctionRef<bool()> ShouldCancel);
+
+	// Generation stages, see ETerrainStage. Pool stages only use job data and its settings snapshot, which owns
+	// everything it points to, so they outlive the generator safely.
+	static void CreateChunkNoise(FTerrainChunkJob& Job);
+	static void ApplyChunkMask(FTerrainChunkJob& Job);
+	static void ErodeChunk(FTerrainChunkJob& Job);
+	static bool ErodeSeamlessChunk(FTerrainChunkJob& Job, const FErosionSolver& Solver, FErosionContext& Context);
+	static bool ErodeHeights(FTerrainChunkJob& Job, const FErosionSolver& Solver, FErosionContext& Context,
+	                         TArray<float>& HeightMap);
+	static void BuildChunkMesh(FTerrainChunkJob& Job);
+	// Stage gates, chunks of shared heightfield wait for their neighbours
+	static bool CanErodeChunk(const FTerrainChunkJob& Job);
+	static bool CanBuildChunkMesh(const FTerrainChunkJob& Job);
+	void UploadChunk(FTerrainChunkJob& Job);
+	void RecordUpload(const FTerrainChunkJob& Job);
+
 	void UpdateWorld();
+	UProceduralMeshComponent* CreateChunkMesh(const TCHAR* BaseName, bool bTerrain);
+	void AcquireChunkMeshes(FChunkProperties& Chunk);
+	void ReleaseChunkMeshes(FChunkProperties& Chunk);
+	void CreateScheduler();
+	void ScheduleGeneration(const FVector& SpawnLocation);
+	FVector2D GetChunkCenter(const FIntPoint& Coordinates) const;
+	FTerrainChunkJobPtr CreateChunkJob(int ChunkIndex, float Priority) const;
+	int64 GetChunkJobBytes() const;
+
+	// Memory budget, see MemoryBudgetMB
+	void TrackChunkMemory(const FChunkProperties& Chunk);
+	bool SetChunkCollision(FChunkProperties& Chunk, bool bEnable);
+	void UpdateSharedMemory();
+	void EnforceMemoryBudget(const FVector& ViewLocation);
+
+	// Streaming, see bStreamWorld
+	int GetUnloadRadius() const { return FMath::Max(UnloadRadius, LoadRadius + 1); }
+	void UpdateMovement(const FVector& ViewLocation, const APawn* Pawn, float DeltaSeconds);
+	void PredictPath(const FVector& ViewLocation, TArray<TPair<FVector2D, float>>& Path) const;
+	void UpdateStreaming(const FVector& ViewLocation);
+	int LoadChunk(const FIntPoint& Coordinates);
+	void UnloadChunk(int ChunkIndex);
+
 	virtual void BeginPlay() override;
+	virtual void EndPlay(const EEndPlayReason::Type EndPlayReason) override;
+	virtual void Tick(float DeltaSeconds) override;
 };
@@ -0,0 +1,63 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "HAL/ThreadSafeCounter.h"
+
+/* Final chunks stored on disk, one directory per hash of generation settings and one file per chunk in it.
+ * Chunk generated once is loaded on later runs with equal settings instead of going through noise, mask and erosion.
+ * Terrain vertices and normals can be stored along with heights, chunk then skips most of mesh stage as well.
+ * Every file carries format version, settings hash, chunk and checksum of its contents, files that do not match are
+ * deleted on load. Files are memory mapped where the platform supports it.
+ * Directories of settings used least recently are deleted on construction, only a few most recent ones are kept.
+ * Load and Store can be called from any thread.
+ */
+class PROCEDURALWORLD_API FTerrainChunkCache
+{
+public:
+	explicit FTerrainChunkCache(const FString& InDirectory);
+
+	// File exists, it may still turn out invalid on load
+	bool Contains(uint64 SettingsHash, const FIntPoint& Chunk) const;
+
+	// Fills heights of HeightNum samples, returns false when there is no valid entry of equal size. Vertices and
+	// normals are filled when entry has VertexNum of them, they are emptied otherwise.
+	bool Load(uint64 SettingsHash, const FIntPoint& Chunk, int HeightNum, int VertexNum, TArray<float>& Heights,
+	          TArray<FVector>& Vertices, TArray<FVector>& Normals);
+	// Vertices and normals are optional, pass empty arrays to store heights only
+	void Store(uint64 SettingsHash, const FIntPoint& Chunk, const TArray<float>& Heights,
+	           const TArray<FVector>& Vertices, const TArray<FVector>& Normals);
+
+	void LogStats() const;
+
+	// Settings directories kept on construction
+	static constexpr int MaxSettingsNum = 4;
+
+private:
+	// Written in front of heights, vertices and normals, native byte order
+	struct FHeader
+	{
+		uint32 Magic = 0;
+		uint32 Version = 0;
+		uint64 SettingsHash = 0;
+		int32 ChunkX = 0;
+		int32 ChunkY = 0;
+		int32 HeightNum = 0;
+		int32 VertexNum = 0;
+		uint64 Checksum = 0;
+	};
+
+	FString GetSettingsDirectory(uint64 SettingsHash) const;
+	FString GetPath(uint64 SettingsHash, const FIntPoint& Chunk) const;
+	// Copies file contents when they match, false otherwise
+	static bool ReadEntry(const uint8* Data, int64 Size, uint64 SettingsHash, const FIntPoint& Chunk, int HeightNum,
+	                      int VertexNum, TArray<float>& Heights, TArray<FVector>& Vertices, TArray<FVector>& Normals);
+
+	FString Directory;
+
+	FThreadSafeCounter Hits;
+	FThreadSafeCounter Misses;
+	FThreadSafeCounter Rejected;
+	FThreadSafeCounter Stored;
+};
@@ -0,0 +1,151 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "HAL/ThreadSafeCounter.h"
+#include "HAL/ThreadSafeCounter64.h"
+
+// Result of a segment traced against terrain
+struct FTerrainRayHit
+{
+	bool bHit = false;
+	// Segment crossed chunks without final heights, those are treated as empty
+	bool bIncomplete = false;
+	// Fraction of segment from start to hit, 1 without hit
+	float Time = 1.f;
+	FVector Location = FVector::ZeroVector;
+	FVector Normal = FVector::ZeroVector;
+};
+
+/* Final height planes of chunks in a square window of the world, sampled bilinearly at world positions.
+ * Every chunk of the window has its own slot, slots wrap around the window, so chunks keep their slot while the
+ * window moves and a slot is reused by a chunk entering the window on the opposite side.
+ * Planes are written on game thread only and read from any thread without locks. Every slot has a version that is
+ * odd while its plane is written, readers check it before and after sampling and sample again when it changed.
+ * Plane memory is allocated once per slot and never moves, so readers never touch freed memory.
+ * Every chunk also keeps a min/max pyramid of its squares, traces skip cells of the pyramid the segment passes above
+ * and intersect bilinear squares exactly only where the segment reaches below their highest corner.
+ */
+class PROCEDURALWORLD_API FTerrainHeightStore
+{
+public:
+	// Window of WindowSize x WindowSize chunks starting at chunk 0, 0. ChunkStride is distance between chunk origins in
+	// vertices and plane of every chunk starts one vertex before its origin.
+	FTerrainHeightStore(int InWindowSize, int InChunkStride, int InPlaneSize, float InVertexSize);
+
+	// Moves window to start at chunk WindowMin, game thread only. Chunks outside of it are no longer found.
+	void SetWindow(const FIntPoint& WindowMin);
+	FIntPoint GetWindow() const;
+
+	// Min/max pyramid of a plane, any thread. Level L covers 2^L x 2^L squares, levels below PyramidFirstLevel are
+	// read from the plane directly.
+	static void BuildPyramid(const TArray<float>& Heights, int ChunkStride, int PlaneSize,
+	                         TArray<FFloatInterval>& Pyramid);
+
+	// Replaces chunk plane and its pyramid, game thread only. Chunks outside of the window are ignored.
+	void SetHeights(const FIntPoint& Chunk, const TArray<float>& Heights, const TArray<FFloatInterval>& Pyramid);
+	// Chunk is no longer found, its slot keeps the memory for the next chunk
+	void RemoveHeights(const FIntPoint& Chunk);
+
+	// Memory of every slot that got a plane, game thread only
+	SIZE_T GetAllocatedSize() const;
+
+	// Return false where chunk has no plane yet or position is outside of the window
+	bool GetHeightAt(const FVector2D& Position, float& Height) const;
+	bool GetNormalAt(const FVector2D& Position, FVector& Normal) const;
+
+	// Positions of one chunk in a row share a version check, returns number of positions found
+	int GetHeightsAt(TArrayView<const FVector2D> Positions, TArrayView<float> Heights, TArrayView<bool> Found) const;
+	int GetNormalsAt(TArrayView<const FVector2D> Positions, TArrayView<FVector> Normals,
+	                 TArrayView<bool> Found) const;
+
+	// First point of segment at or below terrain, returns true on hit
+	bool LineTrace(const FVector& Start, const FVector& End, FTerrainRayHit& Hit) const;
+	// Returns number of hits
+	int LineTrace(TArrayView<const FVector> Starts, TArrayView<const FVector> Ends,
+	              TArrayView<FTerrainRayHit> Hits) const;
+
+	// 4 x 4 squares, smaller cells are cheaper to read from plane than to store
+	static constexpr int PyramidFirstLevel = 2;
+
+private:
+	struct FSlot
+	{
+		// Zero until the first plane, odd while plane is written
+		FThreadSafeCounter Version;
+		// Chunk the plane belongs to, written under version like the plane
+		FIntPoint Chunk = FIntPoint(MAX_int32, MAX_int32);
+		TArray<float> Heights;
+		TArray<FFloatInterval> Pyramid;
+	};
+
+	// Vertex square under a position
+	struct FSquare
+	{
+		int Slot = INDEX_NONE;
+		FIntPoint Chunk = FIntPoint::ZeroValue;
+		int Index = 0;
+		float OffsetX = 0.f;
+		float OffsetY = 0.f;
+	};
+
+	// Heights of square corners, north-west, north-east, south-west and south-east
+	using FCorners = float[4];
+
+	int GetSlot(const FIntPoint& Chunk) const;
+	bool IsInWindow(const FIntPoint& Chunk, const FIntPoint& WindowMin) const;
+	bool FindSquare(const FVector2D& Position, const FIntPoint& WindowMin, FSquare& Square) const;
+
+	// Calls Sample(PositionIndex, Square, Corners) for every position found
+	template <typename TSample>
+	int SampleSquares(TArrayView<const FVector2D> Positions, TArrayView<bool> Found, TSample&& Sample) const;
+
+	float SampleHeight(const FSquare& Square, const FCorners& Corners) const;
+	FVector SampleNormal(const FSquare& Square, const FCorners& Corners) const;
+
+	// Segment in squares of the world and height units, parameter runs from 0 at start to 1 at end
+	struct FRay
+	{
+		double U = 0.0;
+		double V = 0.0;
+		double Z = 0.0;
+		double DirectionU = 0.0;
+		double DirectionV = 0.0;
+		double DirectionZ = 0.0;
+	};
+
+	enum class ETraceResult : uint8
+	{
+		Hit,
+		LeftChunk,
+		Finished
+	};
+
+	// Index of the first cell of a pyramid level, also number of cells below it
+	static int GetPyramidOffset(int ChunkStride, int Level);
+	// Range of plane vertices of a cell, for levels below PyramidFirstLevel
+	static FFloatInterval GetPlaneRange(const float* Heights, int PlaneSize, int Level, const FIntPoint& Cell);
+
+	// Parameter where ray leaves cell of Square at Level, capped at End. Next is the square it enters.
+	static double ExitCell(const FRay& Ray, const FIntPoint& Square, int Level, double End, FIntPoint& Next);
+
+	// Walks the pyramid of one chunk from Square at Time, both are moved to the hit or to the next chunk
+	ETraceResult TraceChunk(const FRay& Ray, const FSlot& Slot, const FIntPoint& Chunk, double End, double& Time,
+	                        FIntPoint& Square) const;
+	// First parameter in [Time, Exit] where ray is at or below bilinear square, local to chunk
+	bool IntersectSquare(const FRay& Ray, const float* Heights, const FIntPoint& Square, const FIntPoint& Local,
+	                     double Time, double Exit, double& HitTime) const;
+
+	// Never resized after construction
+	TArray<FSlot> Slots;
+	int WindowSize = 0;
+	// Packed chunk coordinates of window start, read by any thread
+	FThreadSafeCounter64 Window;
+	int ChunkStride = 0;
+	int PlaneSize = 0;
+	float VertexSize = 0.f;
+	// Pyramid level of a whole chunk
+	int TopLevel = 0;
+	int PyramidNum = 0;
+};
@@ -0,0 +1,76 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "HAL/ThreadSafeCounter.h"
+#include "HAL/ThreadSafeCounter64.h"
+
+/* Height planes of every chunk of one generation epoch, lets erosion run across chunk borders.
+ * Planes of neighbouring chunks overlap by their border, writes go to every plane containing a sample, so
+ * overlapping samples never diverge. Chunks are coloured like a 2x2 checkerboard, a chunk erodes after its
+ * neighbours of lower colour and before the ones of higher colour, so neighbours never erode at the same time
+ * and the result does not depend on timing.
+ * Planes are not locked, callers have to wait for IsErosionReady and IsMeshReady before touching them.
+ */
+class PROCEDURALWORLD_API FTerrainHeightfield
+{
+public:
+	// ChunkStride is distance between chunk origins, plane of every chunk starts one sample before its origin
+	FTerrainHeightfield(int ChunkStride, int PlaneSize);
+
+	// Registers chunk of the epoch, game thread only and before any job starts
+	void AddChunk(const FIntPoint& Chunk);
+
+	// Hands over heights of finished mask stage
+	void SetHeights(const FIntPoint& Chunk, TArray<float>&& Heights);
+
+	// Every neighbour has heights and neighbours of lower colour are eroded
+	bool IsErosionReady(const FIntPoint& Chunk) const;
+	// Chunk and its neighbours are eroded, nobody modifies chunk plane anymore
+	bool IsMeshReady(const FIntPoint& Chunk) const;
+
+	// Copies chunk plane extended by Margin on every side, samples outside the world are clamped to its edge
+	void Gather(const FIntPoint& Chunk, int Margin, TArray<float>& Window) const;
+	// Writes window created by Gather back to every plane it overlaps
+	void Scatter(const FIntPoint& Chunk, int Margin, const TArray<float>& Window);
+	// Part of the window created by Gather covered by the world, inclusive
+	FIntRect GetWorldArea(const FIntPoint& Chunk, int Margin) const;
+
+	void MarkEroded(const FIntPoint& Chunk);
+	// Releases planes that are no longer read by any chunk
+	void MarkMeshed(const FIntPoint& Chunk);
+
+	// Planes that are not released yet, any thread
+	int64 GetAllocatedSize() const { return AllocatedSize.GetValue(); }
+
+private:
+	enum EProgress
+	{
+		HeightsReady = 1,
+		Eroded,
+		Meshed
+	};
+
+	struct FCell
+	{
+		TArray<float> Heights;
+		// Last finished step, see EProgress
+		FThreadSafeCounter Progress;
+		FThreadSafeCounter Released;
+	};
+
+	// Neighbours of chunk with chunk itself in the centre, missing chunks are null
+	using FNeighbourhood = FCell* [3][3];
+
+	void GetNeighbourhood(const FIntPoint& Chunk, FNeighbourhood& Neighbourhood) const;
+	bool IsNeighbourhoodMeshed(const FIntPoint& Chunk) const;
+	static int GetColour(const FIntPoint& Chunk) { return (Chunk.X & 1) + 2 * (Chunk.Y & 1); }
+
+	TMap<FIntPoint, TUniquePtr<FCell>> Cells;
+	FIntPoint MinChunk = FIntPoint(MAX_int32, MAX_int32);
+	FIntPoint MaxChunk = FIntPoint(MIN_int32, MIN_int32);
+	int ChunkStride = 0;
+	int PlaneSize = 0;
+	FThreadSafeCounter64 AllocatedSize;
+};
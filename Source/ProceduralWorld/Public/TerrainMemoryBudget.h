@@ -0,0 +1,96 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "TerrainMemoryBudget.generated.h"
+
+// Terrain data counted by memory budget
+UENUM()
+enum class ETerrainMemory : uint8
+{
+	// Global mask of fixed size world
+	Mask,
+	// Brushes, layouts and blur weights of current erosion solvers
+	ErosionTables,
+	// Shared planes of seamless erosion
+	Heightfield,
+	// Noise, heights and mesh buffers of chunks in generation
+	JobBuffers,
+	// Final heights and pyramids of height queries
+	HeightStore,
+	// Mesh sections of loaded chunks
+	Meshes,
+	// Cooked collision of loaded chunks, estimated from their triangles
+	Collision,
+	// Sections kept by pooled components of unloaded chunks
+	MeshPool,
+	Num UMETA(Hidden)
+};
+
+/* Bytes of terrain data per category and per chunk, with current and peak usage of the total and of every category.
+ * Budget only counts, owners of the data free some of it when the total goes over the limit.
+ * Can be used from any thread.
+ */
+class PROCEDURALWORLD_API FTerrainMemoryBudget
+{
+public:
+	// Limit of 0 is never exceeded
+	explicit FTerrainMemoryBudget(int64 InLimit);
+
+	void SetLimit(int64 InLimit);
+	int64 GetLimit() const;
+
+	// Data owned by a chunk, bytes of a chunk are the sum of its categories
+	void AddChunkBytes(ETerrainMemory Category, const FIntPoint& Chunk, int64 Delta);
+	void SetChunkBytes(ETerrainMemory Category, const FIntPoint& Chunk, int64 Bytes);
+	int64 GetChunkBytes(const FIntPoint& Chunk) const;
+
+	// Data not owned by any chunk, replaces previous value of the category
+	void SetSharedBytes(ETerrainMemory Category, int64 Bytes);
+
+	int64 GetUsed() const;
+	int64 GetPeak() const;
+	int64 GetUsed(ETerrainMemory Category) const;
+	int64 GetPeak(ETerrainMemory Category) const;
+
+	// Bytes over limit, 0 under it
+	int64 GetExcess() const;
+	// Additional bytes stay within limit
+	bool CanAllocate(int64 Bytes) const;
+
+	// Current usage to memory stats of ProceduralWorld group
+	void PublishStats() const;
+	void LogStats() const;
+
+private:
+	struct FUsage
+	{
+		int64 Used = 0;
+		int64 Peak = 0;
+
+		void Add(int64 Delta)
+		{
+			Used += Delta;
+			Peak = FMath::Max(Peak, Used);
+		}
+	};
+
+	struct FChunkUsage
+	{
+		int64 Bytes[static_cast<int>(ETerrainMemory::Num)] = {};
+		int64 Total = 0;
+	};
+
+	// Caller holds the lock
+	void Add(ETerrainMemory Category, int64 Delta);
+
+	mutable FCriticalSection Lock;
+	int64 Limit = 0;
+	FUsage Total;
+	FUsage Categories[static_cast<int>(ETerrainMemory::Num)];
+	// Shared bytes of every category
+	int64 SharedBytes[static_cast<int>(ETerrainMemory::Num)] = {};
+	// Chunks without any bytes are removed
+	TMap<FIntPoint, FChunkUsage> Chunks;
+};
@@ -0,0 +1,196 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Containers/Ticker.h"
+#include "HAL/ThreadSafeCounter.h"
+#include "TerrainScheduler.generated.h"
+
+class FQueuedThreadPool;
+class FTerrainHeightfield;
+class FTerrainMemoryBudget;
+struct FErosionContext;
+struct FTerrainGenerationSettings;
+
+// Steps every chunk goes through, in order
+UENUM()
+enum class ETerrainStage : uint8
+{
+	Noise,
+	Mask,
+	Erosion,
+	Mesh,
+	// Runs on game thread
+	Upload,
+	Num UMETA(Hidden)
+};
+
+USTRUCT()
+struct FTerrainStageLimits
+{
+	GENERATED_BODY()
+
+	FTerrainStageLimits()
+	{
+	}
+
+	FTerrainStageLimits(int InMaxConcurrency, int InQueueCapacity) : MaxConcurrency(InMaxConcurrency),
+	                                                                 QueueCapacity(InQueueCapacity)
+	{
+	}
+
+	// Chunks processed by this stage at once, 0 is limited only by worker count. Per frame for upload stage.
+	UPROPERTY(EditAnywhere, Meta=(ClampMin=0, ClampMax=64))
+	int MaxConcurrency = 0;
+
+	// Chunks allowed to wait for this stage, previous stage stalls when it is full
+	UPROPERTY(EditAnywhere, Meta=(ClampMin=1, ClampMax=1024))
+	int QueueCapacity = 8;
+};
+
+// Data of a single chunk travelling through the pipeline, owned by one stage at a time
+struct PROCEDURALWORLD_API FTerrainChunkJob
+{
+	FTerrainChunkJob() = default;
+	FTerrainChunkJob(const FTerrainChunkJob&) = delete;
+	FTerrainChunkJob& operator=(const FTerrainChunkJob&) = delete;
+	// Gives tracked bytes back to memory budget
+	~FTerrainChunkJob();
+
+	int ChunkIndex = 0;
+	FIntPoint ChunkCoordinates = FIntPoint::ZeroValue;
+	// Lower value is generated first
+	float Priority = 0.f;
+	ETerrainStage Stage = ETerrainStage::Noise;
+	// Set by stage work to send the job to another stage than the following one, upload stage included
+	TOptional<ETerrainStage> NextStage;
+
+	// Generation epoch the job was created in, job is stale once the counter moves on
+	int32 Epoch = 0;
+	TSharedPtr<const FThreadSafeCounter, ESPMode::ThreadSafe> EpochCounter;
+	// Non-zero once streamed chunk is unloaded, job is stale then as well
+	TSharedPtr<const FThreadSafeCounter, ESPMode::ThreadSafe> UnloadCounter;
+	TSharedPtr<const FTerrainGenerationSettings, ESPMode::ThreadSafe> Settings;
+	// Shared by chunks of the epoch when they are eroded together with their neighbours
+	TSharedPtr<FTerrainHeightfield, ESPMode::ThreadSafe> Heightfield;
+
+	// Erosion progress kept between time slices of progressive erosion
+	TSharedPtr<FErosionContext, ESPMode::ThreadSafe> ErosionContext;
+	// Erosion cache key of heights before the first slice, 0 until erosion starts
+	uint64 ErosionCacheKey = 0;
+	// Mesh stage output is the final one, progressive erosion uploads intermediate meshes first
+	bool bFinalMesh = true;
+	// Final heights were loaded from chunk cache, terrain vertices and normals too when they are filled
+	bool bCachedHeights = false;
+	// Meshes uploaded so far, later uploads only update vertices of the first one
+	int MeshUploads = 0;
+
+	// Raw noise samples, released after mask stage
+	TArray<float> NoiseData;
+	// Row-major terrain heights with border, released once final mesh is uploaded. Kept by Heightfield between mask
+	// and mesh.
+	TArray<float> Heights;
+	// Min/max pyramid of final heights for terrain traces, built by mesh stage
+	TArray<FFloatInterval> HeightPyramid;
+
+	// Mesh buffers for upload
+	TArray<FVector> TrueVertices;
+	TArray<FVector> TrueNormals;
+	TArray<FVector> WaterVertices;
+	TArray<FVector> WaterNormals;
+	TArray<FVector2D> UV;
+	TArray<int32> Triangles;
+
+	// Job buffers are counted here from the first stage until the job is destroyed
+	TSharedPtr<FTerrainMemoryBudget, ESPMode::ThreadSafe> MemoryBudget;
+	// Bytes counted at least, buffers grow to about this size at some stage
+	int64 MemoryEstimate = 0;
+	int64 TrackedBytes = 0;
+
+	// Counts current buffers in memory budget, only while no stage works on the job. Without the estimate only buffers
+	// held right now are counted.
+	void TrackMemory(bool bIncludeEstimate = true);
+
+	// Cancellation checkpoint for stage work
+	bool IsStale() const
+	{
+		return (EpochCounter.IsValid() && EpochCounter->GetValue() != Epoch) ||
+			(UnloadCounter.IsValid() && UnloadCounter->GetValue());
+	}
+};
+
+using FTerrainChunkJobPtr = TSharedPtr<FTerrainChunkJob, ESPMode::ThreadSafe>;
+
+// Runs chunks through generation stages on a bounded pool of worker threads, nearest chunks first.
+// Stages are connected with bounded queues, so different chunks occupy different stages at the same time.
+class PROCEDURALWORLD_API FTerrainScheduler : public TSharedFromThis<FTerrainScheduler, ESPMode::ThreadSafe>
+{
+public:
+	// Work executed for a chunk in a given stage
+	using FStageWork = TFunction<void(FTerrainChunkJob& Job)>;
+	// Tells whether chunk can enter a stage, evaluated on game thread whenever any chunk finishes a stage
+	using FStageGate = TFunction<bool(const FTerrainChunkJob& Job)>;
+	// Tells whether the most urgent chunk of the first stage can start, evaluated on game thread before every start
+	using FAdmission = TFunction<bool(const FTerrainChunkJob& Job)>;
+
+	// WorkerCount of 0 picks a count based on available cores
+	explicit FTerrainScheduler(int WorkerCount);
+	~FTerrainScheduler();
+
+	// Upload stage work is executed on game thread, the rest on pool threads
+	void SetStage(ETerrainStage Stage, const FTerrainStageLimits& Limits, FStageWork Work);
+
+	// Chunks waiting for the gate do not count towards queue capacity, so they never stall previous stages
+	void SetStageGate(ETerrainStage Stage, FStageGate Gate);
+
+	// Chunks that were not admitted stay queued, call Dispatch once admission may change. Once nothing else can run,
+	// the most urgent chunk is started regardless, gated chunks may be waiting for it.
+	void SetAdmission(FAdmission InAdmission);
+
+	// Adds chunk to the first stage queue, call Dispatch to start it
+	void Enqueue(const FTerrainChunkJobPtr& Job);
+
+	// Moves chunks between stages and hands them to idle workers, game thread only
+	void Dispatch();
+
+	// Removes queued jobs of outdated epochs, running ones are dropped once they reach a checkpoint
+	void DropStaleJobs();
+
+	int GetWorkerCount() const { return WorkerCount; }
+	bool IsIdle() const;
+	void LogStageTimings() const;
+
+private:
+	struct FStage
+	{
+		FTerrainStageLimits Limits;
+		FStageWork Work;
+		FStageGate Gate;
+		// Binary heap ordered by chunk priority
+		TArray<FTerrainChunkJobPtr> Queue;
+		// Chunks waiting for the gate
+		TArray<FTerrainChunkJobPtr> Blocked;
+		int InFlight = 0;
+
+		// Timing of finished chunks
+		int Completed = 0;
+		double TotalSeconds = 0.0;
+		double MaxSeconds = 0.0;
+	};
+
+	bool CanStart(int StageIndex) const;
+	bool IsStalled() const;
+	void UnblockJobs();
+	void StartOnPool(int StageIndex, const FTerrainChunkJobPtr& Job);
+	void OnStageCompleted(int StageIndex, const FTerrainChunkJobPtr& Job, double Seconds);
+	bool Tick(float DeltaTime);
+
+	FQueuedThreadPool* Pool = nullptr;
+	FStage Stages[static_cast<int>(ETerrainStage::Num)];
+	FAdmission Admission;
+	FDelegateHandle TickerHandle;
+	int WorkerCount = 0;
+	int ActiveWorkers = 0;
+	int DroppedJobs = 0;
+};